@@ -23,6 +23,7 @@
 #include <linux/spi/spi.h>
 #include <linux/mmc/host.h>
 #include <linux/android_pmem.h>
+#include <linux/cma.h>
 #include <linux/usb/android_composite.h>
 
 #include <mach/hardware.h>
@@ -96,7 +97,13 @@
 #define PMEM_GPU_SIZE       SZ_64M
 #define PMEM_UI_SIZE        SZ_32M
 #define PMEM_VPU_SIZE       SZ_64M
+#ifdef CONFIG_CMA
+/* lent to the page allocator while the camera is closed */
+#define PMEM_CAM_CMA
+#define PMEM_CAM_SIZE       ALIGN(PMEM_CAM_NECESSARY, CMA_ALIGN)
+#else
 #define PMEM_CAM_SIZE       PMEM_CAM_NECESSARY
+#endif
 #ifdef CONFIG_VIDEO_RK29_WORK_IPP
 #define MEM_CAMIPP_SIZE     SZ_4M
 #else
@@ -115,10 +122,18 @@
 #endif
 #define PMEM_UI_BASE        (PMEM_GPU_BASE - PMEM_UI_SIZE)
 #define PMEM_VPU_BASE       (PMEM_UI_BASE - PMEM_VPU_SIZE)
+#ifdef PMEM_CAM_CMA
+/* the camera pmem is the top of the memory given to the kernel */
+#define MEM_CAMIPP_BASE     (PMEM_VPU_BASE - MEM_CAMIPP_SIZE)
+#define MEM_FB_BASE         (MEM_CAMIPP_BASE - MEM_FB_SIZE)
+#define MEM_FBIPP_BASE      (MEM_FB_BASE - MEM_FBIPP_SIZE)
+#define PMEM_CAM_BASE       ((MEM_FBIPP_BASE - PMEM_CAM_SIZE) & ~(CMA_ALIGN - 1))
+#else
 #define PMEM_CAM_BASE       (PMEM_VPU_BASE - PMEM_CAM_SIZE)
 #define MEM_CAMIPP_BASE     (PMEM_CAM_BASE - MEM_CAMIPP_SIZE)
 #define MEM_FB_BASE         (MEM_CAMIPP_BASE - MEM_FB_SIZE)
 #define MEM_FBIPP_BASE      (MEM_FB_BASE - MEM_FBIPP_SIZE)
+#endif
 #define LINUX_SIZE          (MEM_FBIPP_BASE - RK29_SDRAM_PHYS)
 
 #define PREALLOC_WLAN_SEC_NUM           4
@@ -1818,6 +1833,9 @@ static void __init machine_rk29_mapio(void)
 	rk29_clock_init(periph_pll_default);
 	rk29_iomux_init();
     ddr_init(DDR_TYPE,DDR_FREQ);  // DDR3_1333H, 400
+#ifdef PMEM_CAM_CMA
+	cma_declare(PMEM_CAM_BASE, PMEM_CAM_SIZE);
+#endif
 }
 
 MACHINE_START(RK29, "RK29board")
@@ -0,0 +1,178 @@
+/*
+ * drivers/block/zram-bench.c
+ *
+ * Swap-in latency benchmark for zram. At load time it writes 'pages'
+ * pages of swap-like data to each of the block devices in 'devs', then
+ * reads them back one page at a time in random order, the way swap-in
+ * faults do, and prints the average and worst read latency per device.
+ * Giving it a zram device and a NAND partition compares the two, e.g.
+ *
+ *	insmod zram-bench.ko devs=/dev/block/zram0,/dev/block/mtdblock7
+ *
+ * The devices are opened exclusively, so active swap is refused, but
+ * whatever else they hold is overwritten: only name scratch partitions.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/random.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#define ZRAM_BENCH_MAX_DEVS	4
+
+static char *devs[ZRAM_BENCH_MAX_DEVS];
+static int nr_devs;
+module_param_array(devs, charp, &nr_devs, 0444);
+MODULE_PARM_DESC(devs, "block devices to compare, comma separated");
+
+static unsigned int pages = 4096;
+module_param(pages, uint, 0444);
+MODULE_PARM_DESC(pages, "pages written, then read back, per device");
+
+struct zram_bench_io {
+	struct completion done;
+	int err;
+};
+
+static void zram_bench_end_io(struct bio *bio, int err)
+{
+	struct zram_bench_io *io = bio->bi_private;
+
+	if (!err && !bio_flagged(bio, BIO_UPTODATE))
+		err = -EIO;
+	io->err = err;
+	complete(&io->done);
+}
+
+/* Reads or writes page 'index' of 'bdev' and waits for it, like swap does */
+static int zram_bench_io(struct block_device *bdev, int rw,
+			 struct page *page, unsigned int index)
+{
+	struct zram_bench_io io;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+	bio->bi_bdev = bdev;
+	bio->bi_sector = (sector_t)index << (PAGE_SHIFT - 9);
+	bio->bi_end_io = zram_bench_end_io;
+	bio->bi_private = &io;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EINVAL;
+	}
+
+	init_completion(&io.done);
+	io.err = 0;
+	submit_bio(rw, bio);
+	wait_for_completion(&io.done);
+	bio_put(bio);
+	return io.err;
+}
+
+/*
+ * Anonymous memory typically compresses to about a third of its size:
+ * a random quarter page followed by a repeating pattern comes close.
+ */
+static void zram_bench_fill(struct page *page, unsigned int index)
+{
+	u32 *p = kmap(page);
+	unsigned int i, n = PAGE_SIZE / sizeof(*p);
+
+	for (i = 0; i < n / 4; i++)
+		p[i] = random32();
+	for (; i < n; i++)
+		p[i] = index + (i & 15);
+	kunmap(page);
+}
+
+static int zram_bench_dev(const char *path, struct page *page)
+{
+	struct block_device *bdev;
+	s64 us, max_us = 0, total_us = 0;
+	unsigned int i, nr = pages;
+	ktime_t start;
+	int err = 0;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE,
+				   zram_bench_dev);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+	if (i_size_read(bdev->bd_inode) >> PAGE_SHIFT < nr)
+		nr = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!nr) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	for (i = 0; i < nr && !err; i++) {
+		zram_bench_fill(page, i);
+		err = zram_bench_io(bdev, WRITE_SYNC, page, i);
+		cond_resched();
+	}
+
+	for (i = 0; i < nr && !err; i++) {
+		start = ktime_get();
+		err = zram_bench_io(bdev, READ_SYNC, page, random32() % nr);
+		us = ktime_us_delta(ktime_get(), start);
+		if (us > max_us)
+			max_us = us;
+		total_us += us;
+		cond_resched();
+	}
+
+	if (!err)
+		printk(KERN_INFO "zram_bench: %s: %u page reads, avg %llu "
+		       "max %lld us\n", path, nr, div_u64(total_us, nr),
+		       max_us);
+out:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+	return err;
+}
+
+static int __init zram_bench_init(void)
+{
+	struct page *page;
+	int i, err;
+
+	if (!nr_devs || !pages)
+		return -EINVAL;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_devs; i++) {
+		err = zram_bench_dev(devs[i], page);
+		if (err)
+			printk(KERN_ERR "zram_bench: %s: failed, %d\n",
+			       devs[i], err);
+	}
+
+	__free_page(page);
+	return 0;
+}
+
+static void __exit zram_bench_exit(void)
+{
+}
+
+module_init(zram_bench_init);
+module_exit(zram_bench_exit);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,642 @@
+/*
+ * Compressed RAM block device, meant to be used as swap.
+ *
+ * Pages written to the device are LZO compressed and kept in RAM, packed
+ * by size class so that many small objects share one page. Modeled on
+ * drivers/block/brd.c.
+ *
+ * This code is released under the GPL version 2.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/buffer_head.h> /* invalidate_bh_lrus() */
+
+#define SECTOR_SHIFT		9
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
+
+/*
+ * Compressed objects are stored in pages split into equal slots. Slot
+ * sizes are multiples of ZRAM_CLASS_DELTA; a class is widened to the
+ * largest size that still gives the same number of slots per page. A page
+ * that compresses to more than ZRAM_MAX_COMPRESSED would take a whole page
+ * anyway, so it is stored as it is, in a class of their own with one slot
+ * per page, and reads of it skip decompression.
+ */
+#define ZRAM_CLASS_SHIFT	5
+#define ZRAM_CLASS_DELTA	(1 << ZRAM_CLASS_SHIFT)
+#define ZRAM_NR_CLASSES		((PAGE_SIZE >> ZRAM_CLASS_SHIFT) + 1)
+#define ZRAM_MAX_SLOTS		(PAGE_SIZE >> ZRAM_CLASS_SHIFT)
+#define ZRAM_MAX_COMPRESSED	(PAGE_SIZE / 2)
+
+struct zram_zpage {
+	struct list_head	list;	/* on its class's partial list */
+	struct page		*page;
+	unsigned short		class;
+	unsigned short		inuse;
+	unsigned long		used[BITS_TO_LONGS(ZRAM_MAX_SLOTS)];
+};
+
+/* What is stored for each PAGE_SIZE block of the device */
+struct zram_entry {
+	struct zram_zpage	*zpage;	/* NULL if nothing is stored */
+	unsigned short		len;	/* compressed length */
+	unsigned char		slot;
+	unsigned char		flags;
+};
+
+#define ZRAM_ZERO		0x01	/* block is all zeroes, not stored */
+
+struct zram_stats {
+	u64		compr_size;	/* bytes of compressed data */
+	u32		pages_stored;	/* blocks held in slots */
+	u32		pages_zero;	/* all-zero blocks */
+	u32		pages_used;	/* pages backing the slots */
+	u32		notify_free;	/* slots freed by swap notification */
+	atomic_t	num_reads;
+	atomic_t	num_writes;
+	atomic_t	failed_reads;
+	atomic_t	failed_writes;
+	atomic_t	invalid_io;
+};
+
+struct zram {
+	int			number;
+	struct request_queue	*queue;
+	struct gendisk		*disk;
+	struct list_head	list;
+
+	/*
+	 * lock protects the table, the slot pages and the stats that are
+	 * not atomic. Readers decompress with it held shared; the swap free
+	 * notification takes it from atomic context.
+	 */
+	rwlock_t		lock;
+	struct zram_entry	*table;
+	unsigned long		nr_pages;
+	struct list_head	partial[ZRAM_NR_CLASSES];
+
+	/* Serialises writers, which share the compression buffers */
+	struct mutex		write_mutex;
+	void			*wrkmem;
+	unsigned char		*cbuf;
+
+	struct zram_stats	stats;
+};
+
+static int zram_class(int len)
+{
+	int objs;
+
+	if (len > ZRAM_MAX_COMPRESSED)
+		return ZRAM_NR_CLASSES - 1;
+
+	len = ALIGN(len, ZRAM_CLASS_DELTA);
+	objs = PAGE_SIZE / len;
+	return (PAGE_SIZE / objs) >> ZRAM_CLASS_SHIFT;
+}
+
+static int zram_class_slots(int class)
+{
+	return PAGE_SIZE / (class << ZRAM_CLASS_SHIFT);
+}
+
+static void zram_free_zpage(struct zram *zram, struct zram_zpage *zpage)
+{
+	list_del(&zpage->list);
+	__free_page(zpage->page);
+	kfree(zpage);
+	zram->stats.pages_used--;
+}
+
+/*
+ * Take a free slot of the given class. Called with the write mutex held,
+ * so nobody else adds pages to the partial lists meanwhile.
+ */
+static struct zram_zpage *zram_alloc_slot(struct zram *zram, int class,
+					  int *slotp)
+{
+	struct list_head *partial = &zram->partial[class];
+	int nr_slots = zram_class_slots(class);
+	struct zram_zpage *zpage = NULL;
+	struct zram_zpage *new;
+	int slot;
+
+	write_lock(&zram->lock);
+	if (list_empty(partial)) {
+		write_unlock(&zram->lock);
+
+		new = kzalloc(sizeof(*new), GFP_NOIO | __GFP_NOWARN);
+		if (!new)
+			return NULL;
+		new->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM |
+				       __GFP_NOWARN);
+		if (!new->page) {
+			kfree(new);
+			return NULL;
+		}
+		new->class = class;
+
+		write_lock(&zram->lock);
+		list_add(&new->list, partial);
+		zram->stats.pages_used++;
+	}
+
+	zpage = list_first_entry(partial, struct zram_zpage, list);
+	slot = find_first_zero_bit(zpage->used, nr_slots);
+	__set_bit(slot, zpage->used);
+	if (++zpage->inuse == nr_slots)
+		list_del_init(&zpage->list);
+	write_unlock(&zram->lock);
+
+	*slotp = slot;
+	return zpage;
+}
+
+/* Called with zram->lock held for writing */
+static void zram_free_slot(struct zram *zram, struct zram_zpage *zpage,
+			   int slot)
+{
+	int nr_slots = zram_class_slots(zpage->class);
+
+	__clear_bit(slot, zpage->used);
+	if (zpage->inuse-- == nr_slots)
+		list_add(&zpage->list, &zram->partial[zpage->class]);
+	if (!zpage->inuse)
+		zram_free_zpage(zram, zpage);
+}
+
+/* Called with zram->lock held for writing */
+static void zram_free_entry(struct zram *zram, unsigned long index)
+{
+	struct zram_entry *entry = &zram->table[index];
+
+	if (entry->flags & ZRAM_ZERO) {
+		entry->flags &= ~ZRAM_ZERO;
+		zram->stats.pages_zero--;
+		return;
+	}
+
+	if (!entry->zpage)
+		return;
+
+	zram_free_slot(zram, entry->zpage, entry->slot);
+	zram->stats.compr_size -= entry->len;
+	zram->stats.pages_stored--;
+	entry->zpage = NULL;
+	entry->len = 0;
+}
+
+static void zram_free_all(struct zram *zram)
+{
+	unsigned long index;
+
+	write_lock(&zram->lock);
+	for (index = 0; index < zram->nr_pages; index++)
+		zram_free_entry(zram, index);
+	write_unlock(&zram->lock);
+}
+
+static int zram_page_zero_filled(void *ptr)
+{
+	unsigned long *word = ptr;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*word); i++)
+		if (word[i])
+			return 0;
+	return 1;
+}
+
+static int zram_read(struct zram *zram, struct page *page,
+		     unsigned long index)
+{
+	struct zram_entry *entry = &zram->table[index];
+	unsigned char *src;
+	unsigned char *dst;
+	size_t clen = PAGE_SIZE;
+	int ret = LZO_E_OK;
+
+	read_lock(&zram->lock);
+	dst = kmap_atomic(page, KM_USER0);
+	if (!entry->zpage) {
+		/* Zero page, or a block that was never written */
+		memset(dst, 0, PAGE_SIZE);
+	} else {
+		src = kmap_atomic(entry->zpage->page, KM_USER1);
+		src += entry->slot * (entry->zpage->class << ZRAM_CLASS_SHIFT);
+		if (entry->len == PAGE_SIZE)
+			memcpy(dst, src, PAGE_SIZE);
+		else
+			ret = lzo1x_decompress_safe(src, entry->len, dst,
+						    &clen);
+		kunmap_atomic(src, KM_USER1);
+	}
+	kunmap_atomic(dst, KM_USER0);
+	read_unlock(&zram->lock);
+	flush_dcache_page(page);
+
+	if (unlikely(ret != LZO_E_OK || clen != PAGE_SIZE)) {
+		printk(KERN_ERR "zram%d: decompression failed for block %lu\n",
+		       zram->number, index);
+		atomic_inc(&zram->stats.failed_reads);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int zram_write(struct zram *zram, struct page *page,
+		      unsigned long index)
+{
+	struct zram_zpage *zpage;
+	unsigned char *src;
+	unsigned char *dst;
+	size_t clen;
+	int zero;
+	int slot;
+	int ret;
+
+	mutex_lock(&zram->write_mutex);
+
+	src = kmap_atomic(page, KM_USER0);
+	zero = zram_page_zero_filled(src);
+	ret = LZO_E_OK;
+	clen = 0;
+	if (!zero)
+		ret = lzo1x_1_compress(src, PAGE_SIZE, zram->cbuf, &clen,
+				       zram->wrkmem);
+	kunmap_atomic(src, KM_USER0);
+
+	if (unlikely(ret != LZO_E_OK)) {
+		printk(KERN_ERR "zram%d: compression failed for block %lu\n",
+		       zram->number, index);
+		goto fail;
+	}
+
+	if (zero) {
+		write_lock(&zram->lock);
+		zram_free_entry(zram, index);
+		zram->table[index].flags |= ZRAM_ZERO;
+		zram->stats.pages_zero++;
+		write_unlock(&zram->lock);
+		goto out;
+	}
+
+	if (clen > ZRAM_MAX_COMPRESSED)
+		clen = PAGE_SIZE;
+
+	zpage = zram_alloc_slot(zram, zram_class(clen), &slot);
+	if (!zpage)
+		goto fail;
+
+	dst = kmap_atomic(zpage->page, KM_USER1);
+	dst += slot * (zpage->class << ZRAM_CLASS_SHIFT);
+	if (clen == PAGE_SIZE) {
+		src = kmap_atomic(page, KM_USER0);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER0);
+	} else
+		memcpy(dst, zram->cbuf, clen);
+	kunmap_atomic(dst, KM_USER1);
+
+	write_lock(&zram->lock);
+	zram_free_entry(zram, index);
+	zram->table[index].zpage = zpage;
+	zram->table[index].slot = slot;
+	zram->table[index].len = clen;
+	zram->stats.compr_size += clen;
+	zram->stats.pages_stored++;
+	write_unlock(&zram->lock);
+
+out:
+	mutex_unlock(&zram->write_mutex);
+	return 0;
+
+fail:
+	mutex_unlock(&zram->write_mutex);
+	atomic_inc(&zram->stats.failed_writes);
+	return -ENOMEM;
+}
+
+static int zram_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	struct zram *zram = bdev->bd_disk->private_data;
+	struct bio_vec *bvec;
+	unsigned long index;
+	sector_t sector;
+	int rw;
+	int i;
+	int err = -EIO;
+
+	sector = bio->bi_sector;
+	if (sector + (bio->bi_size >> SECTOR_SHIFT) >
+						get_capacity(bdev->bd_disk))
+		goto out;
+
+	/* Only whole, aligned pages are stored */
+	if (unlikely(sector & (PAGE_SECTORS - 1) ||
+		     bio->bi_size & (PAGE_SIZE - 1))) {
+		atomic_inc(&zram->stats.invalid_io);
+		goto out;
+	}
+
+	rw = bio_rw(bio);
+	if (rw == READA)
+		rw = READ;
+
+	index = sector >> PAGE_SECTORS_SHIFT;
+	bio_for_each_segment(bvec, bio, i) {
+		if (unlikely(bvec->bv_len != PAGE_SIZE)) {
+			atomic_inc(&zram->stats.invalid_io);
+			err = -EIO;
+			break;
+		}
+
+		if (rw == READ) {
+			atomic_inc(&zram->stats.num_reads);
+			err = zram_read(zram, bvec->bv_page, index);
+		} else {
+			atomic_inc(&zram->stats.num_writes);
+			err = zram_write(zram, bvec->bv_page, index);
+		}
+		if (err)
+			break;
+		index++;
+	}
+
+out:
+	bio_endio(bio, err);
+
+	return 0;
+}
+
+static int zram_ioctl(struct block_device *bdev, fmode_t mode,
+			unsigned int cmd, unsigned long arg)
+{
+	int error;
+	struct zram *zram = bdev->bd_disk->private_data;
+
+	if (cmd != BLKFLSBUF)
+		return -ENOTTY;
+
+	/* As for brd, BLKFLSBUF releases the stored data */
+	mutex_lock(&bdev->bd_mutex);
+	error = -EBUSY;
+	if (bdev->bd_openers <= 1) {
+		invalidate_bh_lrus();
+		truncate_inode_pages(bdev->bd_inode->i_mapping, 0);
+		zram_free_all(zram);
+		error = 0;
+	}
+	mutex_unlock(&bdev->bd_mutex);
+
+	return error;
+}
+
+/* Called from swap_entry_free() with swap_lock held */
+static void zram_slot_free_notify(struct block_device *bdev,
+				  unsigned long index)
+{
+	struct zram *zram = bdev->bd_disk->private_data;
+
+	if (index >= zram->nr_pages)
+		return;
+
+	write_lock(&zram->lock);
+	zram_free_entry(zram, index);
+	zram->stats.notify_free++;
+	write_unlock(&zram->lock);
+}
+
+static const struct block_device_operations zram_fops = {
+	.owner =		THIS_MODULE,
+	.locked_ioctl =		zram_ioctl,
+	.swap_slot_free_notify = zram_slot_free_notify,
+};
+
+/*
+ * Statistics, in /sys/block/zram<N>/
+ */
+static struct zram *dev_to_zram(struct device *dev)
+{
+	return dev_to_disk(dev)->private_data;
+}
+
+#define ZRAM_ATTR(_name, _fmt, _val)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct zram *zram = dev_to_zram(dev);				\
+	u64 val;							\
+									\
+	read_lock(&zram->lock);						\
+	val = (_val);							\
+	read_unlock(&zram->lock);					\
+	return sprintf(buf, _fmt "\n", (unsigned long long)val);	\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, _name##_show, NULL)
+
+ZRAM_ATTR(disksize, "%llu", (u64)zram->nr_pages << PAGE_SHIFT);
+ZRAM_ATTR(orig_data_size, "%llu",
+	  (u64)(zram->stats.pages_stored + zram->stats.pages_zero) <<
+	  PAGE_SHIFT);
+ZRAM_ATTR(compr_data_size, "%llu", zram->stats.compr_size);
+ZRAM_ATTR(mem_used_total, "%llu", (u64)zram->stats.pages_used << PAGE_SHIFT);
+ZRAM_ATTR(zero_pages, "%llu", zram->stats.pages_zero);
+ZRAM_ATTR(notify_free, "%llu", zram->stats.notify_free);
+ZRAM_ATTR(num_reads, "%llu", atomic_read(&zram->stats.num_reads));
+ZRAM_ATTR(num_writes, "%llu", atomic_read(&zram->stats.num_writes));
+ZRAM_ATTR(failed_reads, "%llu", atomic_read(&zram->stats.failed_reads));
+ZRAM_ATTR(failed_writes, "%llu", atomic_read(&zram->stats.failed_writes));
+ZRAM_ATTR(invalid_io, "%llu", atomic_read(&zram->stats.invalid_io));
+
+static struct attribute *zram_attrs[] = {
+	&dev_attr_disksize.attr,
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_mem_used_total.attr,
+	&dev_attr_zero_pages.attr,
+	&dev_attr_notify_free.attr,
+	&dev_attr_num_reads.attr,
+	&dev_attr_num_writes.attr,
+	&dev_attr_failed_reads.attr,
+	&dev_attr_failed_writes.attr,
+	&dev_attr_invalid_io.attr,
+	NULL,
+};
+
+static struct attribute_group zram_attr_group = {
+	.attrs = zram_attrs,
+};
+
+/*
+ * And now the modules code and kernel interface.
+ */
+static int zram_nr = 1;
+static int zram_size;
+static int zram_major;
+module_param(zram_nr, int, 0);
+MODULE_PARM_DESC(zram_nr, "Number of zram devices");
+module_param(zram_size, int, 0);
+MODULE_PARM_DESC(zram_size,
+	"Size of each zram device in kbytes (default: 25% of RAM)");
+MODULE_LICENSE("GPL");
+
+static LIST_HEAD(zram_devices);
+
+static struct zram *zram_alloc(int i, unsigned long nr_pages)
+{
+	struct zram *zram;
+	struct gendisk *disk;
+	int c;
+
+	zram = kzalloc(sizeof(*zram), GFP_KERNEL);
+	if (!zram)
+		goto out;
+	zram->number = i;
+	zram->nr_pages = nr_pages;
+	rwlock_init(&zram->lock);
+	mutex_init(&zram->write_mutex);
+	for (c = 0; c < ZRAM_NR_CLASSES; c++)
+		INIT_LIST_HEAD(&zram->partial[c]);
+
+	zram->table = vmalloc(nr_pages * sizeof(*zram->table));
+	if (!zram->table)
+		goto out_free_dev;
+	memset(zram->table, 0, nr_pages * sizeof(*zram->table));
+
+	zram->wrkmem = kmalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+	zram->cbuf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+	if (!zram->wrkmem || !zram->cbuf)
+		goto out_free_buffers;
+
+	zram->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!zram->queue)
+		goto out_free_buffers;
+	blk_queue_make_request(zram->queue, zram_make_request);
+	blk_queue_max_sectors(zram->queue, 1024);
+	blk_queue_logical_block_size(zram->queue, PAGE_SIZE);
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->queue);
+
+	disk = zram->disk = alloc_disk(1);
+	if (!disk)
+		goto out_free_queue;
+	disk->major		= zram_major;
+	disk->first_minor	= i;
+	disk->fops		= &zram_fops;
+	disk->private_data	= zram;
+	disk->queue		= zram->queue;
+	disk->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
+	sprintf(disk->disk_name, "zram%d", i);
+	set_capacity(disk, (sector_t)nr_pages << PAGE_SECTORS_SHIFT);
+
+	return zram;
+
+out_free_queue:
+	blk_cleanup_queue(zram->queue);
+out_free_buffers:
+	kfree(zram->cbuf);
+	kfree(zram->wrkmem);
+	vfree(zram->table);
+out_free_dev:
+	kfree(zram);
+out:
+	return NULL;
+}
+
+static void zram_free(struct zram *zram)
+{
+	put_disk(zram->disk);
+	blk_cleanup_queue(zram->queue);
+	zram_free_all(zram);
+	kfree(zram->cbuf);
+	kfree(zram->wrkmem);
+	vfree(zram->table);
+	kfree(zram);
+}
+
+static void zram_del_one(struct zram *zram)
+{
+	list_del(&zram->list);
+	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj, &zram_attr_group);
+	del_gendisk(zram->disk);
+	zram_free(zram);
+}
+
+static int __init zram_init(void)
+{
+	unsigned long nr_pages;
+	struct zram *zram, *next;
+	int i;
+
+	if (zram_nr < 1 || zram_nr > 1UL << MINORBITS)
+		return -EINVAL;
+
+	if (zram_size > 0)
+		nr_pages = zram_size >> (PAGE_SHIFT - 10);
+	else
+		nr_pages = totalram_pages / 4;
+
+	zram_major = register_blkdev(0, "zram");
+	if (zram_major <= 0)
+		return -EIO;
+
+	for (i = 0; i < zram_nr; i++) {
+		zram = zram_alloc(i, nr_pages);
+		if (!zram)
+			goto out_free;
+		list_add_tail(&zram->list, &zram_devices);
+	}
+
+	/* point of no return */
+
+	list_for_each_entry(zram, &zram_devices, list) {
+		add_disk(zram->disk);
+		if (sysfs_create_group(&disk_to_dev(zram->disk)->kobj,
+				       &zram_attr_group))
+			printk(KERN_WARNING "zram%d: no sysfs statistics\n",
+			       zram->number);
+	}
+
+	printk(KERN_INFO "zram: %d device(s) of %luk\n", zram_nr,
+	       nr_pages << (PAGE_SHIFT - 10));
+	return 0;
+
+out_free:
+	list_for_each_entry_safe(zram, next, &zram_devices, list) {
+		list_del(&zram->list);
+		zram_free(zram);
+	}
+	unregister_blkdev(zram_major, "zram");
+
+	return -ENOMEM;
+}
+
+static void __exit zram_exit(void)
+{
+	struct zram *zram, *next;
+
+	list_for_each_entry_safe(zram, next, &zram_devices, list)
+		zram_del_one(zram);
+
+	unregister_blkdev(zram_major, "zram");
+}
+
+module_init(zram_init);
+module_exit(zram_exit);
@@ -544,6 +544,9 @@ static struct android_pmem_platform_data android_pmem_cam_pdata = {
 	.size		= PMEM_CAM_SIZE,
 	.no_allocator	= 1,
 	.cached		= 1,
+#ifdef PMEM_CAM_CMA
+	.cma		= 1,
+#endif
 };
 
 static struct platform_device android_pmem_cam_device = {
@@ -23,12 +23,15 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/cma.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
+/* number of per-order free lists, enough for any region size */
+#define PMEM_NR_ORDERS BITS_PER_LONG
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -82,6 +85,10 @@ struct pmem_data {
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	/* links in the free list of this order, only valid while the entry
+	 * heads a free region, -1 terminates the list */
+	int prev;
+	int next;
 };
 
 struct pmem_region_node {
@@ -116,6 +123,12 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* the first free entry of each order, -1 if there is none */
+	int free_list[PMEM_NR_ORDERS];
+	/* number of free entries of each order, for debugfs */
+	unsigned long nr_free[PMEM_NR_ORDERS];
+	/* bit n is set when free_list[n] is not empty */
+	unsigned long free_orders;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -126,12 +139,18 @@ struct pmem_info {
 	/* in no_allocator mode the first mapper gets the whole space and sets
 	 * this flag */
 	unsigned allocated;
+	/* the space is a contiguous memory region (see mm/cma.c), lent to
+	 * the page allocator while nothing is allocated from it */
+	unsigned cma;
+	/* number of allocations from a cma space, it is claimed while this
+	 * is not zero */
+	unsigned long nr_allocations;
 	/* for debugging, creates a list of pmem file structs, the
 	 * data_list_sem should be taken before pmem_data->sem if both are
 	 * needed */
 	struct semaphore data_list_sem;
 	struct list_head data_list;
-	/* pmem_sem protects the bitmap array
+	/* pmem_sem protects the bitmap array and the free lists
 	 * a write lock should be held when modifying entries in bitmap
 	 * a read lock should be held when reading data from bits or
 	 * dereferencing a pointer into bitmap
@@ -232,6 +251,64 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_free_list_add(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int head = pmem[id].free_list[order];
+
+	pmem[id].bitmap[index].prev = -1;
+	pmem[id].bitmap[index].next = head;
+	if (head >= 0)
+		pmem[id].bitmap[head].prev = index;
+	pmem[id].free_list[order] = index;
+	pmem[id].nr_free[order]++;
+	pmem[id].free_orders |= 1UL << order;
+}
+
+static void pmem_free_list_del(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int prev = pmem[id].bitmap[index].prev;
+	int next = pmem[id].bitmap[index].next;
+
+	if (prev >= 0)
+		pmem[id].bitmap[prev].next = next;
+	else
+		pmem[id].free_list[order] = next;
+	if (next >= 0)
+		pmem[id].bitmap[next].prev = prev;
+	pmem[id].nr_free[order]--;
+	if (pmem[id].free_list[order] < 0)
+		pmem[id].free_orders &= ~(1UL << order);
+}
+
+/* take the space back from the page allocator on the first allocation */
+static int pmem_cma_get(int id)
+{
+	struct page *page = pfn_to_page(pmem[id].base >> PAGE_SHIFT);
+
+	if (!pmem[id].cma || pmem[id].nr_allocations++)
+		return 0;
+	if (cma_claim(page, pmem[id].size >> PAGE_SHIFT)) {
+		printk(KERN_WARNING "pmem: %s: could not claim the space from "
+		       "the page allocator\n", pmem[id].dev.name);
+		pmem[id].nr_allocations--;
+		return -1;
+	}
+	/* write back what the pages' previous users left in the cache */
+	dmac_flush_range(pmem[id].vbase, pmem[id].vbase + pmem[id].size);
+	return 0;
+}
+
+/* and lend it out again when the last allocation is freed */
+static void pmem_cma_put(int id)
+{
+	struct page *page = pfn_to_page(pmem[id].base >> PAGE_SHIFT);
+
+	if (pmem[id].cma && !--pmem[id].nr_allocations)
+		cma_release(page, pmem[id].size >> PAGE_SHIFT);
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
@@ -240,25 +317,29 @@ static int pmem_free(int id, int index)
 
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
+		pmem_cma_put(id);
 		return 0;
 	}
 	/* clean up the bitmap, merging any buddies */
 	pmem[id].bitmap[curr].allocated = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
+	 * if the buddy is also free take it off its free list and merge them
 	 * repeat until the buddy is not free or end of the bitmap is reached
 	 */
-	do {
+	for (;;) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
+		if (buddy < pmem[id].num_entries && PMEM_IS_FREE(id, buddy) &&
 				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
+			pmem_free_list_del(id, buddy);
 			PMEM_ORDER(id, buddy)++;
 			PMEM_ORDER(id, curr)++;
 			curr = min(buddy, curr);
 		} else {
 			break;
 		}
-	} while (curr < pmem[id].num_entries);
+	}
+	pmem_free_list_add(id, curr);
+	pmem_cma_put(id);
 
 	return 0;
 }
@@ -380,52 +461,41 @@ static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
+	int best_fit;
 	unsigned long order = pmem_order(len);
+	unsigned long orders;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
 		if ((len > pmem[id].size) || pmem[id].allocated)
 			return -1;
+		if (pmem_cma_get(id))
+			return -1;
 		pmem[id].allocated = 1;
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order > PMEM_MAX_ORDER || order >= PMEM_NR_ORDERS)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
+	/* take the best fit from the free lists:
+	 * 	the smallest non-empty order >= the requested order
+	 * if there is none there are no suitable slots, return an error
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
-	}
-
-	/* if best_fit < 0, there are no suitable slots,
-	 * return an error
-	 */
-	if (best_fit < 0) {
+	orders = pmem[id].free_orders >> order;
+	if (!orders) {
 		printk("pmem: no space left to allocate!\n");
 		return -1;
 	}
+	if (pmem_cma_get(id))
+		return -1;
+	best_fit = pmem[id].free_list[order + __ffs(orders)];
+	pmem_free_list_del(id, best_fit);
 
 	/* now partition the best fit:
 	 * 	split the slot into 2 buddies of order - 1
+	 * 	put the upper buddy on the free list of its order
 	 * 	repeat until the slot is of the correct order
 	 */
 	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
@@ -433,6 +503,7 @@ static int pmem_allocate(int id, unsigned long len)
 		PMEM_ORDER(id, best_fit) -= 1;
 		buddy = PMEM_BUDDY_INDEX(id, best_fit);
 		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem_free_list_add(id, buddy);
 	}
 	pmem[id].bitmap[best_fit].allocated = 1;
 	return best_fit;
@@ -1141,7 +1212,9 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
+			down_write(&pmem[id].bitmap_sem);
 			data->index = pmem_allocate(id, arg);
+			up_write(&pmem[id].bitmap_sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1185,7 +1258,29 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	int n = 0;
 
 	DLOG("debug open\n");
-	n = scnprintf(buffer, debug_bufmax,
+	if (!pmem[id].no_allocator) {
+		int order;
+
+		down_read(&pmem[id].bitmap_sem);
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "free regions by order (order:count):");
+		for (order = 0; order < PMEM_NR_ORDERS; order++)
+			if (pmem[id].nr_free[order])
+				n += scnprintf(buffer + n, debug_bufmax - n,
+					       " %d:%lu", order,
+					       pmem[id].nr_free[order]);
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "\nlargest free region: %lu bytes\n",
+			       pmem[id].free_orders ?
+			       PMEM_MIN_ALLOC << __fls(pmem[id].free_orders) :
+			       0UL);
+		up_read(&pmem[id].bitmap_sem);
+	}
+	if (pmem[id].cma)
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "lent to the page allocator: %s\n",
+			       pmem[id].nr_allocations ? "no" : "yes");
+	n += scnprintf(buffer + n, debug_bufmax - n,
 		      "pid #: mapped regions (offset, len) (offset,len)...\n");
 
 	down(&pmem[id].data_list_sem);
@@ -1225,16 +1320,44 @@ static struct miscdevice pmem_dev = {
 };
 #endif
 
+/* set up the bitmap for num_entries, all free and as few regions as can be */
+static int pmem_bitmap_init(int id)
+{
+	int i, index = 0;
+
+	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits), GFP_KERNEL);
+	if (!pmem[id].bitmap)
+		return -ENOMEM;
+
+	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
+					  pmem[id].num_entries);
+
+	for (i = 0; i < PMEM_NR_ORDERS; i++) {
+		pmem[id].free_list[i] = -1;
+		pmem[id].nr_free[i] = 0;
+	}
+	pmem[id].free_orders = 0;
+	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
+		if (pmem[id].num_entries & (1UL << i)) {
+			PMEM_ORDER(id, index) = i;
+			pmem_free_list_add(id, index);
+			index = PMEM_NEXT_INDEX(id, index);
+		}
+	}
+	return 0;
+}
+
 int pmem_setup(struct android_pmem_platform_data *pdata,
 	       long (*ioctl)(struct file *, unsigned int, unsigned long),
 	       int (*release)(struct inode *, struct file *))
 {
 	int err = 0;
-	int i, index = 0;
 	int id = id_count;
 	id_count++;
 
 	pmem[id].no_allocator = pdata->no_allocator;
+	pmem[id].cma = pdata->cma;
 	pmem[id].cached = pdata->cached;
 	pmem[id].buffered = pdata->buffered;
 	pmem[id].base = pdata->start;
@@ -1256,22 +1379,13 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
-	if (!pmem[id].bitmap)
+	if (pmem_bitmap_init(id))
 		goto err_no_mem_for_metadata;
 
-	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
-					  pmem[id].num_entries);
-
-	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
-			PMEM_ORDER(id, index) = i;
-			index = PMEM_NEXT_INDEX(id, index);
-		}
-	}
-
-	if (pmem[id].cached)
+	if (pmem[id].cma)
+		/* lowmem, already mapped by the kernel */
+		pmem[id].vbase = (unsigned char __iomem *)__va(pmem[id].base);
+	else if (pmem[id].cached)
 		pmem[id].vbase = ioremap_cached(pmem[id].base,
 						pmem[id].size);
 #ifdef ioremap_ext_buffered
@@ -1330,8 +1444,168 @@ static struct platform_driver pmem_driver = {
 };
 
 
+#ifdef CONFIG_ANDROID_PMEM_SELFTEST
+/*
+ * Replays pseudo-random allocate and free sequences against spaces with
+ * no memory behind them, checking the bitmap and the free lists after
+ * every step.  Runs on a pmem[] slot before any device can claim it.
+ */
+static const unsigned long pmem_test_entries[] __initdata = {
+	1, 2, 3, 5, 7, 12, 64, 100, 255, 256, 1000,
+};
+#define PMEM_TEST_MAX_ENTRIES 1000
+#define PMEM_TEST_STEPS 2000
+
+static u32 pmem_test_seed __initdata = 1;
+
+static u32 __init pmem_test_rand(void)
+{
+	pmem_test_seed = pmem_test_seed * 1664525 + 1013904223;
+	return pmem_test_seed >> 8;
+}
+
+static const char * __init pmem_test_check(int id, unsigned char *head)
+{
+	unsigned long nr_entries = pmem[id].num_entries;
+	unsigned long index, nr_free = 0, nr_listed = 0;
+	int order;
+
+	/* the regions tile the space, each aligned to its size */
+	memset(head, 0, nr_entries);
+	for (index = 0; index < nr_entries;
+	     index = PMEM_NEXT_INDEX(id, index)) {
+		if (index & ((1UL << PMEM_ORDER(id, index)) - 1))
+			return "misaligned region";
+		if (PMEM_NEXT_INDEX(id, index) > nr_entries)
+			return "region past the end";
+		head[index] = 1;
+	}
+
+	/* free buddies of the same order have been merged */
+	for (index = 0; index < nr_entries; index++) {
+		unsigned long buddy = PMEM_BUDDY_INDEX(id, index);
+
+		if (!head[index] || !PMEM_IS_FREE(id, index))
+			continue;
+		nr_free++;
+		if (buddy < nr_entries && head[buddy] &&
+		    PMEM_IS_FREE(id, buddy) &&
+		    PMEM_ORDER(id, buddy) == PMEM_ORDER(id, index))
+			return "free buddies not merged";
+	}
+
+	/* and every free region is on the list of its order, once */
+	for (order = 0; order < PMEM_NR_ORDERS; order++) {
+		unsigned long n = 0;
+		int i, prev = -1;
+
+		for (i = pmem[id].free_list[order]; i >= 0;
+		     prev = i, i = pmem[id].bitmap[i].next) {
+			if (i >= nr_entries || !head[i] ||
+			    !PMEM_IS_FREE(id, i) || PMEM_ORDER(id, i) != order)
+				return "free list holds a wrong entry";
+			if (pmem[id].bitmap[i].prev != prev)
+				return "free list back link broken";
+			if (++n > nr_entries)
+				return "free list loops";
+		}
+		if (n != pmem[id].nr_free[order])
+			return "free count wrong";
+		if (!(pmem[id].free_orders & (1UL << order)) != !n)
+			return "free_orders wrong";
+		nr_listed += n;
+	}
+	if (nr_listed != nr_free)
+		return "free region missing from the lists";
+	return NULL;
+}
+
+static int __init pmem_test_space(int id, unsigned long nr_entries,
+				  unsigned char *head, int *allocs)
+{
+	const char *err = NULL;
+	int nr_allocs = 0, step;
+
+	pmem[id].num_entries = nr_entries;
+	if (pmem_bitmap_init(id))
+		return -ENOMEM;
+
+	for (step = 0; step < PMEM_TEST_STEPS && !err; step++) {
+		u32 r = pmem_test_rand();
+		unsigned long len = ((r >> 1) % 16 + 1) * PMEM_MIN_ALLOC;
+
+		if (nr_allocs && ((r & 1) ||
+		    !(pmem[id].free_orders >> pmem_order(len)))) {
+			int i = (r >> 1) % nr_allocs;
+
+			pmem_free(id, allocs[i]);
+			allocs[i] = allocs[--nr_allocs];
+		} else if (pmem[id].free_orders >> pmem_order(len)) {
+			int index = pmem_allocate(id, len);
+
+			if (index < 0)
+				err = "allocation failed with space left";
+			else if (PMEM_IS_FREE(id, index) ||
+				 PMEM_LEN(id, index) < len)
+				err = "allocation too small";
+			else
+				allocs[nr_allocs++] = index;
+		}
+		if (!err)
+			err = pmem_test_check(id, head);
+	}
+
+	while (!err && nr_allocs)
+		pmem_free(id, allocs[--nr_allocs]);
+	if (!err)
+		err = pmem_test_check(id, head);
+	if (!err) {
+		unsigned long n = 0;
+		int order;
+
+		for (order = 0; order < PMEM_NR_ORDERS; order++)
+			n += pmem[id].nr_free[order];
+		if (n != hweight_long(nr_entries))
+			err = "space not merged back when empty";
+	}
+	kfree(pmem[id].bitmap);
+
+	if (err) {
+		printk(KERN_ERR "pmem: selftest: %lu entries, step %d: %s\n",
+		       nr_entries, step, err);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void __init pmem_selftest(void)
+{
+	unsigned char *head;
+	int *allocs;
+	int i, id = id_count, err = -ENOMEM;
+
+	head = kmalloc(PMEM_TEST_MAX_ENTRIES, GFP_KERNEL);
+	allocs = kmalloc(PMEM_TEST_MAX_ENTRIES * sizeof(*allocs), GFP_KERNEL);
+	if (head && allocs)
+		for (i = 0, err = 0;
+		     i < ARRAY_SIZE(pmem_test_entries) && !err; i++)
+			err = pmem_test_space(id, pmem_test_entries[i],
+					      head, allocs);
+	kfree(allocs);
+	kfree(head);
+	memset(&pmem[id], 0, sizeof(pmem[id]));
+
+	printk(KERN_INFO "pmem: selftest %s\n", err ? "FAILED" : "passed");
+}
+#else
+static inline void pmem_selftest(void)
+{
+}
+#endif
+
 static int __init pmem_init(void)
 {
+	pmem_selftest();
 	return platform_driver_register(&pmem_driver);
 }
 
@@ -20,30 +20,131 @@
 #include <linux/init.h>
 #include <linux/mutex.h>
 #include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
 #include <asm/uaccess.h>
 
 #include "mtdcore.h"
 
 static LIST_HEAD(blktrans_majors);
 
+/*
+ * Requests are capped at MTD_BLKTRANS_MAX_BYTES so that each worker's
+ * bounce buffer can take a whole one, letting a request that is spread
+ * over many pages reach the translation layer in a single call.
+ */
+#define MTD_BLKTRANS_MAX_BYTES		(128 * 1024)
+#define MTD_BLKTRANS_MAX_WORKERS	4
+
+static int workers = 1;
+module_param(workers, int, 0444);
+MODULE_PARM_DESC(workers, "Worker threads per translation layer (1-4)");
+
 struct mtd_blkcore_priv {
-	struct task_struct *thread;
+	struct task_struct *thread[MTD_BLKTRANS_MAX_WORKERS];
+	int nr_threads;
 	struct request_queue *rq;
 	spinlock_t queue_lock;
 };
 
+static int blktrans_xfer(struct mtd_blktrans_ops *tr,
+			 struct mtd_blktrans_dev *dev, int write,
+			 unsigned long block, unsigned int len, char *buf)
+{
+	unsigned long nsect = len >> tr->blkshift;
+
+	if (write)
+		return tr->writesect(dev, block, nsect, buf) ? -EIO : 0;
+	return tr->readsect(dev, block, nsect, buf) ? -EIO : 0;
+}
+
+/*
+ * Copy between the request's segments and a linear buffer. Request
+ * pages are always in lowmem since the queue bounces highmem.
+ */
+static void blktrans_copy_bounce(struct request *req, char *bounce, int write)
+{
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+
+	rq_for_each_segment(bvec, req, iter) {
+		char *p = page_address(bvec->bv_page) + bvec->bv_offset;
+
+		if (write) {
+			memcpy(bounce, p, bvec->bv_len);
+		} else {
+			memcpy(p, bounce, bvec->bv_len);
+			flush_dcache_page(bvec->bv_page);
+		}
+		bounce += bvec->bv_len;
+	}
+}
+
+/*
+ * Hand the whole request to the translation layer in as few calls as
+ * possible: one call through @bounce if the request has several
+ * physical segments, otherwise one call per virtually contiguous run.
+ */
+static int blktrans_rw_request(struct mtd_blktrans_ops *tr,
+			       struct mtd_blktrans_dev *dev,
+			       struct request *req, unsigned long block,
+			       char *bounce)
+{
+	int write = rq_data_dir(req) == WRITE;
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	char *run = NULL;
+	unsigned int len = 0;
+	int res;
+
+	if (bounce && req->nr_phys_segments > 1 &&
+	    blk_rq_bytes(req) <= MTD_BLKTRANS_MAX_BYTES) {
+		if (write)
+			blktrans_copy_bounce(req, bounce, 1);
+		res = blktrans_xfer(tr, dev, write, block,
+				    blk_rq_bytes(req), bounce);
+		if (!write && !res)
+			blktrans_copy_bounce(req, bounce, 0);
+		return res;
+	}
+
+	rq_for_each_segment(bvec, req, iter) {
+		char *p = page_address(bvec->bv_page) + bvec->bv_offset;
+
+		if (run && run + len == p) {
+			len += bvec->bv_len;
+			continue;
+		}
+		if (run) {
+			res = blktrans_xfer(tr, dev, write, block, len, run);
+			if (res)
+				return res;
+			block += len >> tr->blkshift;
+		}
+		run = p;
+		len = bvec->bv_len;
+	}
+	if (!run)
+		return 0;
+	res = blktrans_xfer(tr, dev, write, block, len, run);
+	if (!write) {
+		rq_for_each_segment(bvec, req, iter)
+			flush_dcache_page(bvec->bv_page);
+	}
+	return res;
+}
+
 static int do_blktrans_request(struct mtd_blktrans_ops *tr,
 			       struct mtd_blktrans_dev *dev,
-			       struct request *req)
+			       struct request *req, char *bounce)
 {
 	unsigned long block, nsect;
-	char *buf;
 #if 0
 	block = blk_rq_pos(req) << 9 >> tr->blkshift;
 	nsect = blk_rq_cur_bytes(req) >> tr->blkshift;
 #else  //modify by zyf for cap>=4GB 20110120
 	block = blk_rq_pos(req);
-	nsect = blk_rq_cur_bytes(req) >> tr->blkshift;
+	nsect = blk_rq_bytes(req) >> tr->blkshift;
     if(tr->blkshift != 9)
     {
         if(tr->blkshift > 9)
@@ -57,12 +158,10 @@ static int do_blktrans_request(struct mtd_blktrans_ops *tr,
     }
 #endif
 
-	buf = req->buffer;
-
 	if (!blk_fs_request(req))
 		return -EIO;
 
-	if (blk_rq_pos(req) + blk_rq_cur_sectors(req) >
+	if (blk_rq_pos(req) + blk_rq_sectors(req) >
 	    get_capacity(req->rq_disk))
 		return -EIO;
 
@@ -71,19 +170,12 @@ static int do_blktrans_request(struct mtd_blktrans_ops *tr,
 
 	switch(rq_data_dir(req)) {
 	case READ:
-		//for (; nsect > 0; nsect--, block++, buf += tr->blksize)
-			if (tr->readsect(dev, block,nsect, buf))
-				return -EIO;
-		return 0;
+		return blktrans_rw_request(tr, dev, req, block, bounce);
 
 	case WRITE:
 		if (!tr->writesect)
 			return -EIO;
-
-		//for (; nsect > 0; nsect--, block++, buf += tr->blksize)
-			if (tr->writesect(dev, block,nsect, buf))
-				return -EIO;
-		return 0;
+		return blktrans_rw_request(tr, dev, req, block, bounce);
 
 	default:
 		printk(KERN_NOTICE "Unknown request %u\n", rq_data_dir(req));
@@ -95,7 +187,11 @@ static int mtd_blktrans_thread(void *arg)
 {
 	struct mtd_blktrans_ops *tr = arg;
 	struct request_queue *rq = tr->blkcore_priv->rq;
-	struct request *req = NULL;
+	struct request *req;
+	char *bounce;
+
+	/* Without a bounce buffer requests go down one run at a time */
+	bounce = vmalloc(MTD_BLKTRANS_MAX_BYTES);
 
 	/* we might get involved when memory gets low, so use PF_MEMALLOC */
 	current->flags |= PF_MEMALLOC;
@@ -106,7 +202,7 @@ static int mtd_blktrans_thread(void *arg)
 		struct mtd_blktrans_dev *dev;
 		int res;
 
-		if (!req && !(req = blk_fetch_request(rq))) {
+		if (!(req = blk_fetch_request(rq))) {
 			set_current_state(TASK_INTERRUPTIBLE);
 			spin_unlock_irq(rq->queue_lock);
 			schedule();
@@ -120,27 +216,34 @@ static int mtd_blktrans_thread(void *arg)
 		spin_unlock_irq(rq->queue_lock);
 
 		mutex_lock(&dev->lock);
-		res = do_blktrans_request(tr, dev, req);
+		res = do_blktrans_request(tr, dev, req, bounce);
 		mutex_unlock(&dev->lock);
 
 		spin_lock_irq(rq->queue_lock);
 
-		if (!__blk_end_request_cur(req, res))
-			req = NULL;
+		__blk_end_request_all(req, res);
 	}
 
-	if (req)
-		__blk_end_request_all(req, -EIO);
-
 	spin_unlock_irq(rq->queue_lock);
 
+	vfree(bounce);
+
 	return 0;
 }
 
 static void mtd_blktrans_request(struct request_queue *rq)
 {
 	struct mtd_blktrans_ops *tr = rq->queuedata;
-	wake_up_process(tr->blkcore_priv->thread);
+	int i;
+
+	for (i = 0; i < tr->blkcore_priv->nr_threads; i++)
+		wake_up_process(tr->blkcore_priv->thread[i]);
+}
+
+static void mtd_blktrans_stop_threads(struct mtd_blkcore_priv *priv)
+{
+	while (priv->nr_threads)
+		kthread_stop(priv->thread[--priv->nr_threads]);
 }
 
 
@@ -386,16 +489,36 @@ int register_mtd_blktrans(struct mtd_blktrans_ops *tr)
 
 	tr->blkcore_priv->rq->queuedata = tr;
 	blk_queue_logical_block_size(tr->blkcore_priv->rq, tr->blksize);
+	blk_queue_max_sectors(tr->blkcore_priv->rq,
+			      MTD_BLKTRANS_MAX_BYTES >> 9);
 	if (tr->discard)
 		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD,
 					tr->blkcore_priv->rq);
 
 	tr->blkshift = ffs(tr->blksize) - 1;
 
-	tr->blkcore_priv->thread = kthread_run(mtd_blktrans_thread, tr,
-			"%sd", tr->name);
-	if (IS_ERR(tr->blkcore_priv->thread)) {
-		int ret = PTR_ERR(tr->blkcore_priv->thread);
+	/*
+	 * The first worker keeps the historical thread name. Extra workers
+	 * only help when several devices of this type are busy at once,
+	 * since each device is still serialised by its own lock.
+	 */
+	for (i = 0; i < clamp(workers, 1, MTD_BLKTRANS_MAX_WORKERS); i++) {
+		struct task_struct *thread;
+
+		if (i)
+			thread = kthread_run(mtd_blktrans_thread, tr,
+					     "%sd/%d", tr->name, i);
+		else
+			thread = kthread_run(mtd_blktrans_thread, tr,
+					     "%sd", tr->name);
+		if (IS_ERR(thread)) {
+			ret = PTR_ERR(thread);
+			break;
+		}
+		tr->blkcore_priv->thread[tr->blkcore_priv->nr_threads++] =
+			thread;
+	}
+	if (!tr->blkcore_priv->nr_threads) {
 		blk_cleanup_queue(tr->blkcore_priv->rq);
 		unregister_blkdev(tr->major, tr->name);
 		kfree(tr->blkcore_priv);
@@ -422,8 +545,8 @@ int deregister_mtd_blktrans(struct mtd_blktrans_ops *tr)
 
 	mutex_lock(&mtd_table_mutex);
 
-	/* Clean up the kernel thread */
-	kthread_stop(tr->blkcore_priv->thread);
+	/* Clean up the kernel threads */
+	mtd_blktrans_stop_threads(tr->blkcore_priv);
 
 	/* Remove it from the list of active majors */
 	list_del(&tr->list);
@@ -13,32 +13,70 @@
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/proc_fs.h>
 
 #include <linux/mtd/mtd.h>
 #include <linux/mtd/blktrans.h>
 #include <linux/mutex.h>
 
 
+struct mtdblk_slot {
+	struct list_head list;
+	unsigned char *data;
+	loff_t offset;
+	unsigned long dirtied;
+	enum { STATE_EMPTY, STATE_CLEAN, STATE_DIRTY } state;
+};
+
 static struct mtdblk_dev {
 	struct mtd_info *mtd;
 	int count;
 	struct mutex cache_mutex;
-	unsigned char *cache_data;
-	unsigned long cache_offset;
+	struct list_head slots;		/* most recently used first */
+	int nr_slots;
+	int max_slots;
 	unsigned int cache_size;
-	enum { STATE_EMPTY, STATE_CLEAN, STATE_DIRTY } cache_state;
+	unsigned long hits, misses, erases, writebacks;
 } *mtdblks[MAX_MTD_DEVICES];
 
 static struct mutex mtdblks_lock;
 
+static int cache_kb = CONFIG_MTD_BLOCK_CACHE_KB;
+module_param(cache_kb, int, 0444);
+MODULE_PARM_DESC(cache_kb, "Erase block cache size per open device in KiB");
+
+/* shorter delays would only keep the flush thread spinning */
+#define MIN_FLUSH_MS	100
+
+static unsigned int flush_ms = 5000;
+module_param(flush_ms, uint, 0644);
+MODULE_PARM_DESC(flush_ms, "Write-back delay for dirty cached blocks (ms), "
+		 "at least " __stringify(MIN_FLUSH_MS));
+
+static unsigned long flush_delay(void)
+{
+	return msecs_to_jiffies(max_t(unsigned int, flush_ms, MIN_FLUSH_MS));
+}
+
+static struct task_struct *mtdblock_flush_thread;
+
 /*
  * Cache stuff...
  *
  * Since typical flash erasable sectors are much larger than what Linux's
  * buffer cache can handle, we must implement read-modify-write on flash
  * sectors for each block write requests.  To avoid over-erasing flash sectors
- * and to speed things up, we locally cache a whole flash sector while it is
- * being written to until a different sector is required.
+ * and to speed things up, we locally cache whole flash sectors while they
+ * are being written to.
+ *
+ * Each open device has up to cache_kb worth of cached sectors ("slots"),
+ * kept in LRU order. The least recently used slot is written back when a
+ * new sector is needed; otherwise dirty slots are written back together
+ * by the flush thread once one of them is flush_ms old, or on flush and
+ * release. With a budget below one erase block, or on parts that need no
+ * erase, requests go straight to the MTD device, which is what FTL-backed
+ * devices such as rknand want.
  */
 
 static void erase_callback(struct erase_info *done)
@@ -47,7 +85,7 @@ static void erase_callback(struct erase_info *done)
 	wake_up(wait_q);
 }
 
-static int erase_write (struct mtd_info *mtd, unsigned long pos,
+static int erase_write (struct mtd_info *mtd, loff_t pos,
 			int len, const char *buf)
 {
 	struct erase_info erase;
@@ -74,9 +112,9 @@ static int erase_write (struct mtd_info *mtd, unsigned long pos,
 	if (ret) {
 		set_current_state(TASK_RUNNING);
 		remove_wait_queue(&wait_q, &wait);
-		printk (KERN_WARNING "mtdblock: erase of region [0x%lx, 0x%x] "
+		printk (KERN_WARNING "mtdblock: erase of region [0x%llx, 0x%x] "
 				     "on \"%s\" failed\n",
-			pos, len, mtd->name);
+			(unsigned long long)pos, len, mtd->name);
 		return ret;
 	}
 
@@ -96,53 +134,198 @@ static int erase_write (struct mtd_info *mtd, unsigned long pos,
 }
 
 
-static int write_cached_data (struct mtdblk_dev *mtdblk)
+static int write_slot(struct mtdblk_dev *mtdblk, struct mtdblk_slot *slot)
 {
 	struct mtd_info *mtd = mtdblk->mtd;
 	int ret;
 
-	if (mtdblk->cache_state != STATE_DIRTY)
+	if (slot->state != STATE_DIRTY)
 		return 0;
 
 	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: writing cached data for \"%s\" "
-			"at 0x%lx, size 0x%x\n", mtd->name,
-			mtdblk->cache_offset, mtdblk->cache_size);
+			"at 0x%llx, size 0x%x\n", mtd->name,
+			(unsigned long long)slot->offset, mtdblk->cache_size);
 
-	ret = erase_write (mtd, mtdblk->cache_offset,
-			   mtdblk->cache_size, mtdblk->cache_data);
+	ret = erase_write (mtd, slot->offset,
+			   mtdblk->cache_size, slot->data);
 	if (ret)
 		return ret;
+	mtdblk->erases++;
+	mtdblk->writebacks++;
 
 	/*
 	 * Here we could argubly set the cache state to STATE_CLEAN.
 	 * However this could lead to inconsistency since we will not
 	 * be notified if this content is altered on the flash by other
 	 * means.  Let's declare it empty and leave buffering tasks to
-	 * the buffer cache instead.
+	 * the buffer cache instead.  Empty slots go to the LRU tail so
+	 * they are reused first.
 	 */
-	mtdblk->cache_state = STATE_EMPTY;
+	slot->state = STATE_EMPTY;
+	list_move_tail(&slot->list, &mtdblk->slots);
+	return 0;
+}
+
+static int slots_expired(struct mtdblk_dev *mtdblk)
+{
+	unsigned long expire = flush_delay();
+	struct mtdblk_slot *slot;
+
+	list_for_each_entry(slot, &mtdblk->slots, list)
+		if (slot->state == STATE_DIRTY &&
+		    time_after_eq(jiffies, slot->dirtied + expire))
+			return 1;
 	return 0;
 }
 
-#if 0
+/*
+ * Write back every dirty slot. With @expired set this is only done once
+ * at least one of them has reached flush_ms, so that the rest ride along
+ * in the same batch instead of each waiting out its own timer.
+ */
+static int write_cached_data (struct mtdblk_dev *mtdblk, int expired)
+{
+	struct mtdblk_slot *slot, *next;
+	int ret = 0, err;
+
+	if (expired && !slots_expired(mtdblk))
+		return 0;
+
+	list_for_each_entry_safe(slot, next, &mtdblk->slots, list) {
+		err = write_slot(mtdblk, slot);
+		if (err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+static struct mtdblk_slot *find_slot(struct mtdblk_dev *mtdblk,
+				     loff_t sect_start)
+{
+	struct mtdblk_slot *slot;
+
+	list_for_each_entry(slot, &mtdblk->slots, list)
+		if (slot->state != STATE_EMPTY && slot->offset == sect_start)
+			return slot;
+	return NULL;
+}
+
+static struct mtdblk_slot *alloc_slot(struct mtdblk_dev *mtdblk)
+{
+	struct mtdblk_slot *slot;
+
+	slot = kzalloc(sizeof(*slot), GFP_KERNEL);
+	if (!slot)
+		return NULL;
+	slot->data = vmalloc(mtdblk->cache_size);
+	if (!slot->data) {
+		kfree(slot);
+		return NULL;
+	}
+	slot->state = STATE_EMPTY;
+	list_add_tail(&slot->list, &mtdblk->slots);
+	mtdblk->nr_slots++;
+	return slot;
+}
+
+static void free_slots(struct mtdblk_dev *mtdblk)
+{
+	struct mtdblk_slot *slot, *next;
+
+	list_for_each_entry_safe(slot, next, &mtdblk->slots, list) {
+		list_del(&slot->list);
+		vfree(slot->data);
+		kfree(slot);
+	}
+	mtdblk->nr_slots = 0;
+}
+
+/*
+ * Return the slot caching @sect_start, filling one from flash if needed.
+ * A new slot is allocated while under budget; otherwise the LRU slot is
+ * written back and reused.
+ */
+static struct mtdblk_slot *get_slot(struct mtdblk_dev *mtdblk,
+				    loff_t sect_start, int *err)
+{
+	struct mtd_info *mtd = mtdblk->mtd;
+	struct mtdblk_slot *slot;
+	size_t retlen;
+	int ret;
+
+	slot = find_slot(mtdblk, sect_start);
+	if (slot) {
+		mtdblk->hits++;
+		list_move(&slot->list, &mtdblk->slots);
+		return slot;
+	}
+	mtdblk->misses++;
+
+	slot = NULL;
+	if (!list_empty(&mtdblk->slots)) {
+		slot = list_entry(mtdblk->slots.prev, struct mtdblk_slot, list);
+		if (slot->state != STATE_EMPTY &&
+		    mtdblk->nr_slots < mtdblk->max_slots)
+			slot = NULL;
+	}
+	if (!slot)
+		slot = alloc_slot(mtdblk);
+	if (!slot && !list_empty(&mtdblk->slots))
+		slot = list_entry(mtdblk->slots.prev, struct mtdblk_slot, list);
+	if (!slot) {
+		/* -EINTR is not really correct, but it is the best match
+		 * documented in man 2 write for all cases.  We could also
+		 * return -EAGAIN sometimes, but why bother?
+		 */
+		*err = -EINTR;
+		return NULL;
+	}
+
+	ret = write_slot(mtdblk, slot);
+	if (ret)
+		goto fail;
+
+	/* fill the slot with the current sector */
+	slot->state = STATE_EMPTY;
+	ret = mtd->read(mtd, sect_start, mtdblk->cache_size, &retlen,
+			slot->data);
+	if (!ret && retlen != mtdblk->cache_size)
+		ret = -EIO;
+	if (ret)
+		goto fail;
+
+	slot->offset = sect_start;
+	slot->state = STATE_CLEAN;
+	list_move(&slot->list, &mtdblk->slots);
+	return slot;
+
+fail:
+	*err = ret;
+	return NULL;
+}
+
 static int do_cached_write (struct mtdblk_dev *mtdblk, loff_t pos,
 			    int len, const char *buf)
 {
 	struct mtd_info *mtd = mtdblk->mtd;
 	unsigned int sect_size = mtdblk->cache_size;
+	struct mtdblk_slot *slot;
 	size_t retlen;
 	int ret;
 
-	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: write on \"%s\" at 0x%lx, size 0x%x\n",
-		mtd->name, pos, len);
+	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: write on \"%s\" at 0x%llx, size 0x%x\n",
+		mtd->name, (unsigned long long)pos, len);
 
-	if (!sect_size)
+	if (!mtdblk->max_slots)
 		return mtd->write(mtd, pos, len, &retlen, buf);
 
 	while (len > 0) {
-		unsigned long sect_start = (pos/sect_size)*sect_size;
-		unsigned int offset = pos - sect_start;
-		unsigned int size = sect_size - offset;
+		loff_t sect_start;
+		unsigned int offset, size;
+
+		div_u64_rem(pos, sect_size, &offset);
+		sect_start = pos - offset;
+		size = sect_size - offset;
 		if( size > len )
 			size = len;
 
@@ -150,40 +333,30 @@ static int do_cached_write (struct mtdblk_dev *mtdblk, loff_t pos,
 			/*
 			 * We are covering a whole sector.  Thus there is no
 			 * need to bother with the cache while it may still be
-			 * useful for other partial writes.
+			 * useful for other partial writes.  A cached copy of
+			 * this sector is stale from now on.
 			 */
+			slot = find_slot(mtdblk, sect_start);
+			if (slot) {
+				slot->state = STATE_EMPTY;
+				list_move_tail(&slot->list, &mtdblk->slots);
+			}
 			ret = erase_write (mtd, pos, size, buf);
 			if (ret)
 				return ret;
+			mtdblk->erases++;
 		} else {
 			/* Partial sector: need to use the cache */
-
-			if (mtdblk->cache_state == STATE_DIRTY &&
-			    mtdblk->cache_offset != sect_start) {
-				ret = write_cached_data(mtdblk);
-				if (ret)
-					return ret;
-			}
-
-			if (mtdblk->cache_state == STATE_EMPTY ||
-			    mtdblk->cache_offset != sect_start) {
-				/* fill the cache with the current sector */
-				mtdblk->cache_state = STATE_EMPTY;
-				ret = mtd->read(mtd, sect_start, sect_size,
-						&retlen, mtdblk->cache_data);
-				if (ret)
-					return ret;
-				if (retlen != sect_size)
-					return -EIO;
-
-				mtdblk->cache_offset = sect_start;
-				mtdblk->cache_size = sect_size;
-				mtdblk->cache_state = STATE_CLEAN;
-			}
+			slot = get_slot(mtdblk, sect_start, &ret);
+			if (!slot)
+				return ret;
 
 			/* write data to our local cache */
-			memcpy (mtdblk->cache_data + offset, buf, size);
-			mtdblk->cache_state = STATE_DIRTY;
+			memcpy (slot->data + offset, buf, size);
+			if (slot->state != STATE_DIRTY) {
+				slot->state = STATE_DIRTY;
+				slot->dirtied = jiffies;
+			}
 		}
 
 		buf += size;
@@ -200,19 +373,23 @@ static int do_cached_read (struct mtdblk_dev *mtdblk, loff_t pos,
 {
 	struct mtd_info *mtd = mtdblk->mtd;
 	unsigned int sect_size = mtdblk->cache_size;
+	struct mtdblk_slot *slot;
 	size_t retlen;
 	int ret;
 
-	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: read on \"%s\" at 0x%lx, size 0x%x\n",
-			mtd->name, pos, len);
+	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: read on \"%s\" at 0x%llx, size 0x%x\n",
+			mtd->name, (unsigned long long)pos, len);
 
-	if (!sect_size)
+	if (!mtdblk->max_slots)
 		return mtd->read(mtd, pos, len, &retlen, buf);
 
 	while (len > 0) {
-		unsigned long sect_start = (pos/sect_size)*sect_size;
-		unsigned int offset = pos - sect_start;
-		unsigned int size = sect_size - offset;
+		loff_t sect_start;
+		unsigned int offset, size;
+
+		div_u64_rem(pos, sect_size, &offset);
+		sect_start = pos - offset;
+		size = sect_size - offset;
 		if (size > len)
 			size = len;
 
@@ -222,10 +399,12 @@ static int do_cached_read (struct mtdblk_dev *mtdblk, loff_t pos,
 		 * contains what we want, otherwise we read the data directly
 		 * from flash.
 		 */
-		if (mtdblk->cache_state != STATE_EMPTY &&
-		    mtdblk->cache_offset == sect_start) {
-			memcpy (buf, mtdblk->cache_data + offset, size);
+		slot = find_slot(mtdblk, sect_start);
+		if (slot) {
+			mtdblk->hits++;
+			memcpy (buf, slot->data + offset, size);
 		} else {
+			mtdblk->misses++;
 			ret = mtd->read(mtd, pos, size, &retlen, buf);
 			if (ret)
 				return ret;
@@ -242,54 +421,90 @@ static int do_cached_read (struct mtdblk_dev *mtdblk, loff_t pos,
 }
 
 static int mtdblock_readsect(struct mtd_blktrans_dev *dev,
-			      loff_t block,unsigned long nsect, char *buf)
+			      unsigned long block, unsigned long nsect,
+			      char *buf)
 {
 	struct mtdblk_dev *mtdblk = mtdblks[dev->devnum];
-	return do_cached_read(mtdblk, (loff_t)block<<9, 512*nsect, buf);
+	int ret;
+
+	mutex_lock(&mtdblk->cache_mutex);
+	ret = do_cached_read(mtdblk, (loff_t)block<<9, 512*nsect, buf);
+	mutex_unlock(&mtdblk->cache_mutex);
+	return ret;
 }
 
 static int mtdblock_writesect(struct mtd_blktrans_dev *dev,
-			      unsigned long block,unsigned long nsect, char *buf)
+			      unsigned long block, unsigned long nsect,
+			      char *buf)
 {
 	struct mtdblk_dev *mtdblk = mtdblks[dev->devnum];
-	if (unlikely(!mtdblk->cache_data && mtdblk->cache_size)) {
-		mtdblk->cache_data = vmalloc(mtdblk->mtd->erasesize);
-		if (!mtdblk->cache_data)
-			return -EINTR;
-		/* -EINTR is not really correct, but it is the best match
-		 * documented in man 2 write for all cases.  We could also
-		 * return -EAGAIN sometimes, but why bother?
-		 */
-	}
-	return do_cached_write(mtdblk, (loff_t)block<<9, 512*nsect, buf);
+	int ret;
+
+	mutex_lock(&mtdblk->cache_mutex);
+	ret = do_cached_write(mtdblk, (loff_t)block<<9, 512*nsect, buf);
+	mutex_unlock(&mtdblk->cache_mutex);
+	return ret;
 }
-#else
-static int mtdblock_readsect(struct mtd_blktrans_dev *dev,
-			      unsigned long block,unsigned long nsect, char *buf)
+
+/*
+ * Writes back the dirty slots of every open device once they age past
+ * flush_ms, so an idle device does not sit on unwritten data.
+ */
+static int mtdblock_flushd(void *arg)
 {
-	struct mtdblk_dev *mtdblk = mtdblks[dev->devnum];
-	struct mtd_info *mtd = mtdblk->mtd;
-	size_t retlen,len;
-	loff_t pos = (loff_t)block*512;
-    len = 512*nsect;
+	while (!kthread_should_stop()) {
+		int i;
+
+		schedule_timeout_interruptible(flush_delay() / 2);
 
-	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: read on \"%s\" at 0x%llx, size 0x%x\n",mtd->name, pos, len);
-	return mtd->read(mtd, pos, len, &retlen, buf);
+		mutex_lock(&mtdblks_lock);
+		for (i = 0; i < MAX_MTD_DEVICES; i++) {
+			struct mtdblk_dev *mtdblk = mtdblks[i];
+
+			if (!mtdblk || !mtdblk->max_slots)
+				continue;
+			mutex_lock(&mtdblk->cache_mutex);
+			write_cached_data(mtdblk, 1);
+			mutex_unlock(&mtdblk->cache_mutex);
+		}
+		mutex_unlock(&mtdblks_lock);
+	}
+	return 0;
 }
 
-static int mtdblock_writesect(struct mtd_blktrans_dev *dev,
-			      unsigned long block,unsigned long nsect, char *buf)
+#ifdef CONFIG_PROC_FS
+static int mtdblock_read_proc(char *page, char **start, off_t off,
+			      int count, int *eof, void *data)
 {
-	struct mtdblk_dev *mtdblk = mtdblks[dev->devnum];
-	struct mtd_info *mtd = mtdblk->mtd;
-	size_t retlen,len;
-	loff_t pos = (loff_t)block*512;
-    len = 512*nsect;
-    
-	DEBUG(MTD_DEBUG_LEVEL2, "mtdblock: write on \"%s\" at 0x%llx, size 0x%x\n",mtd->name, pos, len);
-    return mtd->write(mtd, pos, len, &retlen, buf);
+	int len, i;
+
+	len = sprintf(page, "dev:        slots      hits    misses    erases "
+		      "writebacks\n");
+
+	mutex_lock(&mtdblks_lock);
+	for (i = 0; i < MAX_MTD_DEVICES && len < PAGE_SIZE - 80; i++) {
+		struct mtdblk_dev *mtdblk = mtdblks[i];
+
+		if (!mtdblk)
+			continue;
+		mutex_lock(&mtdblk->cache_mutex);
+		len += sprintf(page + len,
+			       "mtdblock%d: %2d/%-2d %9lu %9lu %9lu %10lu\n",
+			       i, mtdblk->nr_slots, mtdblk->max_slots,
+			       mtdblk->hits, mtdblk->misses, mtdblk->erases,
+			       mtdblk->writebacks);
+		mutex_unlock(&mtdblk->cache_mutex);
+	}
+	mutex_unlock(&mtdblks_lock);
+
+	*eof = 1;
+	if (off >= len)
+		return 0;
+	*start = page + off;
+	return min(count, len - (int)off);
 }
-#endif
+#endif /* CONFIG_PROC_FS */
+
 static int mtdblock_open(struct mtd_blktrans_dev *mbd)
 {
 	struct mtdblk_dev *mtdblk;
@@ -316,10 +531,13 @@ static int mtdblock_open(struct mtd_blktrans_dev *mbd)
 	mtdblk->mtd = mtd;
 
 	mutex_init(&mtdblk->cache_mutex);
-	mtdblk->cache_state = STATE_EMPTY;
+	INIT_LIST_HEAD(&mtdblk->slots);
 	if ( !(mtdblk->mtd->flags & MTD_NO_ERASE) && mtdblk->mtd->erasesize) {
+		/* Slots are allocated on first use, up to max_slots */
 		mtdblk->cache_size = mtdblk->mtd->erasesize;
-		mtdblk->cache_data = NULL;
+		if (cache_kb > 0)
+			mtdblk->max_slots = ((u64)cache_kb << 10) /
+					    mtdblk->cache_size;
 	}
 
 	mtdblks[dev] = mtdblk;
@@ -340,7 +558,7 @@ static int mtdblock_release(struct mtd_blktrans_dev *mbd)
 	mutex_lock(&mtdblks_lock);
 
 	mutex_lock(&mtdblk->cache_mutex);
-	write_cached_data(mtdblk);
+	write_cached_data(mtdblk, 0);
 	mutex_unlock(&mtdblk->cache_mutex);
 
 	if (!--mtdblk->count) {
@@ -348,7 +566,7 @@ static int mtdblock_release(struct mtd_blktrans_dev *mbd)
 		mtdblks[dev] = NULL;
 		if (mtdblk->mtd->sync)
 			mtdblk->mtd->sync(mtdblk->mtd);
-		vfree(mtdblk->cache_data);
+		free_slots(mtdblk);
 		kfree(mtdblk);
 	}
 
@@ -364,7 +582,7 @@ static int mtdblock_flush(struct mtd_blktrans_dev *dev)
 	struct mtdblk_dev *mtdblk = mtdblks[dev->devnum];
 
 	mutex_lock(&mtdblk->cache_mutex);
-	write_cached_data(mtdblk);
+	write_cached_data(mtdblk, 0);
 	mutex_unlock(&mtdblk->cache_mutex);
 
 	if (mtdblk->mtd->sync)
@@ -414,13 +632,37 @@ static struct mtd_blktrans_ops mtdblock_tr = {
 
 static int __init init_mtdblock(void)
 {
+	int ret;
+
 	mutex_init(&mtdblks_lock);
 
-	return register_mtd_blktrans(&mtdblock_tr);
+	ret = register_mtd_blktrans(&mtdblock_tr);
+	if (ret)
+		return ret;
+
+	/* Nothing is ever dirty without a cache, so no flush thread */
+	if (cache_kb > 0) {
+		mtdblock_flush_thread = kthread_run(mtdblock_flushd, NULL,
+						    "mtdblock_flushd");
+		if (IS_ERR(mtdblock_flush_thread)) {
+			deregister_mtd_blktrans(&mtdblock_tr);
+			return PTR_ERR(mtdblock_flush_thread);
+		}
+	}
+
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("mtdblock", 0, NULL, mtdblock_read_proc, NULL);
+#endif
+	return 0;
 }
 
 static void __exit cleanup_mtdblock(void)
 {
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("mtdblock", NULL);
+#endif
+	if (mtdblock_flush_thread)
+		kthread_stop(mtdblock_flush_thread);
 	deregister_mtd_blktrans(&mtdblock_tr);
 }
 
@@ -0,0 +1,210 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * Test sequential read speed through the MTD block translation layer.
+ *
+ * Each of the block devices given in 'devs' (mtdblock or another
+ * translation layer, e.g. on nandsim) is read for 'mb' MiB with its page
+ * cache dropped, first one device at a time and then all of them at once,
+ * each from its own thread. The first figure shows what request merging
+ * gains for one device, the second what the blktrans workers gain when
+ * several partitions are busy. Nothing is written, e.g.
+ *
+ *	insmod mtd_blkspeedtest.ko devs=/dev/mtdblock3,/dev/mtdblock4
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+
+#define PRINT_PREF KERN_INFO "mtd_blkspeedtest: "
+
+#define MAX_DEVS	4
+#define MAX_BS		(128 * 1024)
+
+static char *devs[MAX_DEVS];
+static int nr_devs;
+module_param_array(devs, charp, &nr_devs, S_IRUGO);
+MODULE_PARM_DESC(devs, "Block devices to read, comma separated");
+
+static unsigned int mb = 16;
+module_param(mb, uint, S_IRUGO);
+MODULE_PARM_DESC(mb, "MiB to read from each device");
+
+static unsigned int bs = 64 * 1024;
+module_param(bs, uint, S_IRUGO);
+MODULE_PARM_DESC(bs, "Size of each read() in bytes");
+
+struct blkspeed_dev {
+	const char *path;
+	u64 bytes;
+	s64 us;
+	int err;
+};
+
+static struct blkspeed_dev dev_state[MAX_DEVS];
+static atomic_t running;
+static struct completion all_done;
+
+static int blkspeed_reader(void *data)
+{
+	struct blkspeed_dev *d = data;
+	u64 size = (u64)mb << 20;
+	mm_segment_t old_fs;
+	struct file *file;
+	ktime_t start;
+	loff_t pos = 0;
+	ssize_t n;
+	char *buf;
+
+	d->bytes = 0;
+	d->us = 0;
+	d->err = 0;
+
+	buf = kmalloc(bs, GFP_KERNEL);
+	if (!buf) {
+		d->err = -ENOMEM;
+		goto out;
+	}
+	file = filp_open(d->path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		d->err = PTR_ERR(file);
+		goto out_free;
+	}
+	invalidate_mapping_pages(file->f_mapping, 0, -1);
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	start = ktime_get();
+	while (pos < size) {
+		n = vfs_read(file, (char __user *)buf, bs, &pos);
+		if (n <= 0) {
+			/* a short device just ends the run early */
+			if (n < 0)
+				d->err = n;
+			break;
+		}
+	}
+	d->us = ktime_us_delta(ktime_get(), start);
+	set_fs(old_fs);
+	d->bytes = pos;
+
+	filp_close(file, NULL);
+out_free:
+	kfree(buf);
+out:
+	if (atomic_dec_and_test(&running))
+		complete(&all_done);
+	return 0;
+}
+
+static unsigned long long kib_per_sec(u64 bytes, s64 us)
+{
+	return div64_u64(bytes * USEC_PER_SEC, (us ? us : 1) * 1024);
+}
+
+/* Reads devices first..first+cnt-1 in parallel, returns the elapsed time */
+static s64 blkspeed_run(int first, int cnt)
+{
+	struct task_struct *task;
+	ktime_t start;
+	int i;
+
+	init_completion(&all_done);
+	atomic_set(&running, cnt + 1);
+	start = ktime_get();
+	for (i = first; i < first + cnt; i++) {
+		task = kthread_run(blkspeed_reader, &dev_state[i],
+				   "mtd_blkspeed%d", i);
+		if (IS_ERR(task)) {
+			dev_state[i].err = PTR_ERR(task);
+			dev_state[i].bytes = 0;
+			atomic_dec(&running);
+		}
+	}
+	if (!atomic_dec_and_test(&running))
+		wait_for_completion(&all_done);
+	return ktime_us_delta(ktime_get(), start);
+}
+
+static int __init mtd_blkspeedtest_init(void)
+{
+	u64 total = 0;
+	int i, err = 0;
+	s64 us;
+
+	printk(KERN_INFO "\n");
+	printk(KERN_INFO "=================================================\n");
+
+	if (!nr_devs || !mb || !bs || bs > MAX_BS || bs % 512) {
+		printk(PRINT_PREF "error: give devs=, and bs= up to %d in "
+		       "multiples of 512\n", MAX_BS);
+		return -EINVAL;
+	}
+	for (i = 0; i < nr_devs; i++)
+		dev_state[i].path = devs[i];
+
+	printk(PRINT_PREF "reading %u MiB per device, %u bytes at a time\n",
+	       mb, bs);
+
+	for (i = 0; i < nr_devs; i++) {
+		blkspeed_run(i, 1);
+		if (dev_state[i].err) {
+			printk(PRINT_PREF "error %d reading %s\n",
+			       dev_state[i].err, devs[i]);
+			err = dev_state[i].err;
+			continue;
+		}
+		printk(PRINT_PREF "%s alone: %llu KiB/s\n", devs[i],
+		       kib_per_sec(dev_state[i].bytes, dev_state[i].us));
+	}
+	if (err || nr_devs == 1)
+		goto out;
+
+	us = blkspeed_run(0, nr_devs);
+	for (i = 0; i < nr_devs; i++) {
+		if (dev_state[i].err) {
+			printk(PRINT_PREF "error %d reading %s\n",
+			       dev_state[i].err, devs[i]);
+			err = dev_state[i].err;
+			continue;
+		}
+		printk(PRINT_PREF "%s in parallel: %llu KiB/s\n", devs[i],
+		       kib_per_sec(dev_state[i].bytes, dev_state[i].us));
+		total += dev_state[i].bytes;
+	}
+	if (!err)
+		printk(PRINT_PREF "all %d in parallel: %llu KiB/s\n", nr_devs,
+		       kib_per_sec(total, us));
+out:
+	if (!err)
+		printk(PRINT_PREF "finished\n");
+	printk(KERN_INFO "=================================================\n");
+	return err;
+}
+module_init(mtd_blkspeedtest_init);
+
+static void __exit mtd_blkspeedtest_exit(void)
+{
+	return;
+}
+module_exit(mtd_blkspeedtest_exit);
+
+MODULE_DESCRIPTION("MTD block translation layer read speed test");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * Test how long UBI takes to attach an MTD device.
+ *
+ * The MTD device is attached and detached 'rounds' times through the UBI
+ * control device, first with UBI's fm_attach parameter off, so that every
+ * attach scans the whole flash, then with it on, so that every attach after
+ * the first uses the fastmap left behind by the previous detach. The device
+ * must carry a UBI image and must not be attached when the test starts.
+ * Repeating it with nandsim at several sizes shows how both methods scale,
+ * e.g. with 1024, 2048 and 4096 eraseblocks:
+ *
+ *	for size in 10 11 12; do
+ *		modprobe nandsim first_id_byte=0x20 second_id_byte=0xdc \
+ *			overridesize=$size
+ *		ubiformat /dev/mtd0
+ *		insmod mtd_ubiattachtest.ko dev=0
+ *		rmmod mtd_ubiattachtest nandsim
+ *	done
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include <mtd/ubi-user.h>
+
+#define PRINT_PREF KERN_INFO "mtd_ubiattachtest: "
+
+#define FM_ATTACH_PARAM "/sys/module/ubi/parameters/fm_attach"
+
+static int dev;
+module_param(dev, int, S_IRUGO);
+MODULE_PARM_DESC(dev, "MTD device number to use");
+
+static int rounds = 4;
+module_param(rounds, int, S_IRUGO);
+MODULE_PARM_DESC(rounds, "Number of times to attach and detach per method");
+
+static struct file *ctrl;
+
+/* Called with KERNEL_DS */
+static int set_fm_attach(int on)
+{
+	struct file *file;
+	loff_t pos = 0;
+	int err;
+
+	file = filp_open(FM_ATTACH_PARAM, O_WRONLY, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = vfs_write(file, (char __user *)(on ? "1" : "0"), 1, &pos);
+	filp_close(file, NULL);
+	return err < 0 ? err : 0;
+}
+
+/* Called with KERNEL_DS */
+static int attach_detach(s64 *attach_us, s64 *detach_us)
+{
+	struct ubi_attach_req req;
+	ktime_t start;
+	int err, ubi_num;
+
+	memset(&req, 0, sizeof(struct ubi_attach_req));
+	req.ubi_num = UBI_DEV_NUM_AUTO;
+	req.mtd_num = dev;
+
+	start = ktime_get();
+	err = ctrl->f_op->unlocked_ioctl(ctrl, UBI_IOCATT,
+					 (unsigned long)&req);
+	*attach_us = ktime_us_delta(ktime_get(), start);
+	if (err) {
+		printk(PRINT_PREF "error %d while attaching mtd%d\n",
+		       err, dev);
+		return err;
+	}
+
+	/* the new device number is passed back in the request */
+	ubi_num = req.ubi_num;
+
+	start = ktime_get();
+	err = ctrl->f_op->unlocked_ioctl(ctrl, UBI_IOCDET,
+					 (unsigned long)&ubi_num);
+	*detach_us = ktime_us_delta(ktime_get(), start);
+	if (err)
+		printk(PRINT_PREF "error %d while detaching ubi%d\n",
+		       err, ubi_num);
+	return err;
+}
+
+/* Called with KERNEL_DS */
+static int time_method(int fastmap)
+{
+	s64 attach_us, detach_us, total_us = 0, max_us = 0;
+	int i, err;
+
+	err = set_fm_attach(fastmap);
+	if (err) {
+		printk(PRINT_PREF "cannot set %s, error %d - no fastmap "
+		       "support?\n", FM_ATTACH_PARAM, err);
+		return err;
+	}
+
+	for (i = 0; i < rounds; i++) {
+		err = attach_detach(&attach_us, &detach_us);
+		if (err)
+			return err;
+		printk(PRINT_PREF "%s round %d: attach %lld ms, detach %lld "
+		       "ms\n", fastmap ? "fastmap" : "scan", i,
+		       div_s64(attach_us, 1000), div_s64(detach_us, 1000));
+		/* the first fastmap attach may still have to scan */
+		if (fastmap && i == 0)
+			continue;
+		total_us += attach_us;
+		if (attach_us > max_us)
+			max_us = attach_us;
+	}
+
+	i = fastmap ? rounds - 1 : rounds;
+	if (i)
+		printk(PRINT_PREF "%s: attach avg %lld ms, max %lld ms\n",
+		       fastmap ? "fastmap" : "scan",
+		       div_s64(div_s64(total_us, i), 1000),
+		       div_s64(max_us, 1000));
+	return 0;
+}
+
+static int __init mtd_ubiattachtest_init(void)
+{
+	mm_segment_t old_fs;
+	int err;
+
+	printk(KERN_INFO "\n");
+	printk(KERN_INFO "=================================================\n");
+
+	if (rounds < 2) {
+		printk(PRINT_PREF "error: rounds has to be at least 2\n");
+		return -EINVAL;
+	}
+
+	ctrl = filp_open("/dev/ubi_ctrl", O_RDONLY, 0);
+	if (IS_ERR(ctrl)) {
+		err = PTR_ERR(ctrl);
+		printk(PRINT_PREF "error %d while opening /dev/ubi_ctrl\n",
+		       err);
+		goto out_banner;
+	}
+	if (!ctrl->f_op || !ctrl->f_op->unlocked_ioctl) {
+		err = -ENOTTY;
+		goto out_close;
+	}
+
+	printk(PRINT_PREF "attaching mtd%d %d times per method\n", dev,
+	       rounds);
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	err = time_method(0);
+	if (!err)
+		err = time_method(1);
+	set_fm_attach(1);
+	set_fs(old_fs);
+
+	if (!err)
+		printk(PRINT_PREF "finished\n");
+out_close:
+	filp_close(ctrl, NULL);
+out_banner:
+	if (err)
+		printk(PRINT_PREF "error %d occurred\n", err);
+	printk(KERN_INFO "=================================================\n");
+	return err;
+}
+module_init(mtd_ubiattachtest_init);
+
+static void __exit mtd_ubiattachtest_exit(void)
+{
+	return;
+}
+module_exit(mtd_ubiattachtest_exit);
+
+MODULE_DESCRIPTION("UBI attach time test");
+MODULE_LICENSE("GPL");
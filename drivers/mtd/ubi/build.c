@@ -43,6 +43,8 @@
 #include <linux/kthread.h>
 #include <linux/reboot.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include "ubi.h"
 
 /* Maximum length of the 'mtd=' parameter */
@@ -562,25 +564,16 @@ static void free_internal_volumes(struct ubi_device *ubi)
 }
 
 /**
- * attach_by_scanning - attach an MTD device using scanning method.
+ * attach_si - build the UBI sub-systems from scanning information.
  * @ubi: UBI device descriptor
+ * @si: scanning information, freed by this function
  *
  * This function returns zero in case of success and a negative error code in
  * case of failure.
- *
- * Note, currently this is the only method to attach UBI devices. Hopefully in
- * the future we'll have more scalable attaching methods and avoid full media
- * scanning. But even in this case scanning will be needed as a fall-back
- * attaching method if there are some on-flash table corruptions.
  */
-static int attach_by_scanning(struct ubi_device *ubi)
+static int attach_si(struct ubi_device *ubi, struct ubi_scan_info *si)
 {
 	int err;
-	struct ubi_scan_info *si;
-
-	si = ubi_scan(ubi);
-	if (IS_ERR(si))
-		return PTR_ERR(si);
 
 	ubi->bad_peb_count = si->bad_peb_count;
 	ubi->good_peb_count = ubi->peb_count - ubi->bad_peb_count;
@@ -599,6 +592,7 @@ static int attach_by_scanning(struct ubi_device *ubi)
 	if (err)
 		goto out_wl;
 
+	ubi_fastmap_reserve(ubi, si);
 	ubi_scan_destroy_si(si);
 	return 0;
 
@@ -612,6 +606,59 @@ out_si:
 	return err;
 }
 
+/**
+ * attach_by_scanning - attach an MTD device using scanning method.
+ * @ubi: UBI device descriptor
+ *
+ * This function returns zero in case of success and a negative error code in
+ * case of failure.
+ *
+ * If the device carries a fastmap, the scanning information is built from it
+ * instead of reading every PEB. The full scan is the fall-back attaching method
+ * when there is no fastmap, or when the fastmap turns out to be inconsistent
+ * with the volume table. The time attaching took is printed either way, so
+ * that the two methods can be compared.
+ */
+static int attach_by_scanning(struct ubi_device *ubi)
+{
+	int i, err;
+	struct ubi_scan_info *si;
+	ktime_t start = ktime_get();
+
+	si = ubi_fastmap_scan(ubi);
+	if (si) {
+		err = attach_si(ubi, si);
+		if (!err) {
+			ubi_msg("attached using the fastmap in %lld ms",
+				div_s64(ktime_us_delta(ktime_get(), start),
+					1000));
+			return 0;
+		}
+
+		ubi_warn("cannot attach using the fastmap, error %d, "
+			 "falling back to full scan", err);
+		ubi_fastmap_forget(ubi);
+		/* attach_si() only frees the internal volumes on failure */
+		for (i = 0; i < ubi->vtbl_slots; i++)
+			kfree(ubi->volumes[i]);
+		memset(ubi->volumes, 0, sizeof(ubi->volumes));
+		ubi->vol_count = 0;
+		ubi->rsvd_pebs = ubi->avail_pebs = 0;
+		ubi->beb_rsvd_pebs = ubi->beb_rsvd_level = 0;
+		ubi->autoresize_vol_id = -1;
+	}
+
+	si = ubi_scan(ubi);
+	if (IS_ERR(si))
+		return PTR_ERR(si);
+
+	err = attach_si(ubi, si);
+	if (!err)
+		ubi_msg("attached by scanning in %lld ms",
+			div_s64(ktime_us_delta(ktime_get(), start), 1000));
+	return err;
+}
+
 /**
  * io_init - initialize I/O sub-system for a given UBI device.
  * @ubi: UBI device description object
@@ -854,6 +901,7 @@ static int ubi_reboot_notifier(struct notifier_block *n, unsigned long state,
 	if (ubi->bgt_thread)
 		kthread_stop(ubi->bgt_thread);
 	ubi_sync(ubi->ubi_num);
+	ubi_fastmap_write(ubi);
 	return NOTIFY_DONE;
 }
 
@@ -940,6 +988,10 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	mutex_init(&ubi->ckvol_mutex);
 	mutex_init(&ubi->device_mutex);
 	spin_lock_init(&ubi->volumes_lock);
+#ifdef CONFIG_MTD_UBI_FASTMAP
+	mutex_init(&ubi->fm_mutex);
+	init_rwsem(&ubi->fm_eba_sem);
+#endif
 
 	ubi_msg("attaching mtd%d to ubi%d", mtd->index, ubi_num);
 
@@ -1094,6 +1146,9 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 	if (ubi->bgt_thread)
 		kthread_stop(ubi->bgt_thread);
 
+	/* Leave a fastmap behind so that the next attach is quick */
+	ubi_fastmap_write(ubi);
+
 	/*
 	 * Get a reference to the device in order to prevent 'dev_release()'
 	 * from freeing @ubi object.
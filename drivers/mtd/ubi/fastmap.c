@@ -0,0 +1,865 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * UBI fast attach map (fastmap).
+ *
+ * Attaching an MTD device normally means reading the EC and VID headers of
+ * every physical eraseblock (see scan.c), which takes time proportional to the
+ * flash size. The fastmap is a snapshot of what scanning would find: the erase
+ * counter of every PEB and the LEB it is mapped to, or whether it is free,
+ * has to be erased or is bad. When a valid fastmap is found, the scanning
+ * information is built from it and only the first %UBI_FM_MAX_START PEBs are
+ * read.
+ *
+ * The fastmap consists of the anchor PEB, which carries &struct ubi_fm_sb and
+ * has to be one of the first %UBI_FM_MAX_START PEBs, and of data PEBs which
+ * may be anywhere. All of them carry VID headers of the fastmap internal
+ * volumes with the same sequence number. The data PEBs are written first and
+ * the anchor last, so a fastmap which was not completely written is never
+ * found.
+ *
+ * The fastmap stays correct only while no LEB is mapped, un-mapped or moved,
+ * and no PEB goes bad. So before the first such change the anchor PEB is
+ * erased and the fastmap is dropped (see 'ubi_fastmap_invalidate()'), and an
+ * unclean reboot at any later point makes the next attach fall back to full
+ * scanning. A new fastmap is written when the device is detached, on reboot,
+ * and by the background thread once the device has not been changed for
+ * @fm_idle_secs seconds. Erasures of PEBs the fastmap already lists as
+ * to-be-erased do not invalidate it, so their erase counters may lag by one
+ * after the next attach.
+ *
+ * While the fastmap is valid its PEBs are in no WL tree. They go back to the
+ * WL sub-system when the fastmap is invalidated. Enough PEBs for the largest
+ * possible fastmap are reserved when the device is attached.
+ */
+
+#include <linux/crc32.h>
+#include <linux/jiffies.h>
+#include <linux/moduleparam.h>
+#include "ubi.h"
+
+/*
+ * How long the device has to stay unchanged before the background thread
+ * writes a new fastmap, in seconds. Zero means the fastmap is only written on
+ * detach and reboot.
+ */
+static unsigned int fm_idle_secs = 30;
+module_param(fm_idle_secs, uint, 0644);
+MODULE_PARM_DESC(fm_idle_secs, "write the fastmap after this many seconds "
+		 "without changes (0 - only on detach and reboot)");
+
+/*
+ * Whether to attach from the fastmap at all. With this off the device is
+ * always scanned, which erases the old fastmap, so that attach times of both
+ * methods can be compared on the same flash.
+ */
+static int fm_attach = 1;
+module_param(fm_attach, bool, 0644);
+MODULE_PARM_DESC(fm_attach, "attach from the fastmap when there is one "
+		 "(0 - always scan)");
+
+/* Index of a volume in the volume table built by 'build_si()' */
+static int fm_vol_idx(int vol_id)
+{
+	if (vol_id >= 0 && vol_id < UBI_MAX_VOLUMES)
+		return vol_id;
+	if (vol_id == UBI_LAYOUT_VOLUME_ID)
+		return UBI_MAX_VOLUMES;
+	return -1;
+}
+
+/**
+ * fm_size - calculate fastmap size.
+ * @ubi: UBI device description object
+ * @vol_count: number of volumes
+ *
+ * This function returns how many bytes the fastmap super block and data take
+ * for @ubi with @vol_count volumes.
+ */
+static int fm_size(const struct ubi_device *ubi, int vol_count)
+{
+	return sizeof(struct ubi_fm_sb) + sizeof(struct ubi_fm_hdr) +
+	       vol_count * sizeof(struct ubi_fm_volhdr) +
+	       ubi->peb_count * sizeof(struct ubi_fm_peb);
+}
+
+/**
+ * add_to_list - add physical eraseblock to a list of scanning information.
+ * @pnum: physical eraseblock number to add
+ * @ec: erase counter of the physical eraseblock
+ * @list: the list to add to
+ *
+ * Returns zero in case of success and %-ENOMEM in case of failure.
+ */
+static int add_to_list(int pnum, int ec, struct list_head *list)
+{
+	struct ubi_scan_leb *seb;
+
+	seb = kmalloc(sizeof(struct ubi_scan_leb), GFP_KERNEL);
+	if (!seb)
+		return -ENOMEM;
+
+	seb->pnum = pnum;
+	seb->ec = ec;
+	list_add_tail(&seb->u.list, list);
+	return 0;
+}
+
+/**
+ * find_anchor - find the fastmap anchor PEB.
+ * @ubi: UBI device description object
+ * @ech: buffer for EC headers
+ * @vidh: buffer for VID headers
+ * @sqnum: sequence number of the anchor is returned here
+ * @image_seq: image sequence number of the anchor is returned here
+ *
+ * This function looks at the first %UBI_FM_MAX_START PEBs and returns the
+ * anchor with the highest sequence number, %-ENOENT if there is no anchor, or
+ * another negative error code in case of failure.
+ */
+static int find_anchor(struct ubi_device *ubi, struct ubi_ec_hdr *ech,
+		       struct ubi_vid_hdr *vidh, unsigned long long *sqnum,
+		       int *image_seq)
+{
+	int pnum, err, anchor = -ENOENT;
+	int last = min(ubi->peb_count, UBI_FM_MAX_START);
+
+	for (pnum = 0; pnum < last; pnum++) {
+		err = ubi_io_is_bad(ubi, pnum);
+		if (err < 0)
+			return err;
+		else if (err)
+			continue;
+
+		err = ubi_io_read_ec_hdr(ubi, pnum, ech, 0);
+		if (err < 0)
+			return err;
+		if ((err && err != UBI_IO_BITFLIPS) ||
+		    ech->version != UBI_VERSION)
+			continue;
+
+		err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+		if (err < 0)
+			return err;
+		if ((err && err != UBI_IO_BITFLIPS) ||
+		    be32_to_cpu(vidh->vol_id) != UBI_FM_SB_VOLUME_ID)
+			continue;
+
+		if (anchor < 0 || be64_to_cpu(vidh->sqnum) > *sqnum) {
+			anchor = pnum;
+			*sqnum = be64_to_cpu(vidh->sqnum);
+			*image_seq = be32_to_cpu(ech->image_seq);
+		}
+	}
+
+	return anchor;
+}
+
+/**
+ * check_sb - check the fastmap super block.
+ * @ubi: UBI device description object
+ * @sb: the super block to check
+ * @anchor: the PEB the super block was read from
+ * @sqnum: sequence number of the VID header of @anchor
+ *
+ * This function returns zero if the super block is fine and %-EINVAL if not.
+ */
+static int check_sb(const struct ubi_device *ubi, const struct ubi_fm_sb *sb,
+		    int anchor, unsigned long long sqnum)
+{
+	int i, err, used_blocks;
+	uint32_t crc, data_size;
+
+	crc = crc32(UBI_CRC32_INIT, sb,
+		    sizeof(struct ubi_fm_sb) - sizeof(__be32));
+	if (be32_to_cpu(sb->magic) != UBI_FM_SB_MAGIC ||
+	    be32_to_cpu(sb->hdr_crc) != crc) {
+		err = 1;
+		goto bad;
+	}
+
+	if (sb->version != UBI_FM_FMT_VERSION) {
+		err = 2;
+		goto bad;
+	}
+
+	if (be32_to_cpu(sb->peb_count) != ubi->peb_count ||
+	    be32_to_cpu(sb->leb_size) != ubi->leb_size ||
+	    be64_to_cpu(sb->sqnum) != sqnum) {
+		err = 3;
+		goto bad;
+	}
+
+	used_blocks = be32_to_cpu(sb->used_blocks);
+	data_size = be32_to_cpu(sb->data_size);
+	if (used_blocks < 1 || used_blocks > UBI_FM_MAX_BLOCKS ||
+	    data_size > used_blocks * ubi->leb_size ||
+	    DIV_ROUND_UP(sizeof(struct ubi_fm_sb) + data_size,
+			 ubi->leb_size) != used_blocks) {
+		err = 4;
+		goto bad;
+	}
+
+	if (be32_to_cpu(sb->block_loc[0]) != anchor) {
+		err = 5;
+		goto bad;
+	}
+
+	for (i = 1; i < used_blocks; i++)
+		if (be32_to_cpu(sb->block_loc[i]) >= ubi->peb_count) {
+			err = 6;
+			goto bad;
+		}
+
+	return 0;
+
+bad:
+	ubi_err("bad fastmap super block at PEB %d, error %d", anchor, err);
+	return -EINVAL;
+}
+
+/**
+ * build_si - build scanning information from fastmap data.
+ * @ubi: UBI device description object
+ * @sb: the fastmap super block, followed by the fastmap data
+ *
+ * This function returns the scanning information in case of success and an
+ * error pointer in case of failure.
+ */
+static struct ubi_scan_info *build_si(struct ubi_device *ubi,
+				      const struct ubi_fm_sb *sb)
+{
+	int i, j, err, pnum, vol_count, bad = 0, fm_blocks = 0;
+	const struct ubi_fm_hdr *hdr = (const void *)(sb + 1);
+	const struct ubi_fm_volhdr *vh, **vols;
+	const struct ubi_fm_peb *peb;
+	struct ubi_vid_hdr vid_hdr;
+	struct ubi_scan_info *si;
+
+	vol_count = be32_to_cpu(hdr->vol_count);
+	if (be32_to_cpu(hdr->magic) != UBI_FM_HDR_MAGIC ||
+	    be32_to_cpu(hdr->peb_count) != ubi->peb_count ||
+	    vol_count < 0 || vol_count > UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT ||
+	    fm_size(ubi, vol_count) !=
+	    sizeof(struct ubi_fm_sb) + be32_to_cpu(sb->data_size)) {
+		ubi_err("bad fastmap header");
+		return ERR_PTR(-EINVAL);
+	}
+
+	vols = kcalloc(UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT, sizeof(void *),
+		       GFP_KERNEL);
+	if (!vols)
+		return ERR_PTR(-ENOMEM);
+
+	vh = (const void *)(hdr + 1);
+	for (i = 0; i < vol_count; i++) {
+		j = fm_vol_idx(be32_to_cpu(vh[i].vol_id));
+		if (j < 0 || vols[j] || (vh[i].vol_type != UBI_VID_DYNAMIC &&
+					 vh[i].vol_type != UBI_VID_STATIC)) {
+			ubi_err("bad fastmap volume record %d", i);
+			err = -EINVAL;
+			goto out_vols;
+		}
+		vols[j] = &vh[i];
+	}
+
+	err = -ENOMEM;
+	si = kzalloc(sizeof(struct ubi_scan_info), GFP_KERNEL);
+	if (!si)
+		goto out_vols;
+
+	INIT_LIST_HEAD(&si->corr);
+	INIT_LIST_HEAD(&si->free);
+	INIT_LIST_HEAD(&si->erase);
+	INIT_LIST_HEAD(&si->alien);
+	INIT_LIST_HEAD(&si->fm);
+	si->volumes = RB_ROOT;
+
+	peb = (const void *)(vh + vol_count);
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		uint32_t state = be32_to_cpu(peb[pnum].vol_id);
+		int ec = be32_to_cpu(peb[pnum].ec);
+
+		cond_resched();
+
+		if (state == UBI_FM_PEB_BAD) {
+			bad += 1;
+			continue;
+		}
+
+		err = -EINVAL;
+		if (ec < 0 || ec > UBI_MAX_ERASECOUNTER) {
+			ubi_err("bad erase counter %d of PEB %d", ec, pnum);
+			goto out_si;
+		}
+
+		switch (state) {
+		case UBI_FM_PEB_FREE:
+			err = add_to_list(pnum, ec, &si->free);
+			break;
+		case UBI_FM_PEB_ERASE:
+			err = add_to_list(pnum, ec, &si->erase);
+			break;
+		case UBI_FM_PEB_MAP:
+			for (i = 0; i < be32_to_cpu(sb->used_blocks); i++)
+				if (be32_to_cpu(sb->block_loc[i]) == pnum)
+					break;
+			if (i == be32_to_cpu(sb->used_blocks)) {
+				ubi_err("PEB %d is not a fastmap PEB", pnum);
+				goto out_si;
+			}
+			fm_blocks += 1;
+			err = add_to_list(pnum, ec, &si->fm);
+			break;
+		default:
+			j = fm_vol_idx(state);
+			if (j < 0 || !vols[j]) {
+				ubi_err("PEB %d belongs to unknown volume %u",
+					pnum, state);
+				goto out_si;
+			}
+
+			/* What the VID header would tell the scanning code */
+			vh = vols[j];
+			memset(&vid_hdr, 0, sizeof(struct ubi_vid_hdr));
+			vid_hdr.vol_type = vh->vol_type;
+			vid_hdr.compat = vh->compat;
+			vid_hdr.vol_id = vh->vol_id;
+			vid_hdr.lnum = peb[pnum].lnum;
+			vid_hdr.data_size = vh->last_data_size;
+			vid_hdr.used_ebs = vh->used_ebs;
+			vid_hdr.data_pad = vh->data_pad;
+			err = ubi_scan_add_used(ubi, si, pnum, ec, &vid_hdr, 0);
+			break;
+		}
+		if (err)
+			goto out_si;
+
+		si->ec_sum += ec;
+		si->ec_count += 1;
+		if (ec > si->max_ec)
+			si->max_ec = ec;
+		if (ec < si->min_ec)
+			si->min_ec = ec;
+	}
+
+	if (bad != be32_to_cpu(hdr->bad_peb_count) ||
+	    fm_blocks != be32_to_cpu(sb->used_blocks)) {
+		ubi_err("inconsistent fastmap PEB records");
+		err = -EINVAL;
+		goto out_si;
+	}
+
+	si->bad_peb_count = bad;
+	if (si->ec_count)
+		si->mean_ec = div_u64(si->ec_sum, si->ec_count);
+	si->max_sqnum = be64_to_cpu(sb->sqnum);
+
+	kfree(vols);
+	return si;
+
+out_si:
+	ubi_scan_destroy_si(si);
+out_vols:
+	kfree(vols);
+	return ERR_PTR(err);
+}
+
+/**
+ * ubi_fastmap_scan - build scanning information from the fastmap.
+ * @ubi: UBI device description object
+ *
+ * This function looks for a fastmap on @ubi and, if there is a valid one,
+ * returns the scanning information it describes. Otherwise it returns %NULL
+ * and the device has to be scanned.
+ */
+struct ubi_scan_info *ubi_fastmap_scan(struct ubi_device *ubi)
+{
+	int i, err, anchor, pnum, len, used_blocks, image_seq = 0;
+	unsigned long long sqnum = 0;
+	struct ubi_ec_hdr *ech;
+	struct ubi_vid_hdr *vidh;
+	struct ubi_fm_sb *sb = NULL;
+	struct ubi_scan_info *si = NULL;
+	uint32_t crc, total;
+	void *buf = NULL;
+
+	if (!fm_attach)
+		return NULL;
+
+	ech = kzalloc(ubi->ec_hdr_alsize, GFP_KERNEL);
+	vidh = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!ech || !vidh)
+		goto out_free;
+
+	anchor = find_anchor(ubi, ech, vidh, &sqnum, &image_seq);
+	if (anchor < 0) {
+		if (anchor != -ENOENT)
+			ubi_err("error %d while looking for the fastmap",
+				anchor);
+		else
+			dbg_bld("no fastmap found");
+		goto out_free;
+	}
+
+	sb = kmalloc(sizeof(struct ubi_fm_sb), GFP_KERNEL);
+	if (!sb)
+		goto out_free;
+
+	err = ubi_io_read_data(ubi, sb, anchor, 0, sizeof(struct ubi_fm_sb));
+	if ((err && err != UBI_IO_BITFLIPS) ||
+	    check_sb(ubi, sb, anchor, sqnum))
+		goto out_bad;
+
+	/* The data follows the super block, read them together */
+	used_blocks = be32_to_cpu(sb->used_blocks);
+	total = sizeof(struct ubi_fm_sb) + be32_to_cpu(sb->data_size);
+	buf = vmalloc(total);
+	if (!buf)
+		goto out_free;
+
+	for (i = 0; i < used_blocks; i++) {
+		pnum = be32_to_cpu(sb->block_loc[i]);
+		if (i) {
+			int vol_id;
+
+			err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+			vol_id = be32_to_cpu(vidh->vol_id);
+			if ((err && err != UBI_IO_BITFLIPS) ||
+			    vol_id != UBI_FM_DATA_VOLUME_ID ||
+			    be32_to_cpu(vidh->lnum) != i ||
+			    be64_to_cpu(vidh->sqnum) != sqnum) {
+				ubi_err("bad fastmap PEB %d", pnum);
+				goto out_bad;
+			}
+		}
+
+		len = min_t(int, total - i * ubi->leb_size, ubi->leb_size);
+		err = ubi_io_read_data(ubi, buf + i * ubi->leb_size, pnum, 0,
+				       len);
+		if (err && err != UBI_IO_BITFLIPS)
+			goto out_bad;
+	}
+
+	if (memcmp(buf, sb, sizeof(struct ubi_fm_sb))) {
+		ubi_err("fastmap super block changed while reading");
+		goto out_bad;
+	}
+
+	crc = crc32(UBI_CRC32_INIT, buf + sizeof(struct ubi_fm_sb),
+		    be32_to_cpu(sb->data_size));
+	if (crc != be32_to_cpu(sb->data_crc)) {
+		ubi_err("bad fastmap data CRC %#08x, read %#08x",
+			be32_to_cpu(sb->data_crc), crc);
+		goto out_bad;
+	}
+
+	si = build_si(ubi, buf);
+	if (IS_ERR(si)) {
+		si = NULL;
+		goto out_bad;
+	}
+
+	if (image_seq)
+		ubi->image_seq = image_seq;
+	for (i = 0; i < used_blocks; i++)
+		ubi->fm.pnum[i] = be32_to_cpu(sb->block_loc[i]);
+	ubi->fm.used_blocks = used_blocks;
+	ubi_msg("attached by fastmap at PEB %d (%d PEBs)", anchor,
+		used_blocks);
+	goto out_free;
+
+out_bad:
+	ubi_warn("cannot use the fastmap at PEB %d, scanning", anchor);
+out_free:
+	vfree(buf);
+	kfree(sb);
+	ubi_free_vid_hdr(ubi, vidh);
+	kfree(ech);
+	return si;
+}
+
+/**
+ * ubi_fastmap_forget - forget the fastmap the device was attached from.
+ * @ubi: UBI device description object
+ *
+ * This function is called when attaching from the fastmap failed and the
+ * device is going to be scanned. Scanning erases the fastmap PEBs, because
+ * their volumes are "delete" compatible.
+ */
+void ubi_fastmap_forget(struct ubi_device *ubi)
+{
+	ubi->fm.used_blocks = 0;
+	ubi->fm_rsvd_pebs = 0;
+	ubi->fm_disabled = 0;
+}
+
+/**
+ * ubi_fastmap_reserve - reserve physical eraseblocks for the fastmap.
+ * @ubi: UBI device description object
+ * @si: scanning information
+ *
+ * This function is called at the end of attaching and reserves enough PEBs
+ * for the largest fastmap @ubi may need. If that is not possible, the fastmap
+ * is disabled for @ubi.
+ */
+void ubi_fastmap_reserve(struct ubi_device *ubi,
+			 const struct ubi_scan_info *si)
+{
+	int blocks;
+
+	ubi->fm_last_change = jiffies;
+
+	/* The fastmap has no record for alien PEBs */
+	if (si->alien_peb_count) {
+		ubi_warn("alien PEBs found, fastmap disabled");
+		ubi->fm_disabled = 1;
+		return;
+	}
+
+	blocks = DIV_ROUND_UP(fm_size(ubi, UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT),
+			      ubi->leb_size);
+	if (blocks > UBI_FM_MAX_BLOCKS || ubi->avail_pebs < blocks) {
+		ubi_warn("no PEBs to reserve for the fastmap (need %d, "
+			 "available %d), fastmap disabled", blocks,
+			 ubi->avail_pebs);
+		ubi->fm_disabled = 1;
+		return;
+	}
+
+	ubi->avail_pebs -= blocks;
+	ubi->rsvd_pebs += blocks;
+	ubi->fm_rsvd_pebs = blocks;
+}
+
+/**
+ * ubi_fastmap_invalidate - invalidate the on-flash fastmap.
+ * @ubi: UBI device description object
+ *
+ * This function has to be called before any change which the fastmap does not
+ * describe reaches the flash. It erases the anchor PEB and returns the
+ * fastmap PEBs to the WL sub-system. Returns zero in case of success and a
+ * negative error code in case of failure, in which case the device is
+ * switched to read-only mode.
+ *
+ * Everybody who may change the flash holds @ubi->fm_eba_sem or
+ * @ubi->work_sem, which the fastmap writer takes for writing, so the unlocked
+ * check of @ubi->fm below cannot miss a fastmap which was just written.
+ */
+int ubi_fastmap_invalidate(struct ubi_device *ubi)
+{
+	int i, err = 0, wl_ready;
+	struct ubi_fastmap fm;
+
+	ubi->fm_last_change = jiffies;
+	if (!ubi->fm.used_blocks)
+		return 0;
+
+	mutex_lock(&ubi->fm_mutex);
+	if (!ubi->fm.used_blocks)
+		goto out_unlock;
+
+	fm = ubi->fm;
+	dbg_gen("invalidate fastmap at PEB %d", fm.pnum[0]);
+
+	/* Before the WL sub-system is initialized the PEBs have no entries */
+	wl_ready = ubi->lookuptbl && ubi->lookuptbl[fm.pnum[0]];
+	if (wl_ready)
+		err = ubi_wl_put_fm_peb(ubi, fm.pnum[0], 1);
+	else
+		err = ubi_io_sync_erase(ubi, fm.pnum[0], 0);
+	if (err < 0) {
+		ubi_err("cannot erase fastmap anchor PEB %d, error %d",
+			fm.pnum[0], err);
+		ubi_ro_mode(ubi);
+		goto out_unlock;
+	}
+
+	ubi->fm.used_blocks = 0;
+	err = 0;
+	if (!wl_ready)
+		goto out_unlock;
+
+	for (i = 1; i < fm.used_blocks; i++) {
+		err = ubi_wl_put_fm_peb(ubi, fm.pnum[i], 0);
+		if (err) {
+			ubi_ro_mode(ubi);
+			goto out_unlock;
+		}
+	}
+
+	/* Let the background thread write a new fastmap later */
+	spin_lock(&ubi->wl_lock);
+	if (ubi->thread_enabled)
+		wake_up_process(ubi->bgt_thread);
+	spin_unlock(&ubi->wl_lock);
+
+out_unlock:
+	mutex_unlock(&ubi->fm_mutex);
+	return err;
+}
+
+/**
+ * fill_fastmap - fill the fastmap super block and data.
+ * @ubi: UBI device description object
+ * @sb: buffer for the super block and the data
+ * @fm: the PEBs the fastmap is going to be written to
+ * @vol_count: number of volumes
+ *
+ * The caller has to hold @ubi->work_sem and @ubi->fm_eba_sem for writing.
+ */
+static void fill_fastmap(struct ubi_device *ubi, struct ubi_fm_sb *sb,
+			 const struct ubi_fastmap *fm, int vol_count)
+{
+	int i, lnum, pnum, bad = 0;
+	struct ubi_fm_hdr *hdr = (void *)(sb + 1);
+	struct ubi_fm_volhdr *vh = (void *)(hdr + 1);
+	struct ubi_fm_peb *peb = (void *)(vh + vol_count);
+	struct ubi_wl_entry *e;
+	struct ubi_volume *vol;
+	struct rb_node *rb;
+
+	spin_lock(&ubi->wl_lock);
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		e = ubi->lookuptbl[pnum];
+		if (!e) {
+			peb[pnum].vol_id = cpu_to_be32(UBI_FM_PEB_BAD);
+			bad += 1;
+			continue;
+		}
+		peb[pnum].ec = cpu_to_be32(e->ec);
+		peb[pnum].vol_id = cpu_to_be32(UBI_FM_PEB_ERASE);
+	}
+
+	ubi_rb_for_each_entry(rb, e, &ubi->free, u.rb)
+		peb[e->pnum].vol_id = cpu_to_be32(UBI_FM_PEB_FREE);
+
+	for (i = 0; i < fm->used_blocks; i++) {
+		pnum = fm->pnum[i];
+		peb[pnum].vol_id = cpu_to_be32(UBI_FM_PEB_MAP);
+		peb[pnum].lnum = cpu_to_be32(i);
+		sb->block_loc[i] = cpu_to_be32(pnum);
+		sb->block_ec[i] = cpu_to_be32(ubi->lookuptbl[pnum]->ec);
+	}
+	spin_unlock(&ubi->wl_lock);
+
+	spin_lock(&ubi->volumes_lock);
+	for (i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++) {
+		vol = ubi->volumes[i];
+		if (!vol)
+			continue;
+
+		vh->vol_id = cpu_to_be32(vol->vol_id);
+		vh->data_pad = cpu_to_be32(vol->data_pad);
+		if (vol->vol_id == UBI_LAYOUT_VOLUME_ID)
+			vh->compat = UBI_LAYOUT_VOLUME_COMPAT;
+		if (vol->vol_type == UBI_STATIC_VOLUME) {
+			vh->vol_type = UBI_VID_STATIC;
+			vh->used_ebs = cpu_to_be32(vol->used_ebs);
+			vh->last_data_size = cpu_to_be32(vol->last_eb_bytes);
+		} else
+			vh->vol_type = UBI_VID_DYNAMIC;
+		vh += 1;
+
+		for (lnum = 0; lnum < vol->reserved_pebs; lnum++) {
+			pnum = vol->eba_tbl[lnum];
+			if (pnum < 0)
+				continue;
+			peb[pnum].vol_id = cpu_to_be32(vol->vol_id);
+			peb[pnum].lnum = cpu_to_be32(lnum);
+		}
+	}
+	spin_unlock(&ubi->volumes_lock);
+
+	hdr->magic = cpu_to_be32(UBI_FM_HDR_MAGIC);
+	hdr->peb_count = cpu_to_be32(ubi->peb_count);
+	hdr->vol_count = cpu_to_be32(vol_count);
+	hdr->bad_peb_count = cpu_to_be32(bad);
+
+	i = fm_size(ubi, vol_count) - sizeof(struct ubi_fm_sb);
+	sb->magic = cpu_to_be32(UBI_FM_SB_MAGIC);
+	sb->version = UBI_FM_FMT_VERSION;
+	sb->data_size = cpu_to_be32(i);
+	sb->data_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, hdr, i));
+	sb->used_blocks = cpu_to_be32(fm->used_blocks);
+	sb->peb_count = cpu_to_be32(ubi->peb_count);
+	sb->leb_size = cpu_to_be32(ubi->leb_size);
+}
+
+/**
+ * write_fastmap - write a new fastmap.
+ * @ubi: UBI device description object
+ *
+ * This function stops all EBA and WL activity, takes a snapshot and writes it
+ * to the flash. It does nothing if the on-flash fastmap is still valid. The
+ * caller has to hold @ubi->device_mutex. Returns zero in case of success and
+ * a negative error code in case of failure.
+ */
+static int write_fastmap(struct ubi_device *ubi)
+{
+	int i, err = 0, size, len, vol_count = 0;
+	unsigned long long sqnum;
+	struct ubi_fastmap fm = { 0 };
+	struct ubi_vid_hdr *vidh = NULL;
+	struct ubi_fm_sb *sb = NULL;
+	struct ubi_volume *vol;
+
+	down_write(&ubi->fm_eba_sem);
+	down_write(&ubi->work_sem);
+	mutex_lock(&ubi->fm_mutex);
+
+	if (ubi->fm.used_blocks || ubi->fm_disabled || ubi->ro_mode)
+		goto out_unlock;
+
+	/* The fastmap cannot describe volumes in the middle of a change */
+	spin_lock(&ubi->volumes_lock);
+	for (i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++) {
+		vol = ubi->volumes[i];
+		if (!vol)
+			continue;
+		if (vol->updating || vol->changing_leb || vol->upd_marker ||
+		    vol->corrupted)
+			err = -EBUSY;
+		vol_count += 1;
+	}
+	spin_unlock(&ubi->volumes_lock);
+	if (err) {
+		dbg_gen("volumes are being changed, no fastmap");
+		goto out_unlock;
+	}
+
+	size = fm_size(ubi, vol_count);
+	fm.used_blocks = DIV_ROUND_UP(size, ubi->leb_size);
+	ubi_assert(fm.used_blocks <= ubi->fm_rsvd_pebs);
+
+	err = -ENOMEM;
+	vidh = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
+	if (!vidh)
+		goto out_unlock;
+
+	sb = vmalloc(fm.used_blocks * ubi->leb_size);
+	if (!sb)
+		goto out_unlock;
+	memset(sb, 0, fm.used_blocks * ubi->leb_size);
+
+	for (i = 0; i < fm.used_blocks; i++) {
+		err = ubi_wl_get_fm_peb(ubi, i == 0);
+		if (err < 0) {
+			dbg_gen("no PEBs for the fastmap, error %d", err);
+			fm.used_blocks = i;
+			goto out_put;
+		}
+		fm.pnum[i] = err;
+	}
+
+	fill_fastmap(ubi, sb, &fm, vol_count);
+	sqnum = ubi_next_sqnum(ubi);
+	sb->sqnum = cpu_to_be64(sqnum);
+	sb->hdr_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, sb,
+			sizeof(struct ubi_fm_sb) - sizeof(__be32)));
+
+	vidh->vol_type = UBI_FM_VOLUME_TYPE;
+	vidh->compat = UBI_FM_VOLUME_COMPAT;
+	vidh->sqnum = cpu_to_be64(sqnum);
+
+	/* The anchor goes last, it makes the fastmap visible */
+	for (i = fm.used_blocks - 1; i >= 0; i--) {
+		vidh->vol_id = cpu_to_be32(i ? UBI_FM_DATA_VOLUME_ID :
+					       UBI_FM_SB_VOLUME_ID);
+		vidh->lnum = cpu_to_be32(i);
+		err = ubi_io_write_vid_hdr(ubi, fm.pnum[i], vidh);
+		if (err)
+			goto out_err;
+
+		len = min(size - i * ubi->leb_size, ubi->leb_size);
+		len = ALIGN(len, ubi->min_io_size);
+		err = ubi_io_write_data(ubi, (void *)sb + i * ubi->leb_size,
+					fm.pnum[i], 0, len);
+		if (err)
+			goto out_err;
+	}
+
+	ubi->fm = fm;
+	dbg_gen("fastmap written at PEB %d (%d PEBs), sqnum %llu",
+		fm.pnum[0], fm.used_blocks, sqnum);
+	goto out_unlock;
+
+out_err:
+	ubi_err("cannot write fastmap to PEB %d, error %d", fm.pnum[i], err);
+out_put:
+	for (i = 0; i < fm.used_blocks; i++)
+		ubi_wl_put_fm_peb(ubi, fm.pnum[i], 0);
+out_unlock:
+	mutex_unlock(&ubi->fm_mutex);
+	up_write(&ubi->work_sem);
+	up_write(&ubi->fm_eba_sem);
+	vfree(sb);
+	ubi_free_vid_hdr(ubi, vidh);
+	return err;
+}
+
+/**
+ * ubi_fastmap_write - write a new fastmap if the on-flash one is stale.
+ * @ubi: UBI device description object
+ *
+ * This function is called when the device is detached and on reboot. Returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+int ubi_fastmap_write(struct ubi_device *ubi)
+{
+	int err;
+
+	mutex_lock(&ubi->device_mutex);
+	err = write_fastmap(ubi);
+	mutex_unlock(&ubi->device_mutex);
+	return err;
+}
+
+/**
+ * ubi_fastmap_idle - let the idle background thread write the fastmap.
+ * @ubi: UBI device description object
+ *
+ * This function is called by the background thread when it has nothing to do
+ * and is about to sleep. If the fastmap is stale and the device has not been
+ * changed for @fm_idle_secs, a new fastmap is written. Returns how long the
+ * thread may sleep.
+ */
+long ubi_fastmap_idle(struct ubi_device *ubi)
+{
+	int err = -EBUSY;
+	long left;
+
+	if (!fm_idle_secs || ubi->fm.used_blocks || ubi->fm_disabled ||
+	    ubi->ro_mode || !ubi->thread_enabled)
+		return MAX_SCHEDULE_TIMEOUT;
+
+	left = (long)(ubi->fm_last_change +
+		      (unsigned long)fm_idle_secs * HZ - jiffies);
+	if (left > 0)
+		return left;
+
+	__set_current_state(TASK_RUNNING);
+
+	/* Do not wait for volume operations, try again later instead */
+	if (mutex_trylock(&ubi->device_mutex)) {
+		err = write_fastmap(ubi);
+		mutex_unlock(&ubi->device_mutex);
+	}
+	if (err)
+		ubi->fm_last_change = jiffies;
+	return 0;
+}
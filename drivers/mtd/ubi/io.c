@@ -605,7 +605,7 @@ int ubi_io_is_bad(const struct ubi_device *ubi, int pnum)
  * This function returns zero in case of success and a negative error code in
  * case of failure.
  */
-int ubi_io_mark_bad(const struct ubi_device *ubi, int pnum)
+int ubi_io_mark_bad(struct ubi_device *ubi, int pnum)
 {
 	int err;
 	struct mtd_info *mtd = ubi->mtd;
@@ -620,6 +620,11 @@ int ubi_io_mark_bad(const struct ubi_device *ubi, int pnum)
 	if (!ubi->bad_allowed)
 		return 0;
 
+	/* The fastmap does not know about the new bad PEB */
+	err = ubi_fastmap_invalidate(ubi);
+	if (err)
+		return err;
+
 	err = mtd->block_markbad(mtd, (loff_t)pnum * ubi->peb_size);
 	if (err)
 		ubi_err("cannot mark PEB %d bad, error %d", pnum, err);
@@ -1067,6 +1072,9 @@ int ubi_io_read_vid_hdr(struct ubi_device *ubi, int pnum,
  * @vid_hdr->magic and the @vid_hdr->version fields, as well as calculates
  * header CRC checksum and stores it at vid_hdr->hdr_crc.
  *
+ * Writing a VID header changes the LEB to PEB mapping, so the on-flash fastmap
+ * is invalidated first.
+ *
  * This function returns zero in case of success and a negative error code in
  * case of failure. If %-EIO is returned, the physical eraseblock probably went
  * bad.
@@ -1094,6 +1102,10 @@ int ubi_io_write_vid_hdr(struct ubi_device *ubi, int pnum,
 	if (err)
 		return -EINVAL;
 
+	err = ubi_fastmap_invalidate(ubi);
+	if (err)
+		return err;
+
 	p = (char *)vid_hdr - ubi->vid_hdr_shift;
 	err = ubi_io_write(ubi, p, pnum, ubi->vid_hdr_aloffset,
 			   ubi->vid_hdr_alsize);
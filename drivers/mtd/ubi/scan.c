@@ -907,6 +907,7 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 	INIT_LIST_HEAD(&si->free);
 	INIT_LIST_HEAD(&si->erase);
 	INIT_LIST_HEAD(&si->alien);
+	INIT_LIST_HEAD(&si->fm);
 	si->volumes = RB_ROOT;
 	si->is_empty = 1;
 
@@ -1053,6 +1054,10 @@ void ubi_scan_destroy_si(struct ubi_scan_info *si)
 		list_del(&seb->u.list);
 		kfree(seb);
 	}
+	list_for_each_entry_safe(seb, seb_tmp, &si->fm, u.list) {
+		list_del(&seb->u.list);
+		kfree(seb);
+	}
 
 	/* Destroy the volume RB-tree */
 	rb = si->volumes.rb_node;
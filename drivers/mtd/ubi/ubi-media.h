@@ -312,6 +312,28 @@ struct ubi_vid_hdr {
 #define UBI_LAYOUT_VOLUME_NAME   "layout volume"
 #define UBI_LAYOUT_VOLUME_COMPAT UBI_COMPAT_REJECT
 
+/*
+ * The fastmap volumes contain the fast attach map (see fastmap.c). They are
+ * "delete" compatible, so an implementation which does not know them simply
+ * erases the map. The super block lives in the anchor PEB, which is always one
+ * of the first %UBI_FM_MAX_START PEBs of the device.
+ */
+#define UBI_FM_SB_VOLUME_ID      (UBI_INTERNAL_VOL_START + 1)
+#define UBI_FM_DATA_VOLUME_ID    (UBI_INTERNAL_VOL_START + 2)
+#define UBI_FM_VOLUME_TYPE       UBI_VID_DYNAMIC
+#define UBI_FM_VOLUME_COMPAT     UBI_COMPAT_DELETE
+#define UBI_FM_MAX_START         64
+#define UBI_FM_MAX_BLOCKS        32
+#define UBI_FM_FMT_VERSION       1
+#define UBI_FM_SB_MAGIC          0x7B11D69F
+#define UBI_FM_HDR_MAGIC         0xD4B82EF7
+
+/* PEB states in &struct ubi_fm_peb for PEBs which belong to no volume */
+#define UBI_FM_PEB_FREE  0xFFFFFFFF
+#define UBI_FM_PEB_ERASE 0xFFFFFFFE
+#define UBI_FM_PEB_BAD   0xFFFFFFFD
+#define UBI_FM_PEB_MAP   0xFFFFFFFC
+
 /* The maximum number of volumes per one UBI device */
 #define UBI_MAX_VOLUMES 128
 
@@ -375,4 +397,93 @@ struct ubi_vtbl_record {
 	__be32  crc;
 } __attribute__ ((packed));
 
+/**
+ * struct ubi_fm_sb - fastmap super block.
+ * @magic: fastmap super block magic number (%UBI_FM_SB_MAGIC)
+ * @version: format version of the fastmap (%UBI_FM_FMT_VERSION)
+ * @padding1: reserved, zeroes
+ * @data_size: size of the map data following the super block
+ * @data_crc: CRC32 checksum of the map data
+ * @used_blocks: number of PEBs the fastmap occupies, including the anchor
+ * @block_loc: PEB numbers of the fastmap, the anchor PEB first
+ * @block_ec: erase counters of the fastmap PEBs
+ * @sqnum: sequence number of the VID headers of all fastmap PEBs
+ * @peb_count: number of PEBs of the device the fastmap was written for
+ * @leb_size: logical eraseblock size the fastmap was written for
+ * @padding2: reserved, zeroes
+ * @hdr_crc: CRC32 checksum of the super block
+ *
+ * The super block sits at the beginning of the data area of the anchor PEB.
+ * The map data starts right after it and continues in the data area of the
+ * following fastmap PEBs, in @block_loc order. It consists of a
+ * &struct ubi_fm_hdr, one &struct ubi_fm_volhdr per volume and one
+ * &struct ubi_fm_peb per physical eraseblock of the device.
+ */
+struct ubi_fm_sb {
+	__be32  magic;
+	__u8    version;
+	__u8    padding1[3];
+	__be32  data_size;
+	__be32  data_crc;
+	__be32  used_blocks;
+	__be32  block_loc[UBI_FM_MAX_BLOCKS];
+	__be32  block_ec[UBI_FM_MAX_BLOCKS];
+	__be64  sqnum;
+	__be32  peb_count;
+	__be32  leb_size;
+	__u8    padding2[28];
+	__be32  hdr_crc;
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_fm_hdr - header of the fastmap data.
+ * @magic: fastmap header magic number (%UBI_FM_HDR_MAGIC)
+ * @peb_count: number of &struct ubi_fm_peb records
+ * @vol_count: number of &struct ubi_fm_volhdr records
+ * @bad_peb_count: number of bad physical eraseblocks
+ */
+struct ubi_fm_hdr {
+	__be32  magic;
+	__be32  peb_count;
+	__be32  vol_count;
+	__be32  bad_peb_count;
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_fm_volhdr - volume description in the fastmap.
+ * @vol_id: volume ID
+ * @vol_type: volume type (%UBI_VID_DYNAMIC or %UBI_VID_STATIC)
+ * @compat: compatibility flags of the volume
+ * @padding: reserved, zeroes
+ * @used_ebs: number of used logical eraseblocks (static volumes only)
+ * @data_pad: how many bytes at the end of logical eraseblocks are not used
+ * @last_data_size: data size in the last logical eraseblock (static volumes
+ *                  only)
+ *
+ * These are the fields the VID headers of the volume would have provided to
+ * the scanning code.
+ */
+struct ubi_fm_volhdr {
+	__be32  vol_id;
+	__u8    vol_type;
+	__u8    compat;
+	__u8    padding[2];
+	__be32  used_ebs;
+	__be32  data_pad;
+	__be32  last_data_size;
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_fm_peb - physical eraseblock description in the fastmap.
+ * @ec: erase counter
+ * @vol_id: ID of the volume the PEB belongs to, or one of the %UBI_FM_PEB_*
+ *          states
+ * @lnum: logical eraseblock number the PEB is mapped to
+ */
+struct ubi_fm_peb {
+	__be32  ec;
+	__be32  vol_id;
+	__be32  lnum;
+} __attribute__ ((packed));
+
 #endif /* !__UBI_MEDIA_H__ */
@@ -286,6 +286,20 @@ struct ubi_volume_desc {
 	int mode;
 };
 
+/**
+ * struct ubi_fastmap - the on-flash fast attach map.
+ * @used_blocks: number of PEBs the map occupies, zero if there is no valid
+ *               map on the flash
+ * @pnum: PEB numbers of the map, the anchor PEB first
+ *
+ * While the map is valid its PEBs belong to no volume and to no WL tree. See
+ * fastmap.c for details.
+ */
+struct ubi_fastmap {
+	int used_blocks;
+	int pnum[UBI_FM_MAX_BLOCKS];
+};
+
 struct ubi_wl_entry;
 
 /**
@@ -351,6 +365,15 @@ struct ubi_wl_entry;
  * @bgt_name: background thread name
  * @reboot_notifier: notifier to terminate background thread before rebooting
  *
+ * @fm: the fast attach map currently on the flash
+ * @fm_mutex: protects @fm
+ * @fm_eba_sem: taken for reading by EBA writers, for writing while the map is
+ *              being written
+ * @fm_last_change: time (in jiffies) of the last change which made the map
+ *                  stale
+ * @fm_rsvd_pebs: how many physical eraseblocks are reserved for the map
+ * @fm_disabled: if the map must not be written for this device
+ *
  * @flash_size: underlying MTD device size (in bytes)
  * @peb_count: count of physical eraseblocks on the MTD device
  * @peb_size: physical eraseblock size
@@ -437,6 +460,16 @@ struct ubi_device {
 	char bgt_name[sizeof(UBI_BGT_NAME_PATTERN)+2];
 	struct notifier_block reboot_notifier;
 
+#ifdef CONFIG_MTD_UBI_FASTMAP
+	/* Fast attach map stuff */
+	struct ubi_fastmap fm;
+	struct mutex fm_mutex;
+	struct rw_semaphore fm_eba_sem;
+	unsigned long fm_last_change;
+	int fm_rsvd_pebs;
+	int fm_disabled;
+#endif
+
 	/* I/O sub-system's stuff */
 	long long flash_size;
 	int peb_count;
@@ -523,6 +556,7 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		     struct ubi_vid_hdr *vid_hdr);
 int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
+unsigned long long ubi_next_sqnum(struct ubi_device *ubi);
 
 /* wl.c */
 int ubi_wl_get_peb(struct ubi_device *ubi, int dtype);
@@ -532,6 +566,45 @@ int ubi_wl_scrub_peb(struct ubi_device *ubi, int pnum);
 int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
 void ubi_wl_close(struct ubi_device *ubi);
 int ubi_thread(void *u);
+#ifdef CONFIG_MTD_UBI_FASTMAP
+int ubi_wl_get_fm_peb(struct ubi_device *ubi, int anchor);
+int ubi_wl_put_fm_peb(struct ubi_device *ubi, int pnum, int sync);
+#endif
+
+/* fastmap.c */
+#ifdef CONFIG_MTD_UBI_FASTMAP
+struct ubi_scan_info *ubi_fastmap_scan(struct ubi_device *ubi);
+void ubi_fastmap_forget(struct ubi_device *ubi);
+void ubi_fastmap_reserve(struct ubi_device *ubi,
+			 const struct ubi_scan_info *si);
+int ubi_fastmap_invalidate(struct ubi_device *ubi);
+int ubi_fastmap_write(struct ubi_device *ubi);
+long ubi_fastmap_idle(struct ubi_device *ubi);
+#else
+static inline struct ubi_scan_info *ubi_fastmap_scan(struct ubi_device *ubi)
+{
+	return NULL;
+}
+static inline void ubi_fastmap_forget(struct ubi_device *ubi)
+{
+}
+static inline void ubi_fastmap_reserve(struct ubi_device *ubi,
+				       const struct ubi_scan_info *si)
+{
+}
+static inline int ubi_fastmap_invalidate(struct ubi_device *ubi)
+{
+	return 0;
+}
+static inline int ubi_fastmap_write(struct ubi_device *ubi)
+{
+	return 0;
+}
+static inline long ubi_fastmap_idle(struct ubi_device *ubi)
+{
+	return MAX_SCHEDULE_TIMEOUT;
+}
+#endif
 
 /* io.c */
 int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
@@ -540,7 +613,7 @@ int ubi_io_write(struct ubi_device *ubi, const void *buf, int pnum, int offset,
 		 int len);
 int ubi_io_sync_erase(struct ubi_device *ubi, int pnum, int torture);
 int ubi_io_is_bad(const struct ubi_device *ubi, int pnum);
-int ubi_io_mark_bad(const struct ubi_device *ubi, int pnum);
+int ubi_io_mark_bad(struct ubi_device *ubi, int pnum);
 int ubi_io_read_ec_hdr(struct ubi_device *ubi, int pnum,
 		       struct ubi_ec_hdr *ec_hdr, int verbose);
 int ubi_io_write_ec_hdr(struct ubi_device *ubi, int pnum,
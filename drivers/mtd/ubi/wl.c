@@ -1126,6 +1126,11 @@ int ubi_wl_put_peb(struct ubi_device *ubi, int pnum, int torture)
 	ubi_assert(pnum >= 0);
 	ubi_assert(pnum < ubi->peb_count);
 
+	/* The fastmap must not map the LEB to this PEB any longer */
+	err = ubi_fastmap_invalidate(ubi);
+	if (err)
+		return err;
+
 retry:
 	spin_lock(&ubi->wl_lock);
 	e = ubi->lookuptbl[pnum];
@@ -1298,6 +1303,108 @@ int ubi_wl_flush(struct ubi_device *ubi)
 	return 0;
 }
 
+#ifdef CONFIG_MTD_UBI_FASTMAP
+
+/**
+ * ubi_wl_get_fm_peb - get a physical eraseblock for the fastmap.
+ * @ubi: UBI device description object
+ * @anchor: if the PEB will be the fastmap anchor
+ *
+ * This function takes a free physical eraseblock and returns its number. The
+ * PEB is not added to any WL tree; it belongs to the fastmap until it is
+ * returned with 'ubi_wl_put_fm_peb()'. The anchor PEB has to be one of the
+ * first %UBI_FM_MAX_START PEBs, and the least worn one of them is picked.
+ *
+ * The caller holds @ubi->work_sem, so this function cannot wait for pending
+ * erasures and returns %-ENOSPC if there is no suitable free PEB.
+ */
+int ubi_wl_get_fm_peb(struct ubi_device *ubi, int anchor)
+{
+	struct ubi_wl_entry *e = NULL, *e1;
+	struct rb_node *rb;
+
+	spin_lock(&ubi->wl_lock);
+	if (anchor) {
+		ubi_rb_for_each_entry(rb, e1, &ubi->free, u.rb)
+			if (e1->pnum < UBI_FM_MAX_START) {
+				e = e1;
+				break;
+			}
+	} else if (ubi->free.rb_node)
+		e = rb_entry(rb_first(&ubi->free), struct ubi_wl_entry, u.rb);
+
+	if (!e) {
+		spin_unlock(&ubi->wl_lock);
+		return -ENOSPC;
+	}
+
+	paranoid_check_in_wl_tree(e, &ubi->free);
+	rb_erase(&e->u.rb, &ubi->free);
+	spin_unlock(&ubi->wl_lock);
+
+	dbg_wl("PEB %d EC %d", e->pnum, e->ec);
+	return e->pnum;
+}
+
+/**
+ * ubi_wl_put_fm_peb - return a fastmap physical eraseblock.
+ * @ubi: UBI device description object
+ * @pnum: physical eraseblock to return
+ * @sync: if the PEB has to be erased before this function returns
+ *
+ * If @sync is zero, the PEB is scheduled for erasure. Otherwise it is erased
+ * synchronously and goes straight to the free tree. This function returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+int ubi_wl_put_fm_peb(struct ubi_device *ubi, int pnum, int sync)
+{
+	int err;
+	struct ubi_wl_entry *e;
+
+	dbg_wl("PEB %d, sync %d", pnum, sync);
+	spin_lock(&ubi->wl_lock);
+	e = ubi->lookuptbl[pnum];
+	spin_unlock(&ubi->wl_lock);
+	ubi_assert(e);
+
+	if (!sync)
+		return schedule_erase(ubi, e, 0);
+
+	err = sync_erase(ubi, e, 0);
+	if (err)
+		return err;
+
+	spin_lock(&ubi->wl_lock);
+	wl_tree_add(e, &ubi->free);
+	spin_unlock(&ubi->wl_lock);
+	return 0;
+}
+
+/**
+ * fastmap_destroy - free the WL entries of the fastmap PEBs.
+ * @ubi: UBI device description object
+ *
+ * While the fastmap is valid its PEBs are in no WL tree, so they are not freed
+ * by 'tree_destroy()'.
+ */
+static void fastmap_destroy(struct ubi_device *ubi)
+{
+	int i, pnum;
+
+	for (i = 0; i < ubi->fm.used_blocks; i++) {
+		pnum = ubi->fm.pnum[i];
+		if (ubi->lookuptbl[pnum]) {
+			kmem_cache_free(ubi_wl_entry_slab,
+					ubi->lookuptbl[pnum]);
+			ubi->lookuptbl[pnum] = NULL;
+		}
+	}
+}
+
+#else
+#define fastmap_destroy(ubi)
+#endif /* CONFIG_MTD_UBI_FASTMAP */
+
 /**
  * tree_destroy - destroy an RB-tree.
  * @root: the root of the tree to destroy
@@ -1356,7 +1463,7 @@ int ubi_thread(void *u)
 			       !ubi->thread_enabled) {
 			set_current_state(TASK_INTERRUPTIBLE);
 			spin_unlock(&ubi->wl_lock);
-			schedule();
+			schedule_timeout(ubi_fastmap_idle(ubi));
 			continue;
 		}
 		spin_unlock(&ubi->wl_lock);
@@ -1483,6 +1590,28 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 		}
 	}
 
+#ifdef CONFIG_MTD_UBI_FASTMAP
+	/*
+	 * The PEBs of a still valid fastmap stay out of the WL trees, those of
+	 * a fastmap which has already been invalidated are erased.
+	 */
+	list_for_each_entry(seb, &si->fm, u.list) {
+		cond_resched();
+
+		e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_KERNEL);
+		if (!e)
+			goto out_free;
+
+		e->pnum = seb->pnum;
+		e->ec = seb->ec;
+		ubi->lookuptbl[e->pnum] = e;
+		if (!ubi->fm.used_blocks && schedule_erase(ubi, e, 0)) {
+			kmem_cache_free(ubi_wl_entry_slab, e);
+			goto out_free;
+		}
+	}
+#endif
+
 	ubi_rb_for_each_entry(rb1, sv, &si->volumes, rb) {
 		ubi_rb_for_each_entry(rb2, seb, &sv->root, u.rb) {
 			cond_resched();
@@ -1523,6 +1652,7 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 
 out_free:
 	cancel_pending(ubi);
+	fastmap_destroy(ubi);
 	tree_destroy(&ubi->used);
 	tree_destroy(&ubi->free);
 	tree_destroy(&ubi->scrub);
@@ -1556,6 +1686,7 @@ void ubi_wl_close(struct ubi_device *ubi)
 	dbg_wl("close the WL sub-system");
 	cancel_pending(ubi);
 	protection_queue_destroy(ubi);
+	fastmap_destroy(ubi);
 	tree_destroy(&ubi->used);
 	tree_destroy(&ubi->erroneous);
 	tree_destroy(&ubi->free);
@@ -19,6 +19,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -33,8 +34,19 @@
 #include <linux/vmalloc.h>
 
 #include "binder.h"
+#include "binder_trace.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * binder_lock protects the object graph: the proc list, threads, nodes,
+ * refs, transaction stacks and todo lists.  Each proc's buffer allocator
+ * is protected by its own proc->alloc_lock instead, so that buffer
+ * allocation and the copy of the transaction payload into the target can
+ * run without holding binder_lock.  When both are needed, binder_lock must
+ * be taken first.  binder_lock is taken through binder_lock() and
+ * binder_unlock(), which emit the binder_lock/binder_locked/binder_unlock
+ * tracepoints so that contention on it shows up in traces.
+ */
+static DEFINE_MUTEX(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
@@ -48,6 +60,15 @@ static uid_t binder_context_mgr_uid = -1;
 static int binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
+/*
+ * Buffer pages that are still mapped but no longer used by any buffer,
+ * oldest first.  They are reused by the next allocation that covers them
+ * or released by binder_shrink under memory pressure.
+ */
+static LIST_HEAD(binder_lru);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static int binder_lru_count;
+
 static int binder_read_proc_proc(char *page, char **start, off_t off,
 				 int count, int *eof, void *data);
 
@@ -64,6 +85,9 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/* free buffers are kept in power-of-two size classes, the last unbounded */
+#define BINDER_SIZE_CLASSES                 24
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -92,6 +116,11 @@ module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
+/* BINDER_TYPE_PTR buffers at least this large are mapped, not copied */
+static int binder_sg_map_threshold = PAGE_SIZE * 16;
+module_param_named(sg_map_threshold, binder_sg_map_threshold, int,
+		   S_IWUSR | S_IRUGO);
+
 static int binder_set_stop_on_user_error(const char *val,
 					 struct kernel_param *kp)
 {
@@ -131,13 +160,45 @@ enum binder_stat_types {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_REPLY_SG) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
+struct binder_alloc_stats {
+	atomic_t page_hits;	/* page was still mapped */
+	atomic_t page_misses;	/* page had to be allocated and mapped */
+	atomic_t pages_reclaimed;
+	atomic_t class_hits;	/* fit found in the request's size class */
+	atomic_t class_misses;	/* split from a larger size class */
+	atomic_t sg_pages_mapped;
+	atomic_t sg_bytes_copied;
+};
+
+static struct binder_alloc_stats binder_alloc_stats;
+
+/*
+ * Transaction latencies in log2 microsecond buckets: bucket 0 counts
+ * latencies below 1us, bucket n those in [2^(n-1), 2^n) us and the last
+ * bucket everything slower.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+enum binder_latency_types {
+	BINDER_LATENCY_QUEUE,		/* sent to dequeued by target */
+	BINDER_LATENCY_SERVICE,		/* dequeued to replied */
+	BINDER_LATENCY_ROUND_TRIP,	/* sent to reply dequeued by sender */
+	BINDER_LATENCY_COUNT
+};
+
+struct binder_latency_stats {
+	int bucket[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+};
+
+static struct binder_latency_stats binder_latency_stats;
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
 	binder_stats.obj_deleted[type]++;
@@ -242,8 +303,10 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct list_head free_entry; /* free entry by size class */
+		struct rb_node rb_node; /* allocated entry by address */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -254,9 +317,17 @@ struct binder_buffer {
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
+struct binder_lru_page {
+	struct list_head lru; /* on binder_lru while mapped but unused */
+	struct page *page_ptr;
+	struct binder_proc *proc;
+	unsigned borrowed:1; /* page_ptr is a BINDER_TYPE_PTR sender page */
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -278,23 +349,28 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock; /* buffers, free/allocated_buffers, pages */
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct list_head free_buffers[BINDER_SIZE_CLASSES];
+	unsigned long free_class_map; /* non-empty free_buffers classes */
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency_stats latency;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
 	long default_priority;
+	int tmp_ref; /* in-flight transactions targeting this proc */
+	int is_dead;
 };
 
 enum {
@@ -338,8 +414,36 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	queue_time;	/* queued on the target */
+	ktime_t	deliver_time;	/* dequeued by the target thread */
+	ktime_t	call_time;	/* reply: queue_time of the call */
 };
 
+static inline void binder_lock(const char *tag)
+{
+	trace_binder_lock(tag);
+	mutex_lock(&binder_main_lock);
+	trace_binder_locked(tag);
+}
+
+static inline void binder_unlock(const char *tag)
+{
+	trace_binder_unlock(tag);
+	mutex_unlock(&binder_main_lock);
+}
+
+/* Called with binder_lock held */
+static void binder_latency_add(struct binder_proc *proc,
+			       enum binder_latency_types type, s64 usecs)
+{
+	int bucket = usecs > 0 ? fls64(usecs) : 0;
+
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	proc->latency.bucket[type][bucket]++;
+	binder_latency_stats.bucket[type][bucket]++;
+}
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -481,6 +585,53 @@ out_unlock:
 	return -EBADF;
 }
 
+static int binder_lru_del(struct binder_lru_page *page);
+
+static int binder_free_proc(struct binder_proc *proc)
+{
+	int page_count = 0;
+
+	if (proc->pages) {
+		int i;
+		/* binder_shrink may be working on one of our parked pages */
+		mutex_lock(&proc->alloc_lock);
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i].page_ptr) {
+				void *page_addr = proc->buffer + i * PAGE_SIZE;
+				if (!binder_lru_del(&proc->pages[i]))
+					binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+						     "binder_release: %d: "
+						     "page %d at %p not freed\n",
+						     proc->pid, i,
+						     page_addr);
+				unmap_kernel_range((unsigned long)page_addr,
+					PAGE_SIZE);
+				if (proc->pages[i].borrowed)
+					put_page(proc->pages[i].page_ptr);
+				else
+					__free_page(proc->pages[i].page_ptr);
+				page_count++;
+			}
+		}
+		mutex_unlock(&proc->alloc_lock);
+		kfree(proc->pages);
+		vfree(proc->buffer);
+	}
+
+	put_task_struct(proc->tsk);
+	kfree(proc);
+	return page_count;
+}
+
+/* Called with binder_lock held */
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	if (proc->tmp_ref == 0 && proc->is_dead)
+		binder_free_proc(proc);
+}
+
 static void binder_set_nice(long nice)
 {
 	long min_nice;
@@ -508,14 +659,20 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_size_class(size_t size)
+{
+	int class = fls(size);
+
+	if (class >= BINDER_SIZE_CLASSES)
+		class = BINDER_SIZE_CLASSES - 1;
+	return class;
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
 	size_t new_buffer_size;
+	int class;
 
 	BUG_ON(!new_buffer->free);
 
@@ -525,20 +682,21 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
+	class = binder_size_class(new_buffer_size);
+	list_add(&new_buffer->free_entry, &proc->free_buffers[class]);
+	__set_bit(class, &proc->free_class_map);
+}
 
-		buffer_size = binder_buffer_size(proc, buffer);
+/* Must be called before the buffer's size changes by merging or splitting */
+static void binder_remove_free_buffer(struct binder_proc *proc,
+				      struct binder_buffer *buffer)
+{
+	int class = binder_size_class(binder_buffer_size(proc, buffer));
 
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
-	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+	BUG_ON(!buffer->free);
+	list_del(&buffer->free_entry);
+	if (list_empty(&proc->free_buffers[class]))
+		__clear_bit(class, &proc->free_class_map);
 }
 
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
@@ -590,6 +748,89 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	BUG_ON(!list_empty(&page->lru));
+	list_add_tail(&page->lru, &binder_lru);
+	binder_lru_count++;
+	spin_unlock(&binder_lru_lock);
+}
+
+static int binder_lru_del(struct binder_lru_page *page)
+{
+	int ret = 0;
+
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&page->lru)) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		ret = 1;
+	}
+	spin_unlock(&binder_lru_lock);
+	return ret;
+}
+
+/* Drop the sender pages a BINDER_TYPE_PTR buffer mapped in start..end */
+static void binder_unmap_user_pages(struct binder_proc *proc,
+				    void *start, void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *page;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm)
+		down_write(&mm->mmap_sem);
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->borrowed)
+			continue;
+		if (mm && proc->vma)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		put_page(page->page_ptr);
+		page->page_ptr = NULL;
+		page->borrowed = 0;
+	}
+
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
+/*
+ * Park every mapped page in start..end on binder_lru, except sender pages
+ * of BINDER_TYPE_PTR buffers, which are given back.
+ */
+static void binder_release_page_range(struct binder_proc *proc,
+				      void *start, void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *page;
+	int borrowed = 0;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->borrowed)
+			borrowed = 1;
+		else if (page->page_ptr)
+			binder_lru_add(page);
+	}
+	if (borrowed)
+		binder_unmap_user_pages(proc, start, end);
+}
+
+/*
+ * Pages are not unmapped when a buffer is freed; they are parked on
+ * binder_lru instead, so an allocation that lands on recently used pages
+ * needs neither mmap_sem nor a page allocation, only clearing the page the
+ * way a newly allocated one would be.  binder_shrink gives the parked pages
+ * back under memory pressure.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -597,8 +838,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *page;
 	struct mm_struct *mm;
+	int need_map = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -607,6 +849,36 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0) {
+		binder_release_page_range(proc, start, end);
+		return 0;
+	}
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		int parked;
+
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr == NULL) {
+			need_map = 1;
+			continue;
+		}
+		parked = binder_lru_del(page);
+		/*
+		 * A mapped page in a free range must be parked; if it is not,
+		 * someone else may still be using it, so give up and put the
+		 * pages taken so far back.
+		 */
+		if (WARN_ON(!parked)) {
+			binder_release_page_range(proc, start, page_addr);
+			return -ENOMEM;
+		}
+		/* it still holds the data of an earlier transaction */
+		memset(page_addr, 0, PAGE_SIZE);
+		atomic_inc(&binder_alloc_stats.page_hits);
+	}
+	if (!need_map)
+		return 0;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -617,9 +889,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -631,16 +900,17 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -650,7 +920,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -658,6 +928,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		atomic_inc(&binder_alloc_stats.page_misses);
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -665,37 +936,34 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
+	binder_release_page_range(proc, start, end);
 	return -ENOMEM;
 }
 
+/* Called with proc->alloc_lock held */
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
-					      size_t offsets_size, int is_async)
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct binder_buffer *buffer = NULL;
+	struct binder_buffer *tmp;
+	size_t buffer_size = 0;
+	size_t tmp_size;
+	int class;
+	int exact_fit = 0;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
@@ -709,11 +977,14 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	size = ALIGN(data_size, sizeof(void *)) +
 		ALIGN(offsets_size, sizeof(void *));
 
-	if (size < data_size || size < offsets_size) {
+	if (size < data_size || size < offsets_size ||
+	    size + extra_buffers_size < size) {
 		binder_user_error("binder: %d: got transaction with invalid "
-			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
+			"size %zd-%zd-%zd\n", proc->pid, data_size,
+			offsets_size, extra_buffers_size);
 		return NULL;
 	}
+	size += extra_buffers_size;
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -723,29 +994,41 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
+	/*
+	 * Best fit within the request's own size class, whose entries may
+	 * still be too small, otherwise the first buffer of the next
+	 * non-empty class, every entry of which is large enough.
+	 */
+	class = binder_size_class(size);
+	list_for_each_entry(tmp, &proc->free_buffers[class], free_entry) {
+		BUG_ON(!tmp->free);
+		tmp_size = binder_buffer_size(proc, tmp);
+		if (tmp_size < size)
+			continue;
+		if (buffer == NULL || tmp_size < buffer_size) {
+			buffer = tmp;
+			buffer_size = tmp_size;
+		}
+		if (tmp_size == size) {
+			exact_fit = 1;
 			break;
 		}
 	}
-	if (best_fit == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
-		       "no address space\n", proc->pid, size);
-		return NULL;
-	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+	if (buffer) {
+		atomic_inc(&binder_alloc_stats.class_hits);
+	} else {
+		class = find_next_bit(&proc->free_class_map,
+				      BINDER_SIZE_CLASSES, class + 1);
+		if (class >= BINDER_SIZE_CLASSES) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf size "
+			       "%zd failed, no address space\n",
+			       proc->pid, size);
+			return NULL;
+		}
+		buffer = list_first_entry(&proc->free_buffers[class],
+					  struct binder_buffer, free_entry);
 		buffer_size = binder_buffer_size(proc, buffer);
+		atomic_inc(&binder_alloc_stats.class_misses);
 	}
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
@@ -754,7 +1037,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (!exact_fit) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -768,7 +1051,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_remove_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -782,6 +1065,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -851,6 +1135,7 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
+/* Called with proc->alloc_lock held */
 static void binder_free_buf(struct binder_proc *proc,
 			    struct binder_buffer *buffer)
 {
@@ -859,7 +1144,8 @@ static void binder_free_buf(struct binder_proc *proc,
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		buffer->extra_buffers_size;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -890,7 +1176,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_remove_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -898,14 +1184,291 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
+			binder_remove_free_buffer(proc, prev);
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
+/*
+ * Maps page at page_addr in the kernel and at the matching address in
+ * vma.  On failure page_addr is left unmapped in both.
+ */
+static int binder_map_page(struct binder_proc *proc,
+			   struct vm_area_struct *vma, void *page_addr,
+			   struct page *page)
+{
+	unsigned long user_page_addr =
+		(uintptr_t)page_addr + proc->user_buffer_offset;
+	struct page **page_array_ptr = &page;
+	struct vm_struct tmp_area;
+	int ret;
+
+	tmp_area.addr = page_addr;
+	tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret)
+		return ret;
+	ret = vm_insert_page(vma, user_page_addr, page);
+	if (ret)
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	return ret;
+}
+
+/*
+ * Replaces the pages backing start..start+length in proc's mapping with
+ * the sender pages at ubuf.  Only pages that are not anonymous memory can
+ * be inserted into the binder vma, so anything else is left to the caller
+ * to copy.  Either every page is replaced or, on failure, the buffer's own
+ * pages are all back in place.  Called with proc->alloc_lock held.
+ */
+static int binder_map_user_pages(struct binder_proc *proc, void *start,
+				 const void __user *ubuf, size_t length)
+{
+	int nr_pages = length / PAGE_SIZE;
+	struct page **pages, **old_pages;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	int i, ret;
+
+	pages = kmalloc(sizeof(*pages) * nr_pages * 2, GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+	old_pages = pages + nr_pages;
+
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, (unsigned long)ubuf,
+			     nr_pages, 0, 0, pages, NULL);
+	up_read(&current->mm->mmap_sem);
+	if (ret < 0)
+		goto err_get_user_pages_failed;
+	if (ret < nr_pages) {
+		nr_pages = ret;
+		ret = -EFAULT;
+		i = 0;
+		goto err_put_pages;
+	}
+	for (i = 0; i < nr_pages; i++)
+		if (PageAnon(pages[i]) || pages[i]->mapping == NULL)
+			break;
+	if (i < nr_pages) {
+		ret = -EINVAL;
+		i = 0;
+		goto err_put_pages;
+	}
+
+	ret = -ESRCH;
+	i = 0;
+	mm = get_task_mm(proc->tsk);
+	if (mm == NULL)
+		goto err_put_pages;
+	down_write(&mm->mmap_sem);
+	vma = proc->vma;
+	if (vma == NULL)
+		goto err_no_vma;
+
+	for (i = 0; i < nr_pages; i++) {
+		void *page_addr = start + i * PAGE_SIZE;
+		struct binder_lru_page *page =
+			&proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+
+		BUG_ON(page->page_ptr == NULL || page->borrowed);
+		/* the buffer's own page is only freed once all are swapped */
+		old_pages[i] = page->page_ptr;
+		zap_page_range(vma, (uintptr_t)page_addr +
+			       proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		ret = binder_map_page(proc, vma, page_addr, pages[i]);
+		if (ret)
+			goto err_map_failed;
+		page->page_ptr = pages[i];
+		page->borrowed = 1;
+	}
+	up_write(&mm->mmap_sem);
+	mmput(mm);
+	for (i = 0; i < nr_pages; i++)
+		__free_page(old_pages[i]);
+	atomic_add(nr_pages, &binder_alloc_stats.sg_pages_mapped);
+	kfree(pages);
+	return 0;
+
+err_map_failed:
+	printk(KERN_ERR "binder: %d: failed to map sender page at %p, %d\n",
+	       proc->pid, start + i * PAGE_SIZE, ret);
+	/*
+	 * Put the buffer's own pages back, the failed slot included.  Their
+	 * page tables exist already, so remapping them cannot run out of
+	 * memory; should it fail anyway -EIO tells the caller not to copy
+	 * into the buffer.
+	 */
+	{
+		int j, failed = 0;
+
+		for (j = i; j >= 0; j--) {
+			void *page_addr = start + j * PAGE_SIZE;
+			struct binder_lru_page *page = &proc->pages[
+				(page_addr - proc->buffer) / PAGE_SIZE];
+
+			if (j < i) {
+				zap_page_range(vma, (uintptr_t)page_addr +
+					proc->user_buffer_offset, PAGE_SIZE,
+					NULL);
+				unmap_kernel_range((unsigned long)page_addr,
+						   PAGE_SIZE);
+			}
+			put_page(pages[j]);
+			page->page_ptr = old_pages[j];
+			page->borrowed = 0;
+			if (binder_map_page(proc, vma, page_addr,
+					    old_pages[j])) {
+				/* an empty slot is remapped on next use */
+				__free_page(old_pages[j]);
+				page->page_ptr = NULL;
+				failed = 1;
+			}
+		}
+		i = nr_pages;
+		if (failed)
+			ret = -EIO;
+	}
+err_no_vma:
+	up_write(&mm->mmap_sem);
+	mmput(mm);
+err_put_pages:
+	for (; i < nr_pages; i++)
+		put_page(pages[i]);
+err_get_user_pages_failed:
+	kfree(pages);
+	return ret;
+}
+
+/*
+ * Places the buffers described by the BINDER_TYPE_PTR objects of a
+ * transaction after its offsets array and points the objects at them.
+ * Returns a description of the first invalid part, or NULL.  Called with
+ * proc->alloc_lock held, before the objects have been validated.
+ */
+static const char *binder_transaction_sg_buffers(struct binder_proc *proc,
+						 struct binder_buffer *buffer,
+						 size_t map_threshold)
+{
+	size_t *offp, *off_end;
+	void *sg_ptr, *sg_end;
+
+	if (!IS_ALIGNED(buffer->offsets_size, sizeof(size_t)))
+		return "offsets size";
+	offp = (size_t *)(buffer->data +
+			  ALIGN(buffer->data_size, sizeof(void *)));
+	off_end = (void *)offp + buffer->offsets_size;
+	sg_ptr = off_end;
+	sg_end = sg_ptr + buffer->extra_buffers_size;
+
+	for (; offp < off_end; offp++) {
+		struct binder_buffer_object *bp;
+		int map, ret;
+
+		if (*offp > buffer->data_size - sizeof(*bp) ||
+		    buffer->data_size < sizeof(*bp) ||
+		    !IS_ALIGNED(*offp, sizeof(void *)))
+			continue; /* rejected by binder_transaction */
+		bp = (struct binder_buffer_object *)(buffer->data + *offp);
+		if (bp->type != BINDER_TYPE_PTR)
+			continue;
+		if (bp->flags)
+			return "sg buffer flags";
+
+		map = map_threshold && bp->length >= map_threshold &&
+			IS_ALIGNED((uintptr_t)bp->buffer, PAGE_SIZE) &&
+			IS_ALIGNED(bp->length, PAGE_SIZE);
+		if (map)
+			sg_ptr = (void *)PAGE_ALIGN((uintptr_t)sg_ptr);
+		if (sg_ptr > sg_end || bp->length > sg_end - sg_ptr)
+			return "sg buffers size";
+
+		ret = map ? binder_map_user_pages(proc, sg_ptr, bp->buffer,
+						  bp->length) : -EINVAL;
+		if (ret == -EIO)
+			return "sg buffer map";
+		if (ret) {
+			if (copy_from_user(sg_ptr, bp->buffer, bp->length))
+				return "sg buffer ptr";
+			atomic_add(bp->length,
+				   &binder_alloc_stats.sg_bytes_copied);
+		}
+		bp->buffer = sg_ptr + proc->user_buffer_offset;
+		sg_ptr += ALIGN(bp->length, sizeof(void *));
+	}
+	return NULL;
+}
+
+/*
+ * binder_shrink - releases parked buffer pages, called from
+ * mm/vmscan.c :: shrink_slab
+ *
+ * Pages are released oldest first.  Procs whose allocator is busy, or
+ * whose mm cannot be locked without waiting, are skipped since the
+ * allocator itself may be what got us into reclaim.
+ */
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	void *page_addr;
+	int count;
+
+	if (!nr_to_scan)
+		return binder_lru_count;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_lru)) {
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&page->lru, &binder_lru);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+		mm = proc->vma ? get_task_mm(proc->tsk) : NULL;
+		if (mm) {
+			if (!down_read_trylock(&mm->mmap_sem)) {
+				mmput(mm);
+				binder_lru_add(page);
+				goto next;
+			}
+			if (proc->vma)
+				zap_page_range(proc->vma, (uintptr_t)page_addr +
+					proc->user_buffer_offset, PAGE_SIZE,
+					NULL);
+			up_read(&mm->mmap_sem);
+			mmput(mm);
+		}
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		atomic_inc(&binder_alloc_stats.pages_reclaimed);
+next:
+		mutex_unlock(&proc->alloc_lock);
+		spin_lock(&binder_lru_lock);
+	}
+	count = binder_lru_count;
+	spin_unlock(&binder_lru_lock);
+
+	return count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -1350,6 +1913,9 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
@@ -1360,7 +1926,8 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       size_t buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1372,6 +1939,10 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	struct binder_buffer *buffer;
+	const char *copy_error = NULL;
+	size_t extra_buffers_size = 0;
+	size_t map_threshold = 0;
 	uint32_t return_error;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
@@ -1464,21 +2035,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1522,37 +2080,122 @@ static void binder_transaction(struct binder_proc *proc,
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
-	if (t->buffer == NULL) {
-		return_error = BR_FAILED_REPLY;
-		goto err_binder_alloc_buf_failed;
-	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
+
+	/*
+	 * Allocate the target buffer and copy the payload into it with only
+	 * target_proc->alloc_lock held.  The target node is pinned by the
+	 * local strong ref taken here and the target proc by tmp_ref, but
+	 * only for as long as the target proc lives: if it is released in
+	 * the meantime, its nodes go with it.  Any thread state is looked up
+	 * again once binder_lock is retaken.
+	 */
 	if (target_node)
 		binder_inc_node(target_node, 1, 0, NULL);
+	target_proc->tmp_ref++;
+	binder_unlock(__func__);
+
+	if (buffers_size) {
+		/* leave room to page align every buffer that may get mapped */
+		if (binder_sg_map_threshold > 0)
+			map_threshold = binder_sg_map_threshold;
+		extra_buffers_size = ALIGN(buffers_size, sizeof(void *));
+		if (map_threshold)
+			extra_buffers_size +=
+				buffers_size / map_threshold * PAGE_SIZE;
+		if (extra_buffers_size < buffers_size)
+			extra_buffers_size = -1; /* rejected by alloc_buf */
+	}
+
+	mutex_lock(&target_proc->alloc_lock);
+	buffer = binder_alloc_buf(target_proc, tr->data_size,
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
+	if (buffer) {
+		buffer->allow_user_free = 0;
+		buffer->debug_id = t->debug_id;
+		buffer->transaction = t;
+		buffer->target_node = target_node;
+		trace_binder_transaction_alloc_buf(buffer);
+		offp = (size_t *)(buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+		if (copy_from_user(buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			copy_error = "data ptr";
+		else if (copy_from_user(offp, tr->data.ptr.offsets,
+					tr->offsets_size))
+			copy_error = "offsets ptr";
+		else if (extra_buffers_size)
+			copy_error = binder_transaction_sg_buffers(target_proc,
+							buffer, map_threshold);
+	}
+	t->buffer = buffer;
+	mutex_unlock(&target_proc->alloc_lock);
 
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
+	binder_lock(__func__);
+	if (t->buffer == NULL) {
+		/* allocation failed, or the target died and freed it */
+		return_error = target_proc->is_dead ? BR_DEAD_REPLY :
+			BR_FAILED_REPLY;
+		/*
+		 * binder_deferred_release has already zeroed the local refs
+		 * of a dead target's nodes, or freed them outright.
+		 */
+		if (target_node && !target_proc->is_dead)
+			binder_dec_node(target_node, 1, 0);
+		binder_proc_dec_tmpref(target_proc);
+		goto err_binder_alloc_buf_failed;
+	}
+	/* target_proc cannot be released while we hold binder_lock */
+	binder_proc_dec_tmpref(target_proc);
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (copy_error) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
+			"%s\n", proc->pid, thread->pid, copy_error);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+
+	if (reply) {
+		target_thread = in_reply_to->from;
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target_thread;
+		}
+		/* the sender's stack may have moved while we were unlocked */
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_dead_target_thread;
+		}
+	} else if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
+		struct binder_transaction *tmp;
+		tmp = thread->transaction_stack;
+		while (tmp) {
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+			tmp = tmp->from_parent;
+		}
 	}
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+	t->to_thread = target_thread;
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1690,6 +2333,31 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp = (void *)fp;
+			void *sg_end = (void *)off_end +
+				t->buffer->extra_buffers_size;
+			void *sg_ptr = (void *)((uintptr_t)bp->buffer -
+				target_proc->user_buffer_offset);
+
+			/*
+			 * binder_transaction_sg_buffers points every object
+			 * it placed into the space after the offsets array;
+			 * anything else was not copied and must not be
+			 * passed on.
+			 */
+			if (*offp > t->buffer->data_size - sizeof(*bp) ||
+			    !t->buffer->extra_buffers_size ||
+			    sg_ptr < (void *)off_end || sg_ptr > sg_end ||
+			    bp->length > sg_end - sg_ptr) {
+				binder_user_error("binder: %d:%d got "
+					"transaction with invalid sg buffer\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+		} break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1698,8 +2366,13 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->queue_time = ktime_get();
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		binder_latency_add(proc, BINDER_LATENCY_SERVICE,
+				   ktime_us_delta(t->queue_time,
+						  in_reply_to->deliver_time));
+		t->call_time = in_reply_to->queue_time;
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1715,6 +2388,7 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	trace_binder_transaction(reply, t, target_node);
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
@@ -1731,10 +2405,13 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target_thread:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
+	mutex_lock(&target_proc->alloc_lock);
 	binder_free_buf(target_proc, t->buffer);
+	mutex_unlock(&target_proc->alloc_lock);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1916,7 +2593,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
+			mutex_unlock(&proc->alloc_lock);
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
@@ -1947,7 +2626,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			mutex_lock(&proc->alloc_lock);
 			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->alloc_lock);
 			break;
 		}
 
@@ -1958,7 +2639,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -2215,7 +2908,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_unlock(__func__);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2239,7 +2932,7 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	binder_lock(__func__);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2252,6 +2945,8 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		ktime_t now;
+		s64 queue_usecs;
 
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
@@ -2442,8 +3137,16 @@ retry:
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
 		list_del(&t->work.entry);
+		now = ktime_get();
+		queue_usecs = ktime_us_delta(now, t->queue_time);
+		binder_latency_add(proc, BINDER_LATENCY_QUEUE, queue_usecs);
+		if (cmd == BR_REPLY)
+			binder_latency_add(proc, BINDER_LATENCY_ROUND_TRIP,
+				ktime_us_delta(now, t->call_time));
+		trace_binder_transaction_received(t, queue_usecs);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			t->deliver_time = now;
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
@@ -2581,12 +3284,12 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_lock(__func__);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_unlock(__func__);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2618,7 +3321,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	binder_lock(__func__);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2727,7 +3430,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	binder_unlock(__func__);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2769,6 +3472,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2816,6 +3520,12 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
+	for (i = 0; i < BINDER_SIZE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->free_buffers[i]);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2867,14 +3577,15 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	mutex_init(&proc->alloc_lock);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	binder_lock(__func__);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_unlock(__func__);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2936,6 +3647,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	struct binder_transaction *t;
 	struct rb_node *n;
 	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int pid;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -3003,6 +3715,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	binder_release_work(&proc->todo);
 	buffers = 0;
 
+	mutex_lock(&proc->alloc_lock);
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3018,40 +3731,26 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_free_buf(proc, buffer);
 		buffers++;
 	}
+	mutex_unlock(&proc->alloc_lock);
 
 	binder_stats_deleted(BINDER_STAT_PROC);
 
+	/*
+	 * A sender that dropped binder_lock to copy into our buffers still
+	 * holds a tmp_ref; the last binder_proc_dec_tmpref frees the proc.
+	 */
+	pid = proc->pid;
+	proc->is_dead = 1;
 	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
-
-	put_task_struct(proc->tsk);
+	if (proc->tmp_ref == 0)
+		page_count = binder_free_proc(proc);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
 		     "refs %d, active transactions %d, buffers %d, "
 		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     pid, threads, nodes, incoming_refs, outgoing_refs,
 		     active_transactions, buffers, page_count);
-
-	kfree(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3061,7 +3760,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_lock(__func__);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3088,7 +3787,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		binder_unlock(__func__);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3313,12 +4012,16 @@ static char *print_binder_proc(char *buf, char *end,
 					       rb_entry(n, struct binder_ref,
 							rb_node_desc));
 	}
+	if (!binder_debug_no_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers);
 	     n != NULL && buf < end;
 	     n = rb_next(n))
 		buf = print_binder_buffer(buf, end, "  buffer",
 					  rb_entry(n, struct binder_buffer,
 						   rb_node));
+	if (!binder_debug_no_lock)
+		mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
@@ -3375,7 +4078,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3432,6 +4137,49 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	return buf;
 }
 
+static const char *binder_latency_strings[] = {
+	"queue",
+	"service",
+	"round trip"
+};
+
+static char *print_binder_latency(char *buf, char *end, const char *prefix,
+				  struct binder_latency_stats *stats)
+{
+	int i, j;
+
+	BUILD_BUG_ON(ARRAY_SIZE(stats->bucket) !=
+			ARRAY_SIZE(binder_latency_strings));
+	for (i = 0; i < ARRAY_SIZE(stats->bucket); i++) {
+		int *bucket = stats->bucket[i];
+		int empty = 1;
+
+		for (j = 0; j < BINDER_LATENCY_BUCKETS; j++) {
+			if (!bucket[j])
+				continue;
+			if (buf >= end)
+				return buf;
+			if (empty) {
+				buf += snprintf(buf, end - buf,
+						"%s%s latency usec:", prefix,
+						binder_latency_strings[i]);
+				empty = 0;
+				if (buf >= end)
+					return buf;
+			}
+			if (j == BINDER_LATENCY_BUCKETS - 1)
+				buf += snprintf(buf, end - buf, " >=%lu:%d",
+						1UL << (j - 1), bucket[j]);
+			else
+				buf += snprintf(buf, end - buf, " <%lu:%d",
+						1UL << j, bucket[j]);
+		}
+		if (!empty && buf < end)
+			buf += snprintf(buf, end - buf, "\n");
+	}
+	return buf;
+}
+
 static char *print_binder_proc_stats(char *buf, char *end,
 				     struct binder_proc *proc)
 {
@@ -3477,8 +4225,12 @@ static char *print_binder_proc_stats(char *buf, char *end,
 		return buf;
 
 	count = 0;
+	if (!binder_debug_no_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	if (!binder_debug_no_lock)
+		mutex_unlock(&proc->alloc_lock);
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
 	if (buf >= end)
 		return buf;
@@ -3498,6 +4250,7 @@ static char *print_binder_proc_stats(char *buf, char *end,
 		return buf;
 
 	buf = print_binder_stats(buf, end, "  ", &proc->stats);
+	buf = print_binder_latency(buf, end, "  ", &proc->latency);
 
 	return buf;
 }
@@ -3518,7 +4271,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(__func__);
 
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
@@ -3536,7 +4289,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 		buf = print_binder_proc(buf, end, proc, 1);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock(__func__);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3564,11 +4317,27 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(__func__);
 
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
 	p = print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
+	if (p < page + PAGE_SIZE)
+		p += snprintf(p, page + PAGE_SIZE - p,
+			      "buffer pages: hits %d misses %d reclaimed %d "
+			      "parked %d\n"
+			      "buffer size classes: hits %d misses %d\n"
+			      "sg buffers: mapped pages %d copied bytes %d\n",
+			      atomic_read(&binder_alloc_stats.page_hits),
+			      atomic_read(&binder_alloc_stats.page_misses),
+			      atomic_read(&binder_alloc_stats.pages_reclaimed),
+			      binder_lru_count,
+			      atomic_read(&binder_alloc_stats.class_hits),
+			      atomic_read(&binder_alloc_stats.class_misses),
+			      atomic_read(&binder_alloc_stats.sg_pages_mapped),
+			      atomic_read(&binder_alloc_stats.sg_bytes_copied));
+	p = print_binder_latency(p, page + PAGE_SIZE, "",
+				 &binder_latency_stats);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (p >= page + PAGE_SIZE)
@@ -3576,7 +4345,7 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock(__func__);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -3605,7 +4374,7 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(__func__);
 
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
@@ -3614,7 +4383,7 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 		buf = print_binder_proc(buf, end, proc, 0);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock(__func__);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3641,11 +4410,11 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(__func__);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
 	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock(__func__);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -3740,6 +4509,7 @@ static int __init binder_init(void)
 		binder_proc_dir_entry_proc = proc_mkdir("proc",
 						binder_proc_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_proc_dir_entry_root) {
 		create_proc_read_entry("state",
 				       S_IRUGO,
@@ -3772,4 +4542,7 @@ static int __init binder_init(void)
 
 device_initcall(binder_init);
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 MODULE_LICENSE("GPL v2");
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,21 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_PTR object describes a buffer outside the transaction data,
+ * sent with BC_TRANSACTION_SG or BC_REPLY_SG.  The driver places the buffer
+ * in the target's mapping after the offsets array and rewrites 'buffer' to
+ * point at it.  Large, page aligned buffers backed by shared memory (e.g.
+ * ashmem) are mapped into the target rather than copied; the sender must
+ * not modify them until the target has freed the transaction buffer.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;	/* must be zero */
+	void			*buffer;
+	size_t			length;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +163,13 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	/* total length of all BINDER_TYPE_PTR buffers, each rounded up to
+	 * a multiple of sizeof(void *) */
+	size_t				buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +347,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with
+	 * BINDER_TYPE_PTR objects among its objects.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -0,0 +1,175 @@
+/* binder_trace.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_buffer;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+struct binder_transaction;
+
+/*
+ * binder_lock is emitted before taking the global binder mutex and
+ * binder_locked once it is held; the time between the two is the time
+ * spent waiting for it.
+ */
+TRACE_EVENT(binder_lock,
+
+	TP_PROTO(const char *tag),
+
+	TP_ARGS(tag),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	tag		)
+	),
+
+	TP_fast_assign(
+		__entry->tag		= tag;
+	),
+
+	TP_printk("tag=%s", __entry->tag)
+);
+
+TRACE_EVENT(binder_locked,
+
+	TP_PROTO(const char *tag),
+
+	TP_ARGS(tag),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	tag		)
+	),
+
+	TP_fast_assign(
+		__entry->tag		= tag;
+	),
+
+	TP_printk("tag=%s", __entry->tag)
+);
+
+TRACE_EVENT(binder_unlock,
+
+	TP_PROTO(const char *tag),
+
+	TP_ARGS(tag),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	tag		)
+	),
+
+	TP_fast_assign(
+		__entry->tag		= tag;
+	),
+
+	TP_printk("tag=%s", __entry->tag)
+);
+
+/* Transaction queued on the target's todo list */
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+
+	TP_ARGS(reply, t, target_node),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	int,		target_node	)
+		__field(	int,		to_proc		)
+		__field(	int,		to_thread	)
+		__field(	int,		reply		)
+		__field(	unsigned int,	code		)
+		__field(	unsigned int,	flags		)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->target_node	= target_node ?
+					  target_node->debug_id : 0;
+		__entry->to_proc	= t->to_proc->pid;
+		__entry->to_thread	= t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply		= reply;
+		__entry->code		= t->code;
+		__entry->flags		= t->flags;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+/* Transaction handed to a reader as BR_TRANSACTION or BR_REPLY */
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(struct binder_transaction *t, s64 queue_usecs),
+
+	TP_ARGS(t, queue_usecs),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	s64,		queue_usecs	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->queue_usecs	= queue_usecs;
+	),
+
+	TP_printk("transaction=%d queued=%lldus",
+		  __entry->debug_id, (long long)__entry->queue_usecs)
+);
+
+TRACE_EVENT(binder_transaction_alloc_buf,
+
+	TP_PROTO(struct binder_buffer *buf),
+
+	TP_ARGS(buf),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	size_t,		data_size	)
+		__field(	size_t,		offsets_size	)
+		__field(	size_t,		extra_buffers_size )
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= buf->debug_id;
+		__entry->data_size	= buf->data_size;
+		__entry->offsets_size	= buf->offsets_size;
+		__entry->extra_buffers_size = buf->extra_buffers_size;
+	),
+
+	TP_printk("transaction=%d data_size=%zd offsets_size=%zd "
+		  "extra_buffers_size=%zd",
+		  __entry->debug_id, __entry->data_size,
+		  __entry->offsets_size, __entry->extra_buffers_size)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
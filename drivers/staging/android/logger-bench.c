@@ -0,0 +1,160 @@
+/*
+ * drivers/staging/android/logger-bench.c
+ *
+ * Logger writer throughput benchmark. At load time it starts one writer
+ * thread per online CPU (or 'writers' of them), each bound to a CPU and
+ * writing 'entries' log entries of 'len' bytes through writev(), the way
+ * liblog does, and prints the entries per second all writers achieved
+ * together, e.g.
+ *
+ *	insmod logger-bench.ko log=/dev/log/main entries=100000
+ *
+ * Run logcat alongside to measure with a reader attached.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/uaccess.h>
+
+static char *log = "/dev/log/main";
+module_param(log, charp, 0444);
+MODULE_PARM_DESC(log, "log device to write to");
+
+static unsigned int writers;
+module_param(writers, uint, 0444);
+MODULE_PARM_DESC(writers, "writer threads, default one per online CPU");
+
+static unsigned int entries = 10000;
+module_param(entries, uint, 0444);
+MODULE_PARM_DESC(entries, "entries written by each writer");
+
+static unsigned int len = 64;
+module_param(len, uint, 0444);
+MODULE_PARM_DESC(len, "message length in bytes");
+
+static atomic_t logger_bench_running;
+static DECLARE_COMPLETION(logger_bench_done);
+static atomic_t logger_bench_errors;
+
+static int logger_bench_writer(void *data)
+{
+	struct file *file = data;
+	static const char tag[] = "logger_bench";
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	struct iovec iov[3];
+	mm_segment_t old_fs;
+	loff_t pos = 0;
+	char *msg;
+	unsigned int i;
+
+	msg = kmalloc(len, GFP_KERNEL);
+	if (!msg) {
+		atomic_inc(&logger_bench_errors);
+		goto out;
+	}
+	memset(msg, 'x', len - 1);
+	msg[len - 1] = '\0';
+
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = len;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	for (i = 0; i < entries; i++) {
+		if (vfs_writev(file, (struct iovec __user *)iov, 3, &pos) < 0) {
+			atomic_inc(&logger_bench_errors);
+			break;
+		}
+	}
+	set_fs(old_fs);
+	kfree(msg);
+out:
+	if (atomic_dec_and_test(&logger_bench_running))
+		complete(&logger_bench_done);
+	return 0;
+}
+
+static int __init logger_bench_init(void)
+{
+	struct task_struct *task;
+	struct file *file;
+	unsigned int i, nr;
+	int cpu = -1;
+	ktime_t start;
+	s64 us;
+	u64 total;
+
+	if (!entries || len < 2)
+		return -EINVAL;
+
+	file = filp_open(log, O_WRONLY, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	nr = writers ? writers : num_online_cpus();
+	atomic_set(&logger_bench_running, nr + 1);
+	atomic_set(&logger_bench_errors, 0);
+
+	start = ktime_get();
+	for (i = 0; i < nr; i++) {
+		task = kthread_create(logger_bench_writer, file,
+				      "logger_bench/%u", i);
+		if (IS_ERR(task)) {
+			atomic_dec(&logger_bench_running);
+			atomic_inc(&logger_bench_errors);
+			continue;
+		}
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+	}
+	if (!atomic_dec_and_test(&logger_bench_running))
+		wait_for_completion(&logger_bench_done);
+	us = ktime_us_delta(ktime_get(), start);
+	filp_close(file, NULL);
+
+	if (atomic_read(&logger_bench_errors)) {
+		printk(KERN_ERR "logger_bench: %d writers failed\n",
+		       atomic_read(&logger_bench_errors));
+		return -EIO;
+	}
+
+	total = (u64)nr * entries;
+	printk(KERN_INFO "logger_bench: %u writers, %llu entries of %u bytes "
+	       "in %lld us, %llu entries/s\n", nr, total, len, us,
+	       div64_u64(total * USEC_PER_SEC, us ? us : 1));
+	return 0;
+}
+
+static void __exit logger_bench_exit(void)
+{
+}
+
+module_init(logger_bench_init);
+module_exit(logger_bench_exit);
+
+MODULE_LICENSE("GPL");
@@ -19,11 +19,21 @@
 
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
+#include <linux/log2.h>
+#include <linux/capability.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,31 +43,104 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock'. Nothing that can sleep or fault is done with it held:
+ * writers gather their payload before taking it and readers copy entries out
+ * to a private buffer before handing them to user-space.
+ *
+ * The buffer is allocated together with the mmap() control page, which
+ * precedes it, and is replaced by LOGGER_SET_LOG_BUF_SIZE. 'resize_mutex'
+ * keeps that from happening while the buffer is mapped.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_hdr; /* control page for mmap() */
+	struct mutex		resize_mutex; /* resizing vs. mmap() */
+	int			mapped;	/* mappings of the buffer */
+	struct list_head	archive; /* archived chunks, oldest first */
+	struct logger_chunk	*arch_cur; /* chunk being filled */
+	struct logger_chunk	*arch_spare; /* next chunk to fill */
+	struct logger_chunk	*arch_busy; /* chunk being compressed */
+	size_t			arch_size; /* bytes held by the archive */
+	struct work_struct	arch_work; /* compresses full chunks */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock, except for
+ * 'buf' and the archive cursor, which are protected by 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			batch;	/* read() many entries at once */
+	struct mutex		mutex;	/* serializes users of 'buf' */
+	unsigned char		*buf;	/* bounce buffer for read() */
+	int			in_archive; /* reading archived entries */
+	__u32			a_pos;	/* archive read position */
+	__u32			c_pos;	/* position of the chunk in 'abuf' */
+	size_t			c_len;	/* valid bytes in 'abuf' */
+	unsigned char		*abuf;	/* uncompressed archive chunk */
+	unsigned char		*cbuf;	/* compressed archive chunk */
+};
+
+/*
+ * struct logger_stage - per-CPU staging buffer for a writer's payload
+ *
+ * Writers copy their payload from user-space here with preemption and page
+ * faults disabled, so that writers on different CPUs never wait on each
+ * other while touching user memory. Only the final copy into the ring is
+ * done under log->lock.
+ */
+struct logger_stage {
+	unsigned char		buf[LOGGER_ENTRY_MAX_PAYLOAD];
+};
+
+static struct logger_stage *logger_stage;
+
+/*
+ * struct logger_chunk - a piece of a log's archive
+ *
+ * With archive_size set, entries that are about to be overwritten in the
+ * ring are appended to the log's archive instead of being dropped. The
+ * archive is a list of chunks, each holding whole entries that were adjacent
+ * in the log, starting at log position 'pos' (see struct logger_mmap_header).
+ * Full chunks are LZO-compressed by the log's archive work, and the oldest
+ * chunks are freed once the archive grows beyond archive_size bytes.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_log's archive */
+	__u32			pos;	/* log position of the first entry */
+	size_t			len;	/* length of the entries */
+	size_t			clen;	/* compressed length, 0 if stored raw */
+	int			packed;	/* compression was attempted */
+	unsigned char		data[0];
 };
 
+#define LOGGER_CHUNK_SIZE	(16 * 1024)
+
+static unsigned long logger_archive_size;
+module_param_named(archive_size, logger_archive_size, ulong,
+		   S_IWUSR | S_IRUGO);
+
+/* LZO work memory and output buffer, shared by all logs' archive work */
+static DEFINE_MUTEX(logger_lzo_mutex);
+static void *logger_lzo_wrkmem;
+static unsigned char *logger_lzo_buf;
+
+/* bounds on the size of a log, see logger_round_size() */
+#define LOGGER_MIN_SIZE		(2 * LOGGER_ENTRY_MAX_LEN)
+#define LOGGER_MAX_SIZE		(16 * 1024 * 1024)
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -88,7 +171,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,15 +190,13 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - reads exactly 'count' bytes from 'log' into the kernel
+ * buffer 'buf'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			unsigned char *buf, size_t count)
 {
 	size_t len;
 
@@ -125,20 +206,146 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(buf + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
+}
+
+/*
+ * get_unread_len - the number of bytes 'reader' has yet to read, counting
+ * the rest of the archive and then the whole ring while it is in the
+ * archive, as logger_read() goes on from log->head once that is done.
+ *
+ * Caller must hold log->lock.
+ */
+static size_t get_unread_len(struct logger_log *log,
+			     struct logger_reader *reader)
+{
+	struct logger_chunk *chunk;
+	size_t len;
+
+	if (!reader->in_archive)
+		return logger_offset(log->w_off - reader->r_off);
+
+	len = logger_offset(log->w_off - log->head);
+	list_for_each_entry(chunk, &log->archive, list) {
+		__u32 end = chunk->pos + chunk->len;
 
-	return count;
+		if ((__s32) (end - reader->a_pos) <= 0)
+			continue;
+		if ((__s32) (chunk->pos - reader->a_pos) > 0)
+			len += chunk->len;
+		else
+			len += end - reader->a_pos;
+	}
+	return len;
+}
+
+/*
+ * load_archive_chunk - makes sure the archive chunk holding reader->a_pos
+ * is unpacked in reader->abuf. Returns zero once the reader has caught up
+ * with the ring, which it then reads from log->head on.
+ *
+ * Caller must hold reader->mutex.
+ */
+static int load_archive_chunk(struct logger_log *log,
+			      struct logger_reader *reader)
+{
+	struct logger_chunk *chunk;
+	size_t len, clen;
+
+	while (reader->a_pos - reader->c_pos >= reader->c_len) {
+		int found = 0;
+
+		spin_lock(&log->lock);
+		if (reader->in_archive)
+			list_for_each_entry(chunk, &log->archive, list) {
+				if ((__s32) (chunk->pos + chunk->len -
+					     reader->a_pos) > 0) {
+					found = 1;
+					break;
+				}
+			}
+		if (!found) {
+			reader->in_archive = 0;
+			reader->r_off = log->head;
+			spin_unlock(&log->lock);
+			return 0;
+		}
+
+		/* skip over entries that were dropped or freed */
+		if ((__s32) (chunk->pos - reader->a_pos) > 0)
+			reader->a_pos = chunk->pos;
+		reader->c_pos = chunk->pos;
+		reader->c_len = chunk->len;
+		clen = chunk->clen;
+		if (clen)
+			memcpy(reader->cbuf, chunk->data, clen);
+		else
+			memcpy(reader->abuf, chunk->data, chunk->len);
+		spin_unlock(&log->lock);
+
+		len = LOGGER_CHUNK_SIZE;
+		if (clen && (lzo1x_decompress_safe(reader->cbuf, clen,
+				reader->abuf, &len) != LZO_E_OK ||
+			     len != reader->c_len)) {
+			printk(KERN_ERR "logger: corrupt archive chunk in "
+			       "log '%s'\n", log->misc.name);
+			reader->a_pos = reader->c_pos + reader->c_len;
+			reader->c_len = 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * do_read_archive - reads whole entries from the log's archive into the
+ * user-space buffer 'buf', one entry or in batch mode as many as fit.
+ * Returns zero once the reader has caught up with the ring.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t do_read_archive(struct logger_log *log,
+			       struct logger_reader *reader,
+			       char __user *buf, size_t count)
+{
+	size_t off, len, nr;
+	__u16 val;
+
+again:
+	if (!load_archive_chunk(log, reader))
+		return 0;
+
+	off = reader->a_pos - reader->c_pos;
+	len = 0;
+	do {
+		memcpy(&val, reader->abuf + off + len, sizeof(val));
+		nr = sizeof(struct logger_entry) + val;
+		if (len + nr > count || off + len + nr > reader->c_len)
+			break;
+		len += nr;
+	} while (reader->batch && off + len < reader->c_len);
+
+	if (!len) {
+		if (off + nr <= reader->c_len)
+			return -EINVAL;
+		/* cannot happen, but never get stuck on a bad entry */
+		reader->a_pos = reader->c_pos + reader->c_len;
+		goto again;
+	}
+
+	if (copy_to_user(buf, reader->abuf + off, len))
+		return -EFAULT;
+	reader->a_pos += len;
+
+	return len;
 }
 
 /*
@@ -148,10 +355,14 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode (see
+ * 	  LOGGER_SET_BATCH_READ) as many whole entries as fit in 'buf'
+ *
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or larger in batch mode. Will set
+ * errno to EINVAL if read buffer is insufficient to hold next entry.
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * After LOGGER_READ_ARCHIVE, entries come from the log's archive until the
+ * reader has caught up with the ring.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
@@ -165,9 +376,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->w_off == reader->r_off) && !reader->in_archive;
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -188,26 +399,63 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+
+	if (reader->in_archive) {
+		ret = do_read_archive(log, reader, buf, count);
+		if (ret)
+			goto out;
+	}
+
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
+	if (count < get_entry_len(log, reader->r_off)) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/*
+	 * Get exactly one entry from the log, or in batch mode keep going
+	 * while whole entries fit. Entries are staged in reader->buf, at most
+	 * LOGGER_ENTRY_MAX_LEN bytes per hold of log->lock.
+	 */
+	do {
+		size_t len = 0;
+
+		do {
+			size_t nr = get_entry_len(log, reader->r_off);
+
+			if (ret + len + nr > count ||
+			    len + nr > LOGGER_ENTRY_MAX_LEN)
+				break;
+			do_read_log(log, reader, reader->buf + len, nr);
+			len += nr;
+		} while (reader->batch && log->w_off != reader->r_off);
+		spin_unlock(&log->lock);
+
+		if (copy_to_user(buf + ret, reader->buf, len)) {
+			if (!ret)
+				ret = -EFAULT;
+			goto out;
+		}
+		ret += len;
+
+		spin_lock(&log->lock);
+	} while (reader->batch && log->w_off != reader->r_off &&
+		 ret + get_entry_len(log, reader->r_off) <= count);
+	spin_unlock(&log->lock);
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -216,7 +464,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -248,13 +496,55 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * archive_entries - appends the entries from 'off' up to 'end', which are
+ * about to be overwritten, to the log's archive. They are dropped if the
+ * archive work has not yet provided a chunk to hold them.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void archive_entries(struct logger_log *log, size_t off, size_t end)
+{
+	struct logger_chunk *chunk = log->arch_cur;
+	size_t count = logger_offset(end - off);
+	__u32 pos = log->mmap_hdr->w_pos - logger_offset(log->w_off - off);
+
+	if (!chunk || chunk->pos + chunk->len != pos ||
+	    chunk->len + count > LOGGER_CHUNK_SIZE) {
+		/* this one is full, or there was a gap: start a new chunk */
+		log->arch_cur = NULL;
+		schedule_work(&log->arch_work);
+
+		chunk = log->arch_spare;
+		if (!chunk)
+			return;
+		log->arch_spare = NULL;
+		chunk->pos = pos;
+		chunk->len = 0;
+		chunk->clen = 0;
+		chunk->packed = 0;
+		list_add_tail(&chunk->list, &log->archive);
+		log->arch_cur = chunk;
+	}
+
+	while (count) {
+		size_t len = min(count, log->size - off);
+
+		memcpy(chunk->data + chunk->len, log->buffer + off, len);
+		chunk->len += len;
+		log->arch_size += len;
+		off = logger_offset(off + len);
+		count -= len;
+	}
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -262,8 +552,13 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		if (logger_archive_size)
+			archive_entries(log, log->head, head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -273,7 +568,7 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -290,44 +585,98 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * gather_payload - copies the first 'count' bytes described by 'iov' into
+ * the kernel buffer 'buf'. With 'atomic' set the copy is done without
+ * faulting in user pages, and fails if any of them is not present.
  *
- * The caller needs to hold log->mutex.
+ * Returns 0 on success, -EFAULT on failure.
+ */
+static int gather_payload(unsigned char *buf, const struct iovec *iov,
+			  unsigned long nr_segs, size_t count, int atomic)
+{
+	while (nr_segs-- > 0 && count) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len) ||
+			    __copy_from_user_inatomic(buf, iov->iov_base, len))
+				return -EFAULT;
+		} else if (copy_from_user(buf, iov->iov_base, len))
+			return -EFAULT;
+
+		buf += len;
+		count -= len;
+		iov++;
+	}
+
+	return 0;
+}
+
+/*
+ * update_mmap_head - publishes log->head in the mmap() control page
  *
- * Returns 'count' on success, negative error code on failure.
+ * The caller needs to hold log->lock.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void update_mmap_head(struct logger_log *log)
 {
-	size_t len;
+	struct logger_mmap_header *hdr = log->mmap_hdr;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	hdr->head_pos = hdr->w_pos - logger_offset(log->w_off - log->head);
+}
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+/*
+ * do_write_entry - appends the entry 'header' with payload 'payload' to 'log'
+ *
+ * Takes log->lock, so the payload must already be in kernel memory.
+ */
+static void do_write_entry(struct logger_log *log, struct logger_entry *header,
+			   const unsigned char *payload)
+{
+	struct logger_mmap_header *hdr;
+	size_t len = sizeof(struct logger_entry) + header->len;
 
-	log->w_off = logger_offset(log->w_off + count);
+	spin_lock(&log->lock);
+	/* logger_resize swaps the buffer under log->lock */
+	hdr = log->mmap_hdr;
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, len);
 
-	return count;
+	/* tell mmap() readers which bytes are about to be overwritten */
+	hdr->w_reserve = hdr->w_pos + len;
+	smp_wmb();
+
+	do_write_log(log, header, sizeof(struct logger_entry));
+	do_write_log(log, payload, header->len);
+
+	smp_wmb();
+	hdr->w_pos = hdr->w_reserve;
+	update_mmap_head(log);
+
+	spin_unlock(&log->lock);
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The payload is first gathered into this CPU's staging buffer without
+ * taking any lock. Should that need to fault in user pages, we fall back to
+ * a temporary buffer gathered with faults enabled. Either way the entry
+ * reaches the ring complete, so a failed write never clobbers the log.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned char *payload;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -341,43 +690,31 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	payload = per_cpu_ptr(logger_stage, get_cpu())->buf;
+	pagefault_disable();
+	ret = gather_payload(payload, iov, nr_segs, header.len, 1);
+	pagefault_enable();
+	if (likely(!ret)) {
+		do_write_entry(log, &header, payload);
+		put_cpu();
+	} else {
+		put_cpu();
 
-		iov++;
-		ret += nr;
+		payload = kmalloc(header.len, GFP_KERNEL);
+		if (unlikely(!payload))
+			return -ENOMEM;
+		ret = gather_payload(payload, iov, nr_segs, header.len, 0);
+		if (likely(!ret))
+			do_write_entry(log, &header, payload);
+		kfree(payload);
+		if (unlikely(ret))
+			return ret;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -407,13 +744,24 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->buf = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->buf) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		reader->batch = 0;
+		reader->in_archive = 0;
+		reader->abuf = NULL;
+		reader->cbuf = NULL;
 		INIT_LIST_HEAD(&reader->list);
+		mutex_init(&reader->mutex);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -431,7 +779,13 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		vfree(reader->abuf);
+		kfree(reader->buf);
 		kfree(reader);
 	}
 
@@ -461,10 +815,371 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->w_off != reader->r_off || reader->in_archive)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+static void logger_vm_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	mutex_lock(&log->resize_mutex);
+	log->mapped++;
+	mutex_unlock(&log->resize_mutex);
+}
+
+static void logger_vm_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	mutex_lock(&log->resize_mutex);
+	log->mapped--;
+	mutex_unlock(&log->resize_mutex);
+}
+
+static const struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vm_open,
+	.close = logger_vm_close,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the log read-only: a control page (struct logger_mmap_header)
+ * followed by the ring buffer itself. See logger.h for how readers consume
+ * entries through the mapping. The log cannot be resized while mapped.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	mutex_lock(&log->resize_mutex);
+	if (vma->vm_pgoff || size != PAGE_SIZE + log->size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = remap_vmalloc_range(vma, log->mmap_hdr, 0);
+	if (ret)
+		goto out;
+
+	vma->vm_ops = &logger_vm_ops;
+	vma->vm_private_data = log;
+	log->mapped++;
+out:
+	mutex_unlock(&log->resize_mutex);
+
+	return ret;
+}
+
+/*
+ * logger_round_size - returns 'size' rounded up to a valid log size, or zero
+ * if it is too large. Logs are a power of two bytes, large enough for two
+ * maximum sized entries.
+ */
+static size_t logger_round_size(unsigned long size)
+{
+	if (!size || size > LOGGER_MAX_SIZE)
+		return 0;
+
+	return max_t(size_t, roundup_pow_of_two(size), LOGGER_MIN_SIZE);
+}
+
+/*
+ * alloc_log_buffer - allocates a ring buffer of 'size' bytes preceded by
+ * its mmap() control page, and returns the control page.
+ */
+static struct logger_mmap_header *alloc_log_buffer(size_t size)
+{
+	struct logger_mmap_header *hdr;
+
+	hdr = vmalloc_user(PAGE_SIZE + size);
+	if (hdr)
+		hdr->size = size;
+
+	return hdr;
+}
+
+/*
+ * logger_resize - replaces the buffer of 'log' with one of 'size' bytes,
+ * keeping as many of the most recent entries as fit. Entries keep their log
+ * position, readers keep their distance from the write head where they can,
+ * and entries that no longer fit are archived.
+ */
+static long logger_resize(struct logger_log *log, unsigned long size)
+{
+	struct logger_mmap_header *hdr, *old;
+	struct logger_reader *reader;
+	unsigned char *buffer;
+	size_t head, keep, off, w_pos, count;
+	long ret = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	size = logger_round_size(size);
+	if (!size)
+		return -EINVAL;
+
+	hdr = alloc_log_buffer(size);
+	if (!hdr)
+		return -ENOMEM;
+	buffer = (unsigned char *) hdr + PAGE_SIZE;
+
+	mutex_lock(&log->resize_mutex);
+	if (log->mapped) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	spin_lock(&log->lock);
+
+	/* drop the oldest entries until the rest fits */
+	head = log->head;
+	keep = logger_offset(log->w_off - head);
+	while (keep >= size) {
+		size_t nr = get_entry_len(log, head);
+
+		if (logger_archive_size)
+			archive_entries(log, head, logger_offset(head + nr));
+		head = logger_offset(head + nr);
+		keep -= nr;
+	}
+
+	/* copy the rest so that each entry keeps its position */
+	old = log->mmap_hdr;
+	w_pos = old->w_pos;
+	off = (w_pos - keep) & (size - 1);
+	count = keep;
+	while (count) {
+		size_t len = min_t(size_t, count,
+				   min_t(size_t, log->size - head, size - off));
+
+		memcpy(buffer + off, log->buffer + head, len);
+		head = logger_offset(head + len);
+		off = (off + len) & (size - 1);
+		count -= len;
+	}
+
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t dist = logger_offset(log->w_off - reader->r_off);
+
+		reader->r_off = (w_pos - min(dist, keep)) & (size - 1);
+	}
+
+	hdr->w_pos = w_pos;
+	hdr->w_reserve = w_pos;
+	log->mmap_hdr = hdr;
+	log->buffer = buffer;
+	log->size = size;
+	log->w_off = w_pos & (size - 1);
+	log->head = (w_pos - keep) & (size - 1);
+	update_mmap_head(log);
+
+	spin_unlock(&log->lock);
+	hdr = old;
+out:
+	mutex_unlock(&log->resize_mutex);
+	vfree(hdr);
+
+	return ret;
+}
+
+/*
+ * logger_archive_work - compresses the full chunks of a log's archive, trims
+ * the archive to archive_size and makes sure a spare chunk is available for
+ * archive_entries() to start the next chunk with.
+ */
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      arch_work);
+	struct logger_chunk *chunk, *packed;
+	size_t clen;
+
+	mutex_lock(&logger_lzo_mutex);
+	if (!logger_lzo_wrkmem) {
+		logger_lzo_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		logger_lzo_buf =
+			vmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE));
+		if (!logger_lzo_wrkmem || !logger_lzo_buf) {
+			vfree(logger_lzo_wrkmem);
+			vfree(logger_lzo_buf);
+			logger_lzo_wrkmem = NULL;
+			logger_lzo_buf = NULL;
+		}
+	}
+
+	while (logger_lzo_wrkmem) {
+		chunk = NULL;
+		spin_lock(&log->lock);
+		list_for_each_entry(packed, &log->archive, list)
+			if (!packed->packed && packed != log->arch_cur) {
+				chunk = packed;
+				break;
+			}
+		log->arch_busy = chunk;
+		spin_unlock(&log->lock);
+		if (!chunk)
+			break;
+
+		packed = NULL;
+		if (lzo1x_1_compress(chunk->data, chunk->len, logger_lzo_buf,
+				     &clen, logger_lzo_wrkmem) == LZO_E_OK &&
+		    clen < chunk->len)
+			packed = kmalloc(sizeof(*packed) + clen, GFP_KERNEL);
+		if (packed) {
+			packed->pos = chunk->pos;
+			packed->len = chunk->len;
+			packed->clen = clen;
+			packed->packed = 1;
+			memcpy(packed->data, logger_lzo_buf, clen);
+		}
+
+		spin_lock(&log->lock);
+		if (log->arch_busy != chunk) {
+			/* the log was flushed meanwhile, the chunk is ours */
+			kfree(packed);
+		} else if (packed) {
+			list_replace(&chunk->list, &packed->list);
+			log->arch_size -= chunk->len - clen;
+		} else {
+			/* keep it uncompressed */
+			chunk->packed = 1;
+			chunk = NULL;
+		}
+		log->arch_busy = NULL;
+		if (chunk && !log->arch_spare && logger_archive_size) {
+			log->arch_spare = chunk;
+			chunk = NULL;
+		}
+		spin_unlock(&log->lock);
+		kfree(chunk);
+	}
+	mutex_unlock(&logger_lzo_mutex);
+
+	packed = NULL;
+	if (!log->arch_spare && logger_archive_size)
+		packed = kmalloc(sizeof(*packed) + LOGGER_CHUNK_SIZE,
+				 GFP_KERNEL);
+
+	spin_lock(&log->lock);
+	if (!log->arch_spare) {
+		log->arch_spare = packed;
+		packed = NULL;
+	}
+	while (log->arch_size > logger_archive_size &&
+	       !list_empty(&log->archive)) {
+		chunk = list_first_entry(&log->archive, struct logger_chunk,
+					 list);
+		if (chunk == log->arch_cur)
+			log->arch_cur = NULL;
+		list_del(&chunk->list);
+		log->arch_size -= chunk->clen ? chunk->clen : chunk->len;
+		/*
+		 * We no longer hold logger_lzo_mutex, so another instance
+		 * of this work may be compressing the chunk right now.
+		 */
+		if (chunk == log->arch_busy)
+			log->arch_busy = NULL;	/* freed by that instance */
+		else
+			kfree(chunk);
+	}
+	if (!logger_archive_size) {
+		packed = log->arch_spare;
+		log->arch_spare = NULL;
+	}
+	spin_unlock(&log->lock);
+	kfree(packed);
+}
+
+/*
+ * flush_archive - frees all archived entries of 'log'
+ *
+ * The caller needs to hold log->lock.
+ */
+static void flush_archive(struct logger_log *log)
+{
+	struct logger_chunk *chunk, *tmp;
+	struct logger_reader *reader;
+
+	list_for_each_entry_safe(chunk, tmp, &log->archive, list) {
+		list_del(&chunk->list);
+		if (chunk == log->arch_busy)
+			log->arch_busy = NULL;	/* freed by the archive work */
+		else
+			kfree(chunk);
+	}
+	log->arch_cur = NULL;
+	log->arch_size = 0;
+
+	list_for_each_entry(reader, &log->readers, list)
+		reader->in_archive = 0;
+}
+
+/*
+ * get_archive_entry_len - the length of the next archived entry of
+ * 'reader', or zero if it has caught up with the ring
+ */
+static long get_archive_entry_len(struct logger_log *log,
+				  struct logger_reader *reader)
+{
+	long ret = 0;
+	__u16 val;
+
+	mutex_lock(&reader->mutex);
+	if (reader->in_archive && load_archive_chunk(log, reader)) {
+		memcpy(&val, reader->abuf + reader->a_pos - reader->c_pos,
+		       sizeof(val));
+		ret = sizeof(struct logger_entry) + val;
+	}
+	mutex_unlock(&reader->mutex);
+
+	return ret;
+}
+
+/*
+ * logger_read_archive - rewinds 'reader' to the oldest archived entry
+ */
+static long logger_read_archive(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	long ret = 0;
+
+	mutex_lock(&reader->mutex);
+	if (!reader->abuf) {
+		reader->abuf = vmalloc(LOGGER_CHUNK_SIZE +
+			lzo1x_worst_compress(LOGGER_CHUNK_SIZE));
+		if (!reader->abuf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		reader->cbuf = reader->abuf + LOGGER_CHUNK_SIZE;
+	}
+
+	spin_lock(&log->lock);
+	if (!list_empty(&log->archive)) {
+		reader->a_pos = list_first_entry(&log->archive,
+					struct logger_chunk, list)->pos;
+		reader->c_len = 0;
+		reader->in_archive = 1;
+	}
+	spin_unlock(&log->lock);
+out:
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -475,7 +1190,28 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	/* these may sleep */
+	switch (cmd) {
+	case LOGGER_SET_LOG_BUF_SIZE:
+		return logger_resize(log, arg);
+	case LOGGER_READ_ARCHIVE:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return logger_read_archive(log, file->private_data);
+	case LOGGER_GET_NEXT_ENTRY_LEN:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		/* the same order as logger_read(): archive, then the ring */
+		reader = file->private_data;
+		if (reader->in_archive) {
+			ret = get_archive_entry_len(log, reader);
+			if (ret)
+				return ret;
+		}
+		break;
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -487,10 +1223,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = get_unread_len(log, reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -511,11 +1244,22 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+		update_mmap_head(log);
+		flush_archive(log);
+		ret = 0;
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -525,6 +1269,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -532,14 +1277,14 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and a default size of 'SIZE'
+ * bytes, which must be a valid log size (see logger_round_size()). The size
+ * can be changed on the kernel command line, as in logger.main_size=256K, and
+ * at runtime with LOGGER_SET_LOG_BUF_SIZE. The buffer is allocated by
+ * init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,10 +1293,13 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.resize_mutex = __MUTEX_INITIALIZER(VAR .resize_mutex), \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.arch_work = __WORK_INITIALIZER(VAR .arch_work, logger_archive_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
@@ -559,6 +1307,34 @@ DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
 DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024)
 DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024)
 
+static int logger_set_size(const char *val, struct kernel_param *kp)
+{
+	struct logger_log *log = kp->arg;
+	size_t size = logger_round_size(memparse(val, NULL));
+
+	if (!size)
+		return -EINVAL;
+	log->size = size;
+
+	return 0;
+}
+
+static int logger_get_size(char *buffer, struct kernel_param *kp)
+{
+	struct logger_log *log = kp->arg;
+
+	return sprintf(buffer, "%zu", log->size);
+}
+
+module_param_call(main_size, logger_set_size, logger_get_size,
+		  &log_main, S_IRUGO);
+module_param_call(events_size, logger_set_size, logger_get_size,
+		  &log_events, S_IRUGO);
+module_param_call(radio_size, logger_set_size, logger_get_size,
+		  &log_radio, S_IRUGO);
+module_param_call(system_size, logger_set_size, logger_get_size,
+		  &log_system, S_IRUGO);
+
 static struct logger_log *get_log_from_minor(int minor)
 {
 	if (log_main.misc.minor == minor)
@@ -576,10 +1352,24 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->mmap_hdr = alloc_log_buffer(log->size);
+	if (unlikely(!log->mmap_hdr)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+	log->buffer = (unsigned char *) log->mmap_hdr + PAGE_SIZE;
+
+	if (logger_archive_size)
+		schedule_work(&log->arch_work);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->mmap_hdr);
+		log->mmap_hdr = NULL;
+		log->buffer = NULL;
 		return ret;
 	}
 
@@ -593,6 +1383,13 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_stage = alloc_percpu(struct logger_stage);
+	if (unlikely(!logger_stage)) {
+		printk(KERN_ERR "logger: failed to allocate staging buffers\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
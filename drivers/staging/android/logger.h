@@ -30,6 +30,26 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - control page at the start of a log's mmap()
+ *
+ * A log opened for reading can be mapped read-only with a length of one page
+ * plus the size of the log (LOGGER_GET_LOG_BUF_SIZE). The ring buffer starts
+ * at the second page. Positions count the bytes ever written to the log,
+ * modulo 2^32; the ring offset of a position is pos & (size - 1).
+ *
+ * A reader consumes entries from its position up to w_pos. Having copied an
+ * entry out of the mapping it rereads w_reserve: if w_reserve - pos is larger
+ * than size, the entry may have been overwritten while it was being copied,
+ * and the reader should start over from head_pos.
+ */
+struct logger_mmap_header {
+	__u32		size;		/* size of the ring buffer */
+	__u32		w_pos;		/* end of last complete entry */
+	__u32		w_reserve;	/* end of entry being written */
+	__u32		head_pos;	/* oldest entry in the log */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +65,8 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* batch reads */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 6) /* resize log */
+#define LOGGER_READ_ARCHIVE		_IO(__LOGGERIO, 7) /* read history */
 
 #endif /* _LINUX_LOGGER_H */
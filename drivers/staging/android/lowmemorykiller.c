@@ -16,6 +16,11 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Before anything gets killed, user-space can be told to trim its caches:
+ * /sys/kernel/mm/lowmemkiller/notify_trigger_active becomes 1, and pollers
+ * are woken, when both free and cached memory drop below notify_trigger
+ * pages. It goes back to 0 once memory is found above the trigger again.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +40,11 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/rculist_nulls.h>
+#include <linux/spinlock.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -51,9 +61,25 @@ static size_t lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+static size_t lowmem_notify_trigger = 20 * 1024;	/* 80MB */
 
 static struct task_struct *lowmem_deathpending;
 
+/*
+ * Thread group leaders, by oom_adj. Readers walk the lists under RCU, as
+ * they would the task list; the task structs are freed after a grace period.
+ * A task whose oom_adj changes is moved to another list without waiting for
+ * one, so each list ends in a nulls marker holding its index: a reader that
+ * ends up on another list's marker has been moved along and must restart.
+ */
+#define LOWMEM_ADJ_LISTS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct hlist_nulls_head lowmem_adj_lists[LOWMEM_ADJ_LISTS];
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static int lowmem_adj_ready;	/* set under tasklist_lock */
+
+static struct kobject *lowmem_kobj;
+static int lowmem_notify_active;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -78,9 +104,109 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static int lowmem_adj_index(struct task_struct *p)
+{
+	int oom_adj = p->signal->oom_adj;
+
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return oom_adj - OOM_DISABLE;
+}
+
+/* Called with tasklist_lock held for writing, for each new group leader */
+void lowmem_adj_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	if (!lowmem_adj_ready)
+		return;
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	hlist_nulls_add_head_rcu(&p->lowmem_node,
+				 &lowmem_adj_lists[lowmem_adj_index(p)]);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Called with tasklist_lock held for writing, as a group leader exits */
+void lowmem_adj_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	hlist_nulls_del_init_rcu(&p->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Called with tasklist_lock held for writing, as 'new' becomes the leader */
+void lowmem_adj_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	if (!lowmem_adj_ready)
+		return;
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	hlist_nulls_del_init_rcu(&old->lowmem_node);
+	hlist_nulls_add_head_rcu(&new->lowmem_node,
+				 &lowmem_adj_lists[lowmem_adj_index(new)]);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Called after the oom_adj of the thread group of 'task' was written */
+void lowmem_adj_update(struct task_struct *task)
+{
+	struct task_struct *p;
+	unsigned long flags;
+
+	rcu_read_lock();
+	p = task->group_leader;
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	/* not hashed if it already exited, or before lowmem_adj_ready */
+	if (!hlist_nulls_unhashed(&p->lowmem_node)) {
+		int i = lowmem_adj_index(p);
+
+		hlist_nulls_del_init_rcu(&p->lowmem_node);
+		hlist_nulls_add_head_rcu(&p->lowmem_node, &lowmem_adj_lists[i]);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	rcu_read_unlock();
+}
+
+static void lowmem_notify_work_fn(struct work_struct *work)
+{
+	if (lowmem_kobj)
+		sysfs_notify(lowmem_kobj, NULL, "notify_trigger_active");
+}
+
+static DECLARE_WORK(lowmem_notify_work, lowmem_notify_work_fn);
+
+static void lowmem_notify(int other_free, int other_file)
+{
+	int active = other_free < lowmem_notify_trigger &&
+		     other_file < lowmem_notify_trigger;
+
+	if (active == lowmem_notify_active)
+		return;
+	lowmem_notify_active = active;
+	lowmem_print(2, "notify_trigger_active %d, ofree %d %d\n",
+		     active, other_free, other_file);
+	/* sysfs_notify sleeps, we may be called in atomic reclaim */
+	schedule_work(&lowmem_notify_work);
+}
+
+static ssize_t lowmem_notify_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", lowmem_notify_active);
+}
+
+static struct kobj_attribute lowmem_notify_attr =
+	__ATTR(notify_trigger_active, S_IRUGO, lowmem_notify_show, NULL);
+
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
+	struct hlist_nulls_node *node;
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
@@ -92,6 +218,8 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
 
+	lowmem_notify(other_free, other_file);
+
 	/*
 	 * If we already have a death outstanding, then
 	 * bail out right away; indicating to vmscan
@@ -128,53 +256,75 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
+	/*
+	 * Only the lists from the highest oom_adj down to min_adj are walked,
+	 * and only until one of them yields a victim.
+	 */
+	rcu_read_lock();
+	for (i = LOWMEM_ADJ_LISTS - 1; i >= min_adj - OOM_DISABLE; i--) {
+restart:
+		hlist_nulls_for_each_entry_rcu(p, node, &lowmem_adj_lists[i],
+					       lowmem_node) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
+				continue;
+			}
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0)
 				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, oom_adj,
+				     tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+		if (get_nulls_value(node) != i)
+			goto restart;
+		if (selected)
+			break;
 	}
+	if (selected)
+		get_task_struct(selected);
+	rcu_read_unlock();
+
 	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		task_free_register(&task_nb);
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+		/* the task list lock keeps ->sighand around for force_sig */
+		read_lock(&tasklist_lock);
+		if (pid_alive(selected)) {
+			lowmem_print(1, "send sigkill to %d (%s), adj %d, "
+				     "size %d\n", selected->pid, selected->comm,
+				     selected_oom_adj, selected_tasksize);
+			lowmem_deathpending = selected;
+			task_free_register(&task_nb);
+			force_sig(SIGKILL, selected);
+			rem -= selected_tasksize;
+		}
+		read_unlock(&tasklist_lock);
+		put_task_struct(selected);
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -183,8 +333,31 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int __init lowmem_adj_lists_init(void)
+{
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_LISTS; i++)
+		INIT_HLIST_NULLS_HEAD(&lowmem_adj_lists[i], i);
+
+	/* pick up the processes that were forked before we got here */
+	write_lock_irq(&tasklist_lock);
+	lowmem_adj_ready = 1;
+	for_each_process(p)
+		lowmem_adj_add(p);
+	write_unlock_irq(&tasklist_lock);
+	return 0;
+}
+core_initcall(lowmem_adj_lists_init);
+
 static int __init lowmem_init(void)
 {
+	lowmem_kobj = kobject_create_and_add("lowmemkiller", mm_kobj);
+	if (!lowmem_kobj ||
+	    sysfs_create_file(lowmem_kobj, &lowmem_notify_attr.attr))
+		printk(KERN_WARNING "lowmemorykiller: "
+		       "cannot create notify_trigger_active\n");
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -192,6 +365,11 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	flush_work(&lowmem_notify_work);
+	if (lowmem_kobj) {
+		sysfs_remove_file(lowmem_kobj, &lowmem_notify_attr.attr);
+		kobject_put(lowmem_kobj);
+	}
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -199,6 +377,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+module_param_named(notify_trigger, lowmem_notify_trigger, uint,
+		   S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
@@ -0,0 +1,345 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * yaffs_bench.c: throughput and concurrency benchmark, run at module load
+ * time.
+ *
+ * First a 'seq_mb' file in 'dir' is written and synced, then read back
+ * with its page cache dropped, which goes through yaffs_writepages and
+ * yaffs_readpages, and the throughput of both is printed.
+ *
+ * Then reader threads repeatedly stat and read another file with its page
+ * cache dropped, so every read goes through yaffs_readpage. They run
+ * for 'seconds' on their own, then as long again next to a thread that
+ * writes and syncs 'write_mb' files. The reader throughput of the two
+ * runs shows how much a writer holds readers up, e.g.
+ *
+ *	insmod yaffs_bench.ko dir=/data readers=2 seconds=10
+ *
+ * The files yaffs_bench.s, yaffs_bench.r and yaffs_bench.w are left in
+ * 'dir'.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/stat.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+
+#define YAFFS_BENCH_IO		(64 * 1024)
+#define YAFFS_BENCH_READ_SIZE	(1024 * 1024)
+#define YAFFS_BENCH_MAX_READERS	16
+
+static char *dir = "/data";
+module_param(dir, charp, 0444);
+MODULE_PARM_DESC(dir, "directory on the yaffs mount to use");
+
+static unsigned int readers = 2;
+module_param(readers, uint, 0444);
+MODULE_PARM_DESC(readers, "reader threads");
+
+static unsigned int seconds = 10;
+module_param(seconds, uint, 0444);
+MODULE_PARM_DESC(seconds, "length of each run");
+
+static unsigned int write_mb = 8;
+module_param(write_mb, uint, 0444);
+MODULE_PARM_DESC(write_mb, "size of each file the writer writes");
+
+static unsigned int seq_mb = 16;
+module_param(seq_mb, uint, 0444);
+MODULE_PARM_DESC(seq_mb, "size of the sequentially written and read file");
+
+struct yaffs_bench_thread {
+	struct task_struct *task;
+	char *name;
+	u64 bytes;
+	unsigned long stats;
+	int err;
+};
+
+static char *yaffs_bench_path(const char *suffix)
+{
+	return kasprintf(GFP_KERNEL, "%s/yaffs_bench.%s", dir, suffix);
+}
+
+/* Writes 'size' bytes of 'buf' over and over, from offset 0 */
+static int yaffs_bench_fill(struct file *file, char *buf, u64 size)
+{
+	loff_t pos = 0;
+	ssize_t n;
+
+	while (pos < size) {
+		n = vfs_write(file, (char __user *)buf, YAFFS_BENCH_IO, &pos);
+		if (n < 0)
+			return n;
+	}
+	return vfs_fsync(file, file->f_path.dentry, 0);
+}
+
+static int yaffs_bench_reader(void *data)
+{
+	struct yaffs_bench_thread *t = data;
+	mm_segment_t old_fs = get_fs();
+	struct file *file;
+	struct kstat stat;
+	loff_t pos;
+	ssize_t n;
+	char *buf;
+
+	file = filp_open(t->name, O_RDONLY, 0);
+	if (IS_ERR(file)) {
+		t->err = PTR_ERR(file);
+		file = NULL;
+	}
+	buf = kmalloc(YAFFS_BENCH_IO, GFP_KERNEL);
+	if (!buf)
+		t->err = -ENOMEM;
+
+	set_fs(KERNEL_DS);
+	while (!kthread_should_stop()) {
+		if (t->err) {
+			msleep_interruptible(10);
+			continue;
+		}
+		t->err = vfs_stat((char __user *)t->name, &stat);
+		t->stats++;
+
+		invalidate_mapping_pages(file->f_mapping, 0, -1);
+		for (pos = 0; !t->err && pos < YAFFS_BENCH_READ_SIZE; ) {
+			n = vfs_read(file, (char __user *)buf,
+				     YAFFS_BENCH_IO, &pos);
+			if (n <= 0)
+				t->err = n ? n : -EIO;
+			else
+				t->bytes += n;
+		}
+		cond_resched();
+	}
+	set_fs(old_fs);
+
+	if (file)
+		filp_close(file, NULL);
+	kfree(buf);
+	return 0;
+}
+
+static int yaffs_bench_writer(void *data)
+{
+	struct yaffs_bench_thread *t = data;
+	mm_segment_t old_fs = get_fs();
+	struct file *file;
+	char *buf;
+
+	buf = kmalloc(YAFFS_BENCH_IO, GFP_KERNEL);
+	if (!buf)
+		t->err = -ENOMEM;
+	else
+		memset(buf, 0x5a, YAFFS_BENCH_IO);
+
+	set_fs(KERNEL_DS);
+	while (!kthread_should_stop()) {
+		if (t->err) {
+			msleep_interruptible(10);
+			continue;
+		}
+		file = filp_open(t->name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (IS_ERR(file)) {
+			t->err = PTR_ERR(file);
+			continue;
+		}
+		t->err = yaffs_bench_fill(file, buf, (u64)write_mb << 20);
+		if (!t->err)
+			t->bytes += (u64)write_mb << 20;
+		filp_close(file, NULL);
+	}
+	set_fs(old_fs);
+
+	kfree(buf);
+	return 0;
+}
+
+static int yaffs_bench_start(struct yaffs_bench_thread *t,
+			     int (*fn)(void *), const char *name)
+{
+	t->bytes = 0;
+	t->stats = 0;
+	t->err = 0;
+	t->task = kthread_run(fn, t, "%s", name);
+	if (IS_ERR(t->task)) {
+		t->err = PTR_ERR(t->task);
+		t->task = NULL;
+	}
+	return t->err;
+}
+
+static int yaffs_bench_stop(struct yaffs_bench_thread *t)
+{
+	if (t->task)
+		kthread_stop(t->task);
+	return t->err;
+}
+
+static int yaffs_bench_run(struct yaffs_bench_thread *rd,
+			   struct yaffs_bench_thread *wr, const char *what)
+{
+	u64 bytes = 0;
+	unsigned long stats = 0;
+	unsigned int i;
+	ktime_t start;
+	s64 us;
+	int err = 0;
+
+	start = ktime_get();
+	for (i = 0; i < readers && !err; i++)
+		err = yaffs_bench_start(&rd[i], yaffs_bench_reader,
+					"yaffs_bench_rd");
+	if (wr && !err)
+		err = yaffs_bench_start(wr, yaffs_bench_writer,
+					"yaffs_bench_wr");
+	if (!err)
+		msleep_interruptible(seconds * 1000);
+
+	for (i = 0; i < readers; i++) {
+		if (yaffs_bench_stop(&rd[i]))
+			err = rd[i].err;
+		bytes += rd[i].bytes;
+		stats += rd[i].stats;
+	}
+	if (wr && yaffs_bench_stop(wr))
+		err = wr->err;
+	us = ktime_us_delta(ktime_get(), start);
+	if (err)
+		return err;
+
+	if (!us)
+		us = 1;
+	printk(KERN_INFO "yaffs_bench: %s: readers %llu KB/s, %llu stat/s",
+	       what, div64_u64(bytes * USEC_PER_SEC, us * 1024),
+	       div64_u64((u64)stats * USEC_PER_SEC, us));
+	if (wr)
+		printk(KERN_CONT ", writer %llu KB/s",
+		       div64_u64(wr->bytes * USEC_PER_SEC, us * 1024));
+	printk(KERN_CONT "\n");
+	return 0;
+}
+
+static u64 yaffs_bench_rate(u64 bytes, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+
+	return div64_u64(bytes * USEC_PER_SEC, (us ? us : 1) * 1024);
+}
+
+/* Called with KERNEL_DS */
+static int yaffs_bench_seq(char *buf)
+{
+	u64 size = (u64)seq_mb << 20;
+	u64 writeRate;
+	struct file *file;
+	char *name;
+	ktime_t start;
+	loff_t pos;
+	ssize_t n;
+	int err;
+
+	name = yaffs_bench_path("s");
+	if (!name)
+		return -ENOMEM;
+	file = filp_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	kfree(name);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	start = ktime_get();
+	err = yaffs_bench_fill(file, buf, size);
+	writeRate = yaffs_bench_rate(size, start);
+
+	invalidate_mapping_pages(file->f_mapping, 0, -1);
+	start = ktime_get();
+	for (pos = 0; !err && pos < size; ) {
+		n = vfs_read(file, (char __user *)buf, YAFFS_BENCH_IO, &pos);
+		if (n <= 0)
+			err = n ? n : -EIO;
+	}
+	if (!err)
+		printk(KERN_INFO "yaffs_bench: %u MB sequential: write %llu "
+		       "KB/s, read %llu KB/s\n", seq_mb, writeRate,
+		       yaffs_bench_rate(size, start));
+
+	filp_close(file, NULL);
+	return err;
+}
+
+static int __init yaffs_bench_init(void)
+{
+	struct yaffs_bench_thread *rd, wr;
+	mm_segment_t old_fs;
+	struct file *file;
+	char *rname, *buf;
+	unsigned int i;
+	int err;
+
+	if (!readers || readers > YAFFS_BENCH_MAX_READERS || !seconds ||
+	    !write_mb)
+		return -EINVAL;
+
+	rname = yaffs_bench_path("r");
+	wr.name = yaffs_bench_path("w");
+	rd = kcalloc(readers, sizeof(*rd), GFP_KERNEL);
+	buf = kzalloc(YAFFS_BENCH_IO, GFP_KERNEL);
+	err = -ENOMEM;
+	if (!rname || !wr.name || !rd || !buf)
+		goto out;
+
+	/* the file the readers read */
+	file = filp_open(rname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	err = PTR_ERR(file);
+	if (IS_ERR(file))
+		goto out;
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	err = yaffs_bench_fill(file, buf, YAFFS_BENCH_READ_SIZE);
+	filp_close(file, NULL);
+	if (!err && seq_mb)
+		err = yaffs_bench_seq(buf);
+	set_fs(old_fs);
+	if (err)
+		goto out;
+
+	for (i = 0; i < readers; i++)
+		rd[i].name = rname;
+
+	printk(KERN_INFO "yaffs_bench: %u readers on %s, %u s per run\n",
+	       readers, dir, seconds);
+	err = yaffs_bench_run(rd, NULL, "idle");
+	if (!err)
+		err = yaffs_bench_run(rd, &wr, "writing");
+	if (err)
+		printk(KERN_ERR "yaffs_bench: failed, %d\n", err);
+out:
+	kfree(buf);
+	kfree(rd);
+	kfree(wr.name);
+	kfree(rname);
+	return err;
+}
+
+static void __exit yaffs_bench_exit(void)
+{
+}
+
+module_init(yaffs_bench_init);
+module_exit(yaffs_bench_exit);
+
+MODULE_LICENSE("GPL");
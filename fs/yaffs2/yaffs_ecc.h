@@ -41,4 +41,12 @@ void yaffs_ECCCalculateOther(const unsigned char *data, unsigned nBytes,
 int yaffs_ECCCorrectOther(unsigned char *data, unsigned nBytes,
 			yaffs_ECCOther *read_ecc,
 			const yaffs_ECCOther *test_ecc);
+
+#ifdef CONFIG_YAFFS_ECC_SELFTEST
+void yaffs_ECCSelfTest(void);
+#else
+static inline void yaffs_ECCSelfTest(void)
+{
+}
+#endif
 #endif
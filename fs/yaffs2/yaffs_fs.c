@@ -47,9 +47,12 @@ extern const char *yaffs_guts_c_version;
 #include <linux/proc_fs.h>
 #include <linux/smp_lock.h>
 #include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/cleancache.h>
 #include <linux/mtd/mtd.h>
 #include <linux/interrupt.h>
 #include <linux/string.h>
+#include <linux/ktime.h>
 #include <linux/ctype.h>
 
 #include "asm/div64.h"
@@ -97,6 +100,14 @@ extern const char *yaffs_guts_c_version;
 #define YAFFS_USE_WRITE_BEGIN_END 0
 #endif
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+#define YAFFS_USE_BG_THREAD 1
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#else
+#define YAFFS_USE_BG_THREAD 0
+#endif
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28))
 static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 {
@@ -112,6 +123,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 
 #include "yportenv.h"
 #include "yaffs_guts.h"
+#include "yaffs_ecc.h"
 
 #include <linux/mtd/mtd.h>
 #include "yaffs_mtdif.h"
@@ -121,16 +133,22 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_gc_urgency = 1;	/* 0 disables background GC */
+unsigned int yaffs_gc_chunks = 10;	/* chunks copied per GC step */
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_gc_urgency, uint, 0644);
+module_param(yaffs_gc_chunks, uint, 0444);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_bg_gc_urgency, "i");
+MODULE_PARM(yaffs_gc_chunks, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -242,6 +260,12 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc);
 #else
 static int yaffs_writepage(struct page *page);
 #endif
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 24))
+static int yaffs_readpages(struct file *file, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages);
+static int yaffs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc);
+#endif
 
 
 #if (YAFFS_USE_WRITE_BEGIN_END != 0)
@@ -270,6 +294,10 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd);
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
 	.writepage = yaffs_writepage,
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 24))
+	.readpages = yaffs_readpages,
+	.writepages = yaffs_writepages,
+#endif
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 	.write_begin = yaffs_write_begin,
 	.write_end = yaffs_write_end,
@@ -368,16 +396,116 @@ static const struct super_operations yaffs_super_ops = {
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
-	down(&dev->grossLock);
+	down_write(&dev->grossLock);
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs unlocking %p\n", current));
-	up(&dev->grossLock);
+	up_write(&dev->grossLock);
+}
+
+/*
+ * The shared lock is only for operations that neither change the device nor
+ * use its scratch state (short op cache, temp buffers). They only exclude
+ * writers and GC, and run alongside each other. Statistics counters may be
+ * updated racily under it.
+ */
+static void yaffs_GrossLockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs locking shared %p\n", current));
+	down_read(&dev->grossLock);
+	T(YAFFS_TRACE_OS, ("yaffs locked shared %p\n", current));
+}
+
+static void yaffs_GrossUnlockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs unlocking shared %p\n", current));
+	up_read(&dev->grossLock);
+}
+
+/* Write latencies, lock wait included, for /proc/yaffs. Needs grossLock. */
+static void yaffs_RecordWriteLatency(yaffs_Device *dev, ktime_t start)
+{
+	s64 usecs = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	while (usecs > 1 && bucket < YAFFS_WRITE_LATENCY_BUCKETS - 1) {
+		usecs >>= 1;
+		bucket++;
+	}
+	dev->writeLatency[bucket]++;
+}
+
+#if (YAFFS_USE_BG_THREAD > 0)
+/*
+ * The background thread garbage collects while the device is idle, that is
+ * while nobody holds or waits for the gross lock. While a block is being
+ * collected it comes back every few ticks, otherwise every couple of
+ * seconds. There is no remount hook, so it checks for a read-only mount
+ * on every pass and just sleeps while there is one.
+ */
+static int yaffs_BackgroundThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	struct super_block *sb = (struct super_block *)dev->superBlock;
+	unsigned urgency;
+	int more;
+
+	T(YAFFS_TRACE_GC, ("yaffs_background starting for %p\n", dev));
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		if (try_to_freeze())
+			continue;
+
+		more = 0;
+		urgency = yaffs_bg_gc_urgency;
+		if (urgency && !(sb->s_flags & MS_RDONLY) &&
+		    down_write_trylock(&dev->grossLock)) {
+			more = yaffs_BackgroundGarbageCollect(dev, urgency);
+			yaffs_GrossUnlock(dev);
+		}
+
+		schedule_timeout_interruptible(more ? HZ / 50 + 1 : 2 * HZ);
+	}
+
+	return 0;
+}
+
+static void yaffs_StartBackgroundThread(yaffs_Device *dev)
+{
+	struct task_struct *thread;
+
+	thread = kthread_run(yaffs_BackgroundThread, dev, "yaffs-bg-%s",
+			     dev->name);
+	if (IS_ERR(thread)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background thread\n"));
+		thread = NULL;
+	}
+	dev->bgThread = thread;
+}
+
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+	if (dev->bgThread) {
+		kthread_stop(dev->bgThread);
+		dev->bgThread = NULL;
+	}
+}
+#else
+static void yaffs_StartBackgroundThread(yaffs_Device *dev)
+{
 }
 
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+}
+#endif
+
 
 /*-----------------------------------------------------------------*/
 /* Directory search context allows us to unlock access to yaffs during
@@ -563,22 +691,35 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 {
 	yaffs_Object *obj;
 	struct inode *inode = NULL;	/* NCB 2.5/2.6 needs NULL here */
+	int needLock;
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
-
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
 		yaffs_InodeToObject(dir)->objectId, dentry->d_name.name));
 
-	obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
-					dentry->d_name.name);
+	/* Most lookups only need what is already in RAM */
+	yaffs_GrossLockShared(dev);
+
+	obj = yaffs_FindLoadedObjectByName(yaffs_InodeToObject(dir),
+					dentry->d_name.name, &needLock);
 
 	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
+
+	if (needLock) {
+		yaffs_GrossLock(dev);
+
+		obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
+						dentry->d_name.name);
+
+		obj = yaffs_GetEquivalentObject(obj);
+
+		/* Can't hold gross lock when calling yaffs_get_inode() */
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -740,13 +881,24 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	ret = -1;
+	if (dev->sharedReads) {
+		yaffs_GrossLockShared(dev);
+		ret = yaffs_ReadDataFromFileShared(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
+		yaffs_GrossUnlockShared(dev);
+	}
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
-				pg->index << PAGE_CACHE_SHIFT,
-				PAGE_CACHE_SIZE);
+	if (ret < 0) {
+		yaffs_GrossLock(dev);
 
-	yaffs_GrossUnlock(dev);
+		ret = yaffs_ReadDataFromFile(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
+
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -794,6 +946,7 @@ static int yaffs_writepage(struct page *page)
 	yaffs_Object *obj;
 	int nWritten = 0;
 	unsigned nBytes;
+	ktime_t start;
 
 	if (!mapping)
 		BUG();
@@ -825,6 +978,7 @@ static int yaffs_writepage(struct page *page)
 	buffer = kmap(page);
 
 	obj = yaffs_InodeToObject(inode);
+	start = ktime_get();
 	yaffs_GrossLock(obj->myDev);
 
 	T(YAFFS_TRACE_OS,
@@ -841,6 +995,7 @@ static int yaffs_writepage(struct page *page)
 		("writepag1: obj = %05x, ino = %05x\n",
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
+	yaffs_RecordWriteLatency(obj->myDev, start);
 	yaffs_GrossUnlock(obj->myDev);
 
 	kunmap(page);
@@ -851,6 +1006,196 @@ static int yaffs_writepage(struct page *page)
 	return (nWritten == nBytes) ? 0 : -ENOSPC;
 }
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 24))
+/*
+ * Readahead and writeback move up to YAFFS_BATCH_PAGES contiguous pages
+ * through a bounce buffer, so that the whole run costs one trip through
+ * the gross lock and, for reads, as few NAND operations as possible.
+ */
+#define YAFFS_BATCH_PAGES 8
+
+static void yaffs_ReadPageBatch(struct file *f, struct page **batch,
+				int nPages, __u8 *buffer)
+{
+	yaffs_Object *obj = yaffs_DentryToObject(f->f_dentry);
+	yaffs_Device *dev = obj->myDev;
+	int ret = -1;
+	int i;
+
+	if (buffer && nPages > 1 && dev->sharedReads) {
+		yaffs_GrossLockShared(dev);
+		ret = yaffs_ReadDataFromFileShared(obj, buffer,
+				(loff_t)batch[0]->index << PAGE_CACHE_SHIFT,
+				nPages * PAGE_CACHE_SIZE);
+		yaffs_GrossUnlockShared(dev);
+	}
+
+	for (i = 0; i < nPages; i++) {
+		struct page *pg = batch[i];
+
+		if (ret >= 0) {
+			memcpy(kmap(pg), buffer + i * PAGE_CACHE_SIZE,
+				PAGE_CACHE_SIZE);
+			flush_dcache_page(pg);
+			kunmap(pg);
+			SetPageUptodate(pg);
+			ClearPageError(pg);
+			unlock_page(pg);
+		} else
+			yaffs_readpage_unlock(f, pg);
+
+		page_cache_release(pg);
+	}
+}
+
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages)
+{
+	yaffs_Device *dev = yaffs_DentryToObject(f->f_dentry)->myDev;
+	struct page *batch[YAFFS_BATCH_PAGES];
+	int nBatch = 0;
+	__u8 *buffer = NULL;
+	unsigned i;
+
+	T(YAFFS_TRACE_OS, ("yaffs_readpages %u pages\n", nr_pages));
+
+	/* Another reader has the buffer: read page by page meanwhile */
+	if (dev->readpagesBuffer && mutex_trylock(&dev->readpagesLock))
+		buffer = dev->readpagesBuffer;
+
+	for (i = 0; i < nr_pages; i++) {
+		struct page *pg = list_entry(pages->prev, struct page, lru);
+
+		list_del(&pg->lru);
+		if (add_to_page_cache_lru(pg, mapping, pg->index,
+					GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+
+		if (nBatch > 0 && (nBatch == YAFFS_BATCH_PAGES ||
+				pg->index != batch[nBatch - 1]->index + 1)) {
+			yaffs_ReadPageBatch(f, batch, nBatch, buffer);
+			nBatch = 0;
+		}
+		batch[nBatch++] = pg;
+	}
+
+	if (nBatch > 0)
+		yaffs_ReadPageBatch(f, batch, nBatch, buffer);
+
+	if (buffer)
+		mutex_unlock(&dev->readpagesLock);
+	return 0;
+}
+
+typedef struct {
+	struct address_space *mapping;
+	struct page *pages[YAFFS_BATCH_PAGES];
+	int nPages;
+	unsigned nBytes;
+	__u8 *buffer;
+	int error;
+} yaffs_WritepagesContext;
+
+/* Writes out the batched pages and ends writeback on them. */
+static void yaffs_FlushWritepages(yaffs_WritepagesContext *wc)
+{
+	yaffs_Object *obj = yaffs_InodeToObject(wc->mapping->host);
+	ktime_t start;
+	int nWritten;
+	int i;
+
+	start = ktime_get();
+	yaffs_GrossLock(obj->myDev);
+
+	T(YAFFS_TRACE_OS,
+		("yaffs_writepages at %08x, %d pages, size %08x\n",
+		(unsigned)(wc->pages[0]->index << PAGE_CACHE_SHIFT),
+		wc->nPages, wc->nBytes));
+
+	nWritten = yaffs_WriteDataToFile(obj, wc->buffer,
+			(loff_t)wc->pages[0]->index << PAGE_CACHE_SHIFT,
+			wc->nBytes, 0);
+
+	yaffs_RecordWriteLatency(obj->myDev, start);
+	yaffs_GrossUnlock(obj->myDev);
+
+	for (i = 0; i < wc->nPages; i++) {
+		if (nWritten != wc->nBytes)
+			SetPageError(wc->pages[i]);
+		end_page_writeback(wc->pages[i]);
+	}
+
+	if (nWritten != wc->nBytes) {
+		mapping_set_error(wc->mapping, -ENOSPC);
+		wc->error = -ENOSPC;
+	}
+
+	wc->nPages = 0;
+	wc->nBytes = 0;
+}
+
+static int yaffs_WritepagesFill(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	yaffs_WritepagesContext *wc = data;
+	struct inode *inode = wc->mapping->host;
+	loff_t offset = (loff_t) page->index << PAGE_CACHE_SHIFT;
+	unsigned nBytes;
+
+	if (offset > inode->i_size) {
+		unlock_page(page);
+		return 0;
+	}
+
+	if (page->index < (inode->i_size >> PAGE_CACHE_SHIFT))
+		nBytes = PAGE_CACHE_SIZE;
+	else
+		nBytes = inode->i_size & (PAGE_CACHE_SIZE - 1);
+
+	if (wc->nPages > 0 && (wc->nPages == YAFFS_BATCH_PAGES ||
+			wc->nBytes != wc->nPages * PAGE_CACHE_SIZE ||
+			page->index != wc->pages[wc->nPages - 1]->index + 1))
+		yaffs_FlushWritepages(wc);
+
+	memcpy(wc->buffer + wc->nBytes, kmap(page), nBytes);
+	kunmap(page);
+	SetPageUptodate(page);
+
+	set_page_writeback(page);
+	unlock_page(page);
+
+	wc->pages[wc->nPages++] = page;
+	wc->nBytes += nBytes;
+
+	return 0;
+}
+
+static int yaffs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	yaffs_Device *dev = yaffs_InodeToObject(mapping->host)->myDev;
+	yaffs_WritepagesContext wc;
+	int ret;
+
+	/* Another writeback has the buffer: write page by page meanwhile */
+	if (!dev->writepagesBuffer || !mutex_trylock(&dev->writepagesLock))
+		return generic_writepages(mapping, wbc);
+
+	memset(&wc, 0, sizeof(wc));
+	wc.mapping = mapping;
+	wc.buffer = dev->writepagesBuffer;
+
+	ret = write_cache_pages(mapping, wbc, yaffs_WritepagesFill, &wc);
+	if (wc.nPages > 0)
+		yaffs_FlushWritepages(&wc);
+
+	mutex_unlock(&dev->writepagesLock);
+	return ret ? ret : wc.error;
+}
+#endif
+
 
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1152,11 +1497,13 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	int nWritten, ipos;
 	struct inode *inode;
 	yaffs_Device *dev;
+	ktime_t start;
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
 	dev = obj->myDev;
 
+	start = ktime_get();
 	yaffs_GrossLock(dev);
 
 	inode = f->f_dentry->d_inode;
@@ -1195,6 +1542,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
+	yaffs_RecordWriteLatency(dev, start);
 	yaffs_GrossUnlock(dev);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
@@ -1215,11 +1563,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	nFreeChunks = yaffs_GetNumberOfFreeChunks(dev);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	return (nFreeChunks > 20) ? 1 : 0;
 }
@@ -1677,7 +2025,7 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 
 	T(YAFFS_TRACE_OS, ("yaffs_statfs\n"));
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1726,7 +2074,7 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 	return 0;
 }
 
@@ -1881,6 +2229,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundThread(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1902,6 +2252,8 @@ static void yaffs_put_super(struct super_block *sb)
 		dev->spareBuffer = NULL;
 	}
 
+	kfree(dev->readpagesBuffer);
+	kfree(dev->writepagesBuffer);
 	kfree(dev);
 }
 
@@ -1931,6 +2283,7 @@ typedef struct {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int cache_size;
 	int empty_lost_and_found_overridden;
 	int empty_lost_and_found;
 } yaffs_options;
@@ -1963,6 +2316,9 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 			options->inband_tags = 1;
 		else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
+		else if (!strncmp(cur_opt, "cache-size=", 11))
+			options->cache_size = simple_strtoul(cur_opt + 11,
+							NULL, 0);
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
@@ -1998,6 +2354,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	struct mtd_info *mtd;
 	int err;
 	char *data_str = (char *)data;
+	struct timeval start;
+	struct timeval end;
 
 	yaffs_options options;
 
@@ -2187,7 +2545,13 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		dev->nShortOpCaches = 0;
+	else if (options.cache_size)
+		dev->nShortOpCaches = options.cache_size;
+	else
+		dev->nShortOpCaches = 10;
+	dev->gcChunksPerCall = yaffs_gc_chunks;
 	dev->inbandTags = options.inband_tags;
 #if defined (CONFIG_ARCH_RK2818) || (CONFIG_ARCH_RK29)
 	dev->inbandTags = 1;
@@ -2206,6 +2570,13 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 		dev->totalBytesPerChunk = mtd->writesize;
 		dev->nChunksPerBlock = mtd->erasesize / mtd->writesize;
+		/*
+		 * nandmtd2 data-only reads use no shared buffers on these
+		 * kernels, but with inband tags every chunk read needs the
+		 * tags unpacked through a temp buffer.
+		 */
+		dev->sharedReads = !dev->inbandTags;
+		dev->readChunksFromNAND = nandmtd2_ReadChunksFromNAND;
 #else
 		dev->totalBytesPerChunk = mtd->oobblock;
 		dev->nChunksPerBlock = mtd->erasesize / mtd->oobblock;
@@ -2257,11 +2628,15 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         YINIT_LIST_HEAD(&dev->searchContexts);
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->grossLock);
 
 	yaffs_GrossLock(dev);
 
+	do_gettimeofday(&start);
 	err = yaffs_GutsInitialise(dev);
+	do_gettimeofday(&end);
+	dev->mountMsecs = (end.tv_sec - start.tv_sec) * 1000 +
+			  (end.tv_usec - start.tv_usec) / 1000;
 
 	T(YAFFS_TRACE_OS,
 	  ("yaffs_read_super: guts initialised %s\n",
@@ -2296,6 +2671,21 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 24))
+	/* Allocated once here, as readahead and writeback would want them
+	 * over and over */
+	mutex_init(&dev->readpagesLock);
+	dev->readpagesBuffer = kmalloc(YAFFS_BATCH_PAGES * PAGE_CACHE_SIZE,
+				       GFP_KERNEL | __GFP_NOWARN);
+	mutex_init(&dev->writepagesLock);
+	dev->writepagesBuffer = kmalloc(YAFFS_BATCH_PAGES * PAGE_CACHE_SIZE,
+					GFP_KERNEL | __GFP_NOWARN);
+#endif
+
+	/* idles while mounted read-only, but may be remounted read-write */
+	yaffs_StartBackgroundThread(dev);
+	cleancache_init_fs(sb);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2397,6 +2787,36 @@ static DECLARE_FSTYPE(yaffs2_fs_type, "yaffs2", yaffs2_read_super,
 
 static struct proc_dir_entry *my_proc_entry;
 
+/* Bucket b of writeLatency counts writes that took under 2^(b+1) usecs */
+static char *yaffs_WriteLatencyPercentiles(char *buf, yaffs_Device *dev)
+{
+	static const unsigned percentiles[] = { 50, 90, 99, 100 };
+	__u32 total = 0;
+	__u32 sum;
+	int b;
+	int i;
+
+	for (b = 0; b < YAFFS_WRITE_LATENCY_BUCKETS; b++)
+		total += dev->writeLatency[b];
+
+	buf += sprintf(buf, "nWrites............ %u\n", total);
+	if (!total)
+		return buf;
+
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+		sum = 0;
+		for (b = 0; b < YAFFS_WRITE_LATENCY_BUCKETS - 1; b++) {
+			sum += dev->writeLatency[b];
+			if ((__u64)sum * 100 >= (__u64)total * percentiles[i])
+				break;
+		}
+		buf += sprintf(buf, "writeLatency p%-3u.. < %u us\n",
+			       percentiles[i], 1U << (b + 1));
+	}
+
+	return buf;
+}
+
 static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 {
 	buf += sprintf(buf, "startBlock......... %d\n", dev->startBlock);
@@ -2420,6 +2840,8 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2435,6 +2857,9 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "useNANDECC......... %d\n", dev->useNANDECC);
 	buf += sprintf(buf, "isYaffs2........... %d\n", dev->isYaffs2);
 	buf += sprintf(buf, "inbandTags......... %d\n", dev->inbandTags);
+	buf += sprintf(buf, "sharedReads........ %d\n", dev->sharedReads);
+	buf += sprintf(buf, "mountTime.......... %u ms\n", dev->mountMsecs);
+	buf = yaffs_WriteLatencyPercentiles(buf, dev);
 
 	return buf;
 }
@@ -2634,6 +3059,8 @@ static int __init init_yaffs_fs(void)
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs " __DATE__ " " __TIME__ " Installing. \n"));
 
+	yaffs_ECCSelfTest();
+
 	/* Install the proc_fs entry */
 	my_proc_entry = create_proc_entry("yaffs",
 					       S_IRUGO | S_IFREG,
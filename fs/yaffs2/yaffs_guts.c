@@ -1921,6 +1921,7 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
 		YINIT_LIST_HEAD(&tn->siblings);
+		YINIT_LIST_HEAD(&tn->chunkCaches);
 
 
 		/* Now make the directory sane */
@@ -2003,6 +2004,8 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 	}
 #endif
 
+	/* Caches must not keep pointing at a freed object */
+	yaffs_InvalidateWholeChunkCache(tn);
 	yaffs_UnhashObject(tn);
 
 #ifdef VALGRIND_TEST
@@ -2627,7 +2630,7 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
  */
 
 static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
-					int aggressive)
+					int aggressive, int background)
 {
 	int b = dev->currentDirtyChecker;
 
@@ -2670,14 +2673,19 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 	dev->nonAggressiveSkip--;
 
-	if (!aggressive && (dev->nonAggressiveSkip > 0))
+	if (!aggressive && !background && (dev->nonAggressiveSkip > 0))
 		return -1;
 
+	/* In the background we have time to look at all blocks, and will take
+	 * any that are at least half dirty.
+	 */
 	if (!prioritised)
 		pagesInUse =
-			(aggressive) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_CHUNKS + 1;
+			(aggressive) ? dev->nChunksPerBlock :
+			(background) ? dev->nChunksPerBlock / 2 + 1 :
+			YAFFS_PASSIVE_GC_CHUNKS + 1;
 
-	if (aggressive)
+	if (aggressive || background)
 		iterations =
 		    dev->internalEndBlock - dev->internalStartBlock + 1;
 	else {
@@ -2857,7 +2865,7 @@ static int yaffs_CalcCheckpointBlocksRequired(yaffs_Device *dev)
 		nBytes += devBlocks * sizeof(yaffs_BlockInfo);
 		nBytes += devBlocks * dev->chunkBitmapStride;
 		nBytes += (sizeof(yaffs_CheckpointObject) + sizeof(__u32)) * (dev->nObjectsCreated - dev->nFreeObjects);
-		nBytes += (tnodeSize + sizeof(__u32)) * (dev->nTnodesCreated - dev->nFreeTnodes);
+		nBytes += (tnodeSize + sizeof(__u32) + 1) * (dev->nTnodesCreated - dev->nFreeTnodes);
 		nBytes += sizeof(yaffs_CheckpointValidity);
 		nBytes += sizeof(__u32); /* checksum*/
 
@@ -3022,7 +3030,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 		yaffs_VerifyBlock(dev, bi, block);
 
-		maxCopies = (wholeBlock) ? dev->nChunksPerBlock : 10;
+		maxCopies = (wholeBlock) ? dev->nChunksPerBlock :
+			(dev->gcChunksPerCall > 0) ? dev->gcChunksPerCall : 10;
 		oldChunk = block * dev->nChunksPerBlock + dev->gcChunk;
 
 		for (/* init already done */;
@@ -3221,15 +3230,25 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
  *
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
+ *
+ * Each call only copies a few chunks (gcChunksPerCall) off the block being
+ * collected, unless we are already eating into the reserved blocks, so that
+ * a single write does not pay for a whole block of copying.
+ *
+ * 'background' is the urgency of a background collection, or 0 when called
+ * in the course of a write.
  */
-static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
+static int yaffs_CheckGarbageCollection(yaffs_Device *dev,
+					unsigned background)
 {
 	int block;
 	int aggressive;
+	int wholeBlock;
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
 
 	int checkpointBlockAdjust;
+	int minErased;
 
 	if (dev->isDoingGC) {
 		/* Bail out so we don't get recursive gc */
@@ -3247,7 +3266,9 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		if (checkpointBlockAdjust < 0)
 			checkpointBlockAdjust = 0;
 
-		if (dev->nErasedBlocks < (dev->nReservedBlocks + checkpointBlockAdjust + 2)) {
+		minErased = dev->nReservedBlocks + checkpointBlockAdjust + 1;
+
+		if (dev->nErasedBlocks < minErased + 1 || background > 1) {
 			/* We need a block soon...*/
 			aggressive = 1;
 		} else {
@@ -3255,8 +3276,12 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			aggressive = 0;
 		}
 
+		/* Down to the reserve: no time for doing it bit by bit */
+		wholeBlock = (dev->nErasedBlocks < minErased);
+
 		if (dev->gcBlock <= 0) {
-			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive);
+			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev,
+						aggressive, background);
 			dev->gcChunk = 0;
 		}
 
@@ -3266,13 +3291,18 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			dev->garbageCollections++;
 			if (!aggressive)
 				dev->passiveGarbageCollections++;
+			if (background)
+				dev->backgroundGarbageCollections++;
 
 			T(YAFFS_TRACE_GC,
 			  (TSTR
-			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
-			   dev->nErasedBlocks, aggressive));
+			   ("yaffs: GC erasedBlocks %d aggressive %d whole %d"
+			    " background %d" TENDSTR),
+			   dev->nErasedBlocks, aggressive, wholeBlock,
+			   background));
 
-			gcOk = yaffs_GarbageCollectBlock(dev, block, aggressive);
+			gcOk = yaffs_GarbageCollectBlock(dev, block,
+							 wholeBlock);
 		}
 
 		if (dev->nErasedBlocks < (dev->nReservedBlocks) && block > 0) {
@@ -3288,6 +3318,23 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/*
+ * yaffs_BackgroundGarbageCollect does one incremental step of garbage
+ * collection on behalf of an idle device. With an urgency of 1 it collects
+ * blocks that are at least half dirty, with 2 also less dirty ones.
+ * Returns 1 if it is in the middle of collecting a block, so should be called
+ * again soon.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency)
+{
+	if (!urgency || dev->isDoingGC)
+		return 0;
+
+	yaffs_CheckGarbageCollection(dev, urgency);
+
+	return dev->gcBlock > 0;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3642,7 +3689,7 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 	yaffs_Device *dev = in->myDev;
 
-	yaffs_CheckGarbageCollection(dev);
+	yaffs_CheckGarbageCollection(dev, 0);
 
 	/* Get the previous chunk at this location in the file if it exists */
 	prevChunkId = yaffs_FindChunkInFile(in, chunkInInode, &prevTags);
@@ -3709,7 +3756,7 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		in == dev->rootDir || /* The rootDir should also be saved */
 		force) {
 
-		yaffs_CheckGarbageCollection(dev);
+		yaffs_CheckGarbageCollection(dev, 0);
 		yaffs_CheckObjectDetailsLoaded(in);
 
 		buffer = yaffs_GetTempBuffer(in->myDev, __LINE__);
@@ -3855,21 +3902,90 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The number of cache chunks per device is set at mount time, so finding the
+ *   cache for a chunk goes through a small hash of (object, chunk), and each
+ *   object keeps its caches on a list sorted by chunkId. Unused caches sit on
+ *   the device's free list. Caches are only given to and taken from objects
+ *   with yaffs_SetChunkCache and yaffs_ClearChunkCache, which keep all of
+ *   these up to date.
  */
 
-static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
+static int yaffs_ChunkCacheHash(yaffs_Device *dev, const yaffs_Object *obj,
+				int chunkId)
+{
+	return (obj->objectId * 31 + chunkId) & dev->srCacheHashMask;
+}
+
+static void yaffs_ClearChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	int index = cache - dev->srCache;
+	int *link;
+
+	if (!cache->object)
+		return;
+
+	link = &dev->srCacheHash[yaffs_ChunkCacheHash(dev, cache->object,
+						      cache->chunkId)];
+	while (*link != index)
+		link = &dev->srCache[*link].hashNext;
+	*link = cache->hashNext;
+
+	ylist_del(&cache->objList);
+	ylist_add(&cache->objList, &dev->srCacheFree);
+
+	cache->hashNext = -1;
+	cache->object = NULL;
+}
+
+static void yaffs_SetChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				yaffs_Object *obj, int chunkId)
+{
+	int hash = yaffs_ChunkCacheHash(dev, obj, chunkId);
+	struct ylist_head *pos;
+
+	yaffs_ClearChunkCache(dev, cache);
+
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->hashNext = dev->srCacheHash[hash];
+	dev->srCacheHash[hash] = cache - dev->srCache;
+
+	/* Files are mostly written in order, so search from the end */
+	pos = obj->chunkCaches.prev;
+	while (pos != &obj->chunkCaches &&
+	       ylist_entry(pos, yaffs_ChunkCache, objList)->chunkId > chunkId)
+		pos = pos->prev;
+	ylist_del(&cache->objList);
+	ylist_add(&cache->objList, pos);
+}
+
+/* Changes nothing, so may be used with the device lock shared */
+static yaffs_ChunkCache *yaffs_LookupChunkCache(const yaffs_Object *obj,
+						int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
 	int i;
-	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	if (dev->nShortOpCaches <= 0)
+		return NULL;
+
+	i = dev->srCacheHash[yaffs_ChunkCacheHash(dev, obj, chunkId)];
+	while (i >= 0) {
+		if (dev->srCache[i].object == obj &&
+		    dev->srCache[i].chunkId == chunkId)
+			return &dev->srCache[i];
+		i = dev->srCache[i].hashNext;
+	}
+
+	return NULL;
+}
+
+static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
+{
+	struct ylist_head *i;
+
+	ylist_for_each(i, &obj->chunkCaches) {
+		if (ylist_entry(i, yaffs_ChunkCache, objList)->dirty)
 			return 1;
 	}
 
@@ -3880,49 +3996,29 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i, *n;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->nShortOpCaches;
-
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
+	int chunkWritten;
 
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
-
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
-
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
-
-		} while (cache && chunkWritten > 0);
+	/* Write out the dirty caches in chunk order, freeing them up */
+	ylist_for_each_safe(i, n, &obj->chunkCaches) {
+		cache = ylist_entry(i, yaffs_ChunkCache, objList);
+		if (!cache->dirty)
+			continue;
+		if (cache->locked)
+			break;
 
-		if (cache) {
+		chunkWritten = yaffs_WriteChunkDataToObject(obj,
+							    cache->chunkId,
+							    cache->data,
+							    cache->nBytes, 1);
+		cache->dirty = 0;
+		yaffs_ClearChunkCache(dev, cache);
+		if (chunkWritten <= 0) {
 			/* Hoosterman, disk full while writing cache out. */
 			T(YAFFS_TRACE_ERROR,
 			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
-
+			break;
 		}
 	}
 
@@ -3935,25 +4031,14 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
-	yaffs_Object *obj;
 	int nCaches = dev->nShortOpCaches;
 	int i;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
-		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
-
-	} while (obj);
+	/* Flushing an object cleans all of its caches, so one pass will do */
+	for (i = 0; i < nCaches; i++) {
+		if (dev->srCache[i].object && dev->srCache[i].dirty)
+			yaffs_FlushFilesChunkCache(dev->srCache[i].object);
+	}
 
 }
 
@@ -3965,14 +4050,9 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
-
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
+	if (dev->nShortOpCaches > 0 && !ylist_empty(&dev->srCacheFree))
+		return ylist_entry(dev->srCacheFree.next, yaffs_ChunkCache,
+				   objList);
 
 	return NULL;
 }
@@ -4032,19 +4112,12 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
-	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache = yaffs_LookupChunkCache(obj, chunkId);
 
-				return &dev->srCache[i];
-			}
-		}
-	}
-	return NULL;
+	if (cache)
+		obj->myDev->cacheHits++;
+
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -4081,7 +4154,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ClearChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4090,16 +4163,12 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
 	yaffs_Device *dev = in->myDev;
 
-	if (dev->nShortOpCaches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
-		}
-	}
+	while (!ylist_empty(&in->chunkCaches))
+		yaffs_ClearChunkCache(dev, ylist_entry(in->chunkCaches.next,
+						       yaffs_ChunkCache,
+						       objList));
 }
 
 /*--------------------- Checkpointing --------------------*/
@@ -4308,6 +4377,103 @@ static int yaffs_CheckpointObjectToObject(yaffs_Object *obj, yaffs_CheckpointObj
 
 
 
+/*
+ * A level 0 tnode is checkpointed as its base chunk and a run count. Files
+ * are mostly written sequentially, so a tnode usually maps a few runs of
+ * consecutive NAND chunks, each stored as (position, length, first chunk).
+ * A run count of zero means the raw tnode follows instead; that is used
+ * whenever the runs would not be smaller. Empty tnodes are not written.
+ */
+#define YAFFS_CHECKPOINT_RUN_SIZE 6
+
+static int yaffs_WriteCheckpointLevel0Tnode(yaffs_Device *dev,
+					yaffs_Tnode *tn, __u32 baseOffset,
+					int tnodeSize)
+{
+	__u8 rec[1 + YAFFS_NTNODES_LEVEL0 * YAFFS_CHECKPOINT_RUN_SIZE];
+	__u8 *run = &rec[1];
+	__u32 step = 1 << dev->chunkGroupBits;
+	__u32 first;
+	int nRuns = 0;
+	int ok;
+	int i;
+	int j;
+
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i = j) {
+		first = yaffs_GetChunkGroupBase(dev, tn, i);
+		j = i + 1;
+		if (!first)
+			continue;
+
+		while (j < YAFFS_NTNODES_LEVEL0 &&
+		       yaffs_GetChunkGroupBase(dev, tn, j) ==
+				first + (j - i) * step)
+			j++;
+
+		run[0] = i;
+		run[1] = j - i;
+		memcpy(&run[2], &first, sizeof(first));
+		run += YAFFS_CHECKPOINT_RUN_SIZE;
+		nRuns++;
+	}
+
+	if (!nRuns)
+		return 1;
+
+	if (nRuns * YAFFS_CHECKPOINT_RUN_SIZE >= tnodeSize)
+		nRuns = 0;
+	rec[0] = nRuns;
+
+	ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) ==
+		sizeof(baseOffset));
+	if (ok && nRuns)
+		ok = (yaffs_CheckpointWrite(dev, rec, run - rec) ==
+			run - rec);
+	else if (ok)
+		ok = (yaffs_CheckpointWrite(dev, rec, 1) == 1 &&
+			yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize);
+
+	return ok;
+}
+
+static int yaffs_ReadCheckpointLevel0Tnode(yaffs_Device *dev,
+					yaffs_Tnode *tn, int tnodeSize)
+{
+	__u8 rec[YAFFS_NTNODES_LEVEL0 * YAFFS_CHECKPOINT_RUN_SIZE];
+	__u8 *run;
+	__u32 step = 1 << dev->chunkGroupBits;
+	__u32 first;
+	__u8 nRuns;
+	int i;
+	int k;
+
+	if (yaffs_CheckpointRead(dev, &nRuns, 1) != 1)
+		return 0;
+
+	if (!nRuns)
+		return (yaffs_CheckpointRead(dev, tn, tnodeSize) == tnodeSize);
+
+	if (nRuns > YAFFS_NTNODES_LEVEL0 ||
+	    yaffs_CheckpointRead(dev, rec, nRuns * YAFFS_CHECKPOINT_RUN_SIZE) !=
+			nRuns * YAFFS_CHECKPOINT_RUN_SIZE)
+		return 0;
+
+	memset(tn, 0, tnodeSize);
+
+	for (i = 0; i < nRuns; i++) {
+		run = &rec[i * YAFFS_CHECKPOINT_RUN_SIZE];
+		if (run[0] + run[1] > YAFFS_NTNODES_LEVEL0)
+			return 0;
+
+		memcpy(&first, &run[2], sizeof(first));
+		for (k = 0; k < run[1]; k++)
+			yaffs_PutLevel0Tnode(dev, tn, run[0] + k,
+					first + k * step);
+	}
+
+	return 1;
+}
+
 static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 					__u32 level, int chunkOffset)
 {
@@ -4333,9 +4499,8 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 			}
 		} else if (level == 0) {
 			__u32 baseOffset = chunkOffset <<  YAFFS_TNODES_LEVEL0_BITS;
-			ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
-			if (ok)
-				ok = (yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize);
+			ok = yaffs_WriteCheckpointLevel0Tnode(dev, tn,
+							baseOffset, tnodeSize);
 		}
 	}
 
@@ -4383,7 +4548,8 @@ static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 
 		tn = yaffs_GetTnodeRaw(dev);
 		if (tn)
-			ok = (yaffs_CheckpointRead(dev, tn, tnodeSize) == tnodeSize);
+			ok = yaffs_ReadCheckpointLevel0Tnode(dev, tn,
+							tnodeSize);
 		else
 			ok = 0;
 
@@ -4406,6 +4572,111 @@ static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 }
 
 
+/*
+ * An object is checkpointed as a packed record: object id, parent id and
+ * header chunk, 16 bits of type and flags, the serial and then only the
+ * fields that apply, the data chunk count if non-zero and the file size
+ * or hard link target. That is 15 bytes for most directories instead of
+ * the 28 of a yaffs_CheckpointObject. An object id of ~0 ends the list.
+ */
+#define YAFFS_CHECKPOINT_OBJ_HDR_SIZE	15
+#define YAFFS_CHECKPOINT_OBJ_MAX_SIZE	(YAFFS_CHECKPOINT_OBJ_HDR_SIZE + 8)
+
+#define YAFFS_CHECKPOINT_OBJ_TYPE	0x0007
+#define YAFFS_CHECKPOINT_OBJ_DELETED	0x0008
+#define YAFFS_CHECKPOINT_OBJ_SOFTDEL	0x0010
+#define YAFFS_CHECKPOINT_OBJ_UNLINKED	0x0020
+#define YAFFS_CHECKPOINT_OBJ_FAKE	0x0040
+#define YAFFS_CHECKPOINT_OBJ_RENAME	0x0080
+#define YAFFS_CHECKPOINT_OBJ_UNLINK	0x0100
+#define YAFFS_CHECKPOINT_OBJ_CHUNKS	0x0200
+
+static int yaffs_HasCheckpointObjectSize(int variantType)
+{
+	return variantType == YAFFS_OBJECT_TYPE_FILE ||
+		variantType == YAFFS_OBJECT_TYPE_HARDLINK;
+}
+
+static int yaffs_WriteCheckpointObject(yaffs_Device *dev,
+					yaffs_CheckpointObject *cp)
+{
+	__u8 rec[YAFFS_CHECKPOINT_OBJ_MAX_SIZE];
+	int len = YAFFS_CHECKPOINT_OBJ_HDR_SIZE;
+	__u16 flags = cp->variantType;
+
+	if (cp->deleted)
+		flags |= YAFFS_CHECKPOINT_OBJ_DELETED;
+	if (cp->softDeleted)
+		flags |= YAFFS_CHECKPOINT_OBJ_SOFTDEL;
+	if (cp->unlinked)
+		flags |= YAFFS_CHECKPOINT_OBJ_UNLINKED;
+	if (cp->fake)
+		flags |= YAFFS_CHECKPOINT_OBJ_FAKE;
+	if (cp->renameAllowed)
+		flags |= YAFFS_CHECKPOINT_OBJ_RENAME;
+	if (cp->unlinkAllowed)
+		flags |= YAFFS_CHECKPOINT_OBJ_UNLINK;
+	if (cp->nDataChunks)
+		flags |= YAFFS_CHECKPOINT_OBJ_CHUNKS;
+
+	memcpy(&rec[0], &cp->objectId, 4);
+	memcpy(&rec[4], &cp->parentId, 4);
+	memcpy(&rec[8], &cp->hdrChunk, 4);
+	memcpy(&rec[12], &flags, 2);
+	rec[14] = cp->serial;
+
+	if (cp->nDataChunks) {
+		memcpy(&rec[len], &cp->nDataChunks, 4);
+		len += 4;
+	}
+	if (yaffs_HasCheckpointObjectSize(cp->variantType)) {
+		memcpy(&rec[len], &cp->fileSizeOrEquivalentObjectId, 4);
+		len += 4;
+	}
+
+	return (yaffs_CheckpointWrite(dev, rec, len) == len);
+}
+
+static int yaffs_ReadCheckpointObject(yaffs_Device *dev,
+					yaffs_CheckpointObject *cp)
+{
+	__u8 rec[YAFFS_CHECKPOINT_OBJ_HDR_SIZE];
+	__u16 flags;
+
+	if (yaffs_CheckpointRead(dev, rec, sizeof(rec)) != sizeof(rec))
+		return 0;
+
+	memset(cp, 0, sizeof(*cp));
+	memcpy(&cp->objectId, &rec[0], 4);
+	if (cp->objectId == ~0)
+		return 1;
+
+	memcpy(&cp->parentId, &rec[4], 4);
+	memcpy(&cp->hdrChunk, &rec[8], 4);
+	memcpy(&flags, &rec[12], 2);
+	cp->serial = rec[14];
+
+	if ((flags & YAFFS_CHECKPOINT_OBJ_TYPE) > YAFFS_OBJECT_TYPE_MAX)
+		return 0;
+	cp->variantType = flags & YAFFS_CHECKPOINT_OBJ_TYPE;
+	cp->deleted = !!(flags & YAFFS_CHECKPOINT_OBJ_DELETED);
+	cp->softDeleted = !!(flags & YAFFS_CHECKPOINT_OBJ_SOFTDEL);
+	cp->unlinked = !!(flags & YAFFS_CHECKPOINT_OBJ_UNLINKED);
+	cp->fake = !!(flags & YAFFS_CHECKPOINT_OBJ_FAKE);
+	cp->renameAllowed = !!(flags & YAFFS_CHECKPOINT_OBJ_RENAME);
+	cp->unlinkAllowed = !!(flags & YAFFS_CHECKPOINT_OBJ_UNLINK);
+
+	if ((flags & YAFFS_CHECKPOINT_OBJ_CHUNKS) &&
+	    yaffs_CheckpointRead(dev, &cp->nDataChunks, 4) != 4)
+		return 0;
+	if (yaffs_HasCheckpointObjectSize(cp->variantType) &&
+	    yaffs_CheckpointRead(dev, &cp->fileSizeOrEquivalentObjectId,
+				 4) != 4)
+		return 0;
+
+	return 1;
+}
+
 static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 {
 	yaffs_Object *obj;
@@ -4425,13 +4696,12 @@ static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
 				if (!obj->deferedFree) {
 					yaffs_ObjectToCheckpointObject(&cp, obj);
-					cp.structType = sizeof(cp);
 
 					T(YAFFS_TRACE_CHECKPOINT, (
 						TSTR("Checkpoint write object %d parent %d type %d chunk %d obj addr %x" TENDSTR),
 						cp.objectId, cp.parentId, cp.variantType, cp.hdrChunk, (unsigned) obj));
 
-					ok = (yaffs_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp));
+					ok = yaffs_WriteCheckpointObject(dev, &cp);
 
 					if (ok && obj->variantType == YAFFS_OBJECT_TYPE_FILE)
 						ok = yaffs_WriteCheckpointTnodes(obj);
@@ -4441,11 +4711,11 @@ static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 	}
 
 	/* Dump end of list */
-	memset(&cp, 0xFF, sizeof(yaffs_CheckpointObject));
-	cp.structType = sizeof(cp);
+	memset(&cp, 0, sizeof(yaffs_CheckpointObject));
+	cp.objectId = ~0;
 
 	if (ok)
-		ok = (yaffs_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp));
+		ok = yaffs_WriteCheckpointObject(dev, &cp);
 
 	return ok ? 1 : 0;
 }
@@ -4459,11 +4729,11 @@ static int yaffs_ReadCheckpointObjects(yaffs_Device *dev)
 	yaffs_Object *hardList = NULL;
 
 	while (ok && !done) {
-		ok = (yaffs_CheckpointRead(dev, &cp, sizeof(cp)) == sizeof(cp));
-		if (cp.structType != sizeof(cp)) {
-			T(YAFFS_TRACE_CHECKPOINT, (TSTR("struct size %d instead of %d ok %d"TENDSTR),
-				cp.structType, sizeof(cp), ok));
-			ok = 0;
+		ok = yaffs_ReadCheckpointObject(dev, &cp);
+		if (!ok) {
+			T(YAFFS_TRACE_CHECKPOINT,
+			  (TSTR("Checkpoint object record bad" TENDSTR)));
+			break;
 		}
 
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("Checkpoint read object %d parent %d type %d chunk %d " TENDSTR),
@@ -4720,8 +4990,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 				if (!cache) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					yaffs_SetChunkCache(dev, cache,
+							in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -4770,6 +5040,65 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+/*
+ * yaffs_ReadDataFromFileShared reads whole chunks that are not in the short
+ * op cache straight from NAND into the buffer, runs of chunks that are
+ * consecutive on NAND in a single read. Unlike yaffs_ReadDataFromFile it
+ * does not use the cache or the temp buffers, nor does it handle ECC errors
+ * (which updates the block info), so readers holding the device lock shared
+ * may run it side by side. Returns -1 if the range cannot be read this way
+ * or a read fails; the caller then reads it again with the lock held
+ * exclusively, which handles the errors.
+ */
+int yaffs_ReadDataFromFileShared(yaffs_Object *in, __u8 *buffer,
+				loff_t offset, int nBytes)
+{
+	yaffs_Device *dev = in->myDev;
+	int chunk;
+	__u32 start;
+	int nChunks;
+	int nandChunk;
+	int run;
+	int j;
+
+	if (dev->inbandTags || nBytes % dev->nDataBytesPerChunk)
+		return -1;
+
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+	chunk++;
+	if (start != 0)
+		return -1;
+
+	nChunks = nBytes / dev->nDataBytesPerChunk;
+	for (j = 0; j < nChunks; j++) {
+		if (yaffs_LookupChunkCache(in, chunk + j))
+			return -1;
+	}
+
+	while (nChunks > 0) {
+		nandChunk = yaffs_FindChunkInFile(in, chunk, NULL);
+
+		/* How many of the following chunks come right after it? */
+		run = 1;
+		while (nandChunk >= 0 && run < nChunks &&
+		       yaffs_FindChunkInFile(in, chunk + run, NULL) ==
+		       nandChunk + run)
+			run++;
+
+		if (nandChunk < 0)
+			memset(buffer, 0, dev->nDataBytesPerChunk); /* a hole */
+		else if (yaffs_ReadChunksFromNAND(dev, nandChunk, run,
+						  buffer) != YAFFS_OK)
+			return -1;
+
+		chunk += run;
+		nChunks -= run;
+		buffer += run * dev->nDataBytesPerChunk;
+	}
+
+	return nBytes;
+}
+
 int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -4850,8 +5179,8 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					yaffs_SetChunkCache(dev, cache,
+							in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -5008,7 +5337,7 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 	yaffs_FlushFilesChunkCache(in);
 	yaffs_InvalidateWholeChunkCache(in);
 
-	yaffs_CheckGarbageCollection(dev);
+	yaffs_CheckGarbageCollection(dev, 0);
 
 	if (in->variantType != YAFFS_OBJECT_TYPE_FILE)
 		return YAFFS_FAIL;
@@ -6277,8 +6606,12 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			/* Inband tags come with the data, so keep it in case
+			 * this turns out to be an object header.
+			 */
+			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk,
+					dev->inbandTags ? chunkData : NULL,
+					&tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6427,10 +6760,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 					 * living with invalid data until needed.
 					 */
 
-					result = yaffs_ReadChunkWithTagsFromNAND(dev,
-									chunk,
-									chunkData,
-									NULL);
+					if (!dev->inbandTags)
+						result =
+						    yaffs_ReadChunkWithTagsFromNAND(
+							dev, chunk, chunkData,
+							NULL);
 
 					oh = (yaffs_ObjectHeader *) chunkData;
 
@@ -6914,8 +7248,13 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	yaffs_VerifyObjectInDirectory(obj);
 }
 
-yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
-				     const YCHAR *name)
+/*
+ * With a needLock, search only what is in RAM: if an object on the way has
+ * not had its details loaded, or its name has to be read from NAND, give up
+ * and set *needLock so that the caller retries with the device locked.
+ */
+static yaffs_Object *yaffs_FindObjectByNameWorker(yaffs_Object *directory,
+				const YCHAR *name, int *needLock)
 {
 	int sum;
 
@@ -6951,7 +7290,12 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 			if (l->parent != directory)
 				YBUG();
 
-			yaffs_CheckObjectDetailsLoaded(l);
+			if (!needLock)
+				yaffs_CheckObjectDetailsLoaded(l);
+			else if (l->lazyLoaded && l->hdrChunk > 0) {
+				*needLock = 1;
+				return NULL;
+			}
 
 			/* Special case for lost-n-found */
 			if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
@@ -6961,6 +7305,14 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				/* LostnFound chunk called Objxxx
 				 * Do a real check
 				 */
+				if (needLock && l->hdrChunk > 0
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+				    && !l->shortName[0]
+#endif
+				    ) {
+					*needLock = 1;
+					return NULL;
+				}
 				yaffs_GetObjectName(l, buffer,
 						    YAFFS_MAX_NAME_LENGTH + 1);
 				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
@@ -6972,6 +7324,24 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	return NULL;
 }
 
+yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
+				     const YCHAR *name)
+{
+	return yaffs_FindObjectByNameWorker(directory, name, NULL);
+}
+
+/*
+ * Like yaffs_FindObjectByName, but neither reads NAND nor changes any state,
+ * so that it can be called with the device lock shared. Returns NULL with
+ * *needLock set if yaffs_FindObjectByName has to be used instead.
+ */
+yaffs_Object *yaffs_FindLoadedObjectByName(yaffs_Object *directory,
+					   const YCHAR *name, int *needLock)
+{
+	*needLock = 0;
+	return yaffs_FindObjectByNameWorker(directory, name, needLock);
+}
+
 
 #if 0
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
@@ -7458,6 +7828,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	dev->srCache = NULL;
+	YINIT_LIST_HEAD(&dev->srCacheFree);
 	dev->gcCleanupList = NULL;
 
 
@@ -7465,10 +7836,20 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	    dev->nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+		int nHash = 1;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+
+		/* About two chains per cache */
+		while (nHash < 2 * dev->nShortOpCaches)
+			nHash <<= 1;
+		dev->srCacheHashMask = nHash - 1;
+		dev->srCacheHash = YMALLOC(nHash * sizeof(int));
+		for (i = 0; dev->srCacheHash && i < nHash; i++)
+			dev->srCacheHash[i] = -1;
 
 		dev->srCache =  YMALLOC(srCacheBytes);
 
@@ -7481,9 +7862,12 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			dev->srCache[i].object = NULL;
 			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			dev->srCache[i].hashNext = -1;
+			ylist_add_tail(&dev->srCache[i].objList,
+				       &dev->srCacheFree);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
-		if (!buf)
+		if (!buf || !dev->srCacheHash)
 			init_failed = 1;
 
 		dev->srLastUse = 0;
@@ -7608,6 +7992,10 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			YFREE(dev->srCache);
 			dev->srCache = NULL;
 		}
+		if (dev->srCacheHash) {
+			YFREE(dev->srCacheHash);
+			dev->srCacheHash = NULL;
+		}
 
 		YFREE(dev->gcCleanupList);
 
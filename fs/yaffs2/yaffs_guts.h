@@ -60,10 +60,12 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+#define YAFFS_WRITE_LATENCY_BUCKETS	24
+
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
-#define YAFFS_CHECKPOINT_VERSION 	3
+#define YAFFS_CHECKPOINT_VERSION 	5
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -88,7 +90,7 @@
 
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -119,6 +121,8 @@ typedef struct {
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
+	int hashNext;		/* Next cache in the hash chain, or -1 */
+	struct ylist_head objList; /* The object's caches by chunkId, or free */
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u8 *data;
 #else
@@ -435,6 +439,8 @@ struct yaffs_ObjectStruct {
 
 	struct ylist_head hardLinks;    /* all the equivalent hard linked objects */
 
+	struct ylist_head chunkCaches;  /* short op caches holding my chunks */
+
 	/* directory structure stuff */
 	/* also used for linking up the free list */
 	struct yaffs_ObjectStruct *parent;
@@ -556,6 +562,8 @@ struct yaffs_DeviceStruct {
 				 * the number of short op caches (don't use too many)
 				 */
 
+	int gcChunksPerCall;	/* Chunks copied per GC step, 0 for 10 */
+
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 
 	int emptyLostAndFound;  /* Flasg to determine if lst+found should be emptied on init */
@@ -590,6 +598,9 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+	/* Optional: data of consecutive chunks in one go, no tags */
+	int (*readChunksFromNAND) (struct yaffs_DeviceStruct *dev,
+				   int chunkInNAND, int nChunks, __u8 *data);
 #endif
 
 	int isYaffs2;
@@ -636,7 +647,8 @@ struct yaffs_DeviceStruct {
 #ifdef __KERNEL__
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
-	struct semaphore grossLock;	/* Gross locking semaphore */
+	struct rw_semaphore grossLock;	/* Gross lock, shared by readers */
+	int sharedReads;	/* NAND reads are safe with grossLock shared */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
@@ -644,6 +656,13 @@ struct yaffs_DeviceStruct {
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
+	struct task_struct *bgThread;	/* Background GC thread */
+	__u32 writeLatency[YAFFS_WRITE_LATENCY_BUCKETS]; /* log2 usecs */
+	__u32 mountMsecs;	/* Time taken by yaffs_GutsInitialise() */
+	__u8 *readpagesBuffer;	/* Bounce buffer for readahead batches */
+	struct mutex readpagesLock;	/* Serialises use of readpagesBuffer */
+	__u8 *writepagesBuffer;	/* Bounce buffer for writeback batches */
+	struct mutex writepagesLock;	/* Serialises use of writepagesBuffer */
 
 #endif
 
@@ -725,6 +744,7 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -749,6 +769,9 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
+	int *srCacheHash;	/* Heads of the cache hash chains, or -1 */
+	int srCacheHashMask;	/* Number of chains - 1 */
+	struct ylist_head srCacheFree;	/* Caches not given to any object */
 	int srLastUse;
 
 	int cacheHits;
@@ -842,6 +865,8 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadDataFromFileShared(yaffs_Object *obj, __u8 *buffer,
+				loff_t offset, int nBytes);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -853,6 +878,9 @@ int yaffs_FlushFile(yaffs_Object *obj, int updateTime);
 /* Flushing and checkpointing */
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 
+/* Garbage collection */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency);
+
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
@@ -860,6 +888,8 @@ int yaffs_CheckpointRestore(yaffs_Device *dev);
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *theDir, const YCHAR *name);
+yaffs_Object *yaffs_FindLoadedObjectByName(yaffs_Object *theDir,
+				const YCHAR *name, int *needLock);
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
 				   int (*fn) (yaffs_Object *));
 
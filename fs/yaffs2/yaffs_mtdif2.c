@@ -135,7 +135,8 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		ops.len = data ? dev->nDataBytesPerChunk : sizeof(pt);
 		ops.ooboffs = 0;
 		ops.datbuf = data;
-		ops.oobbuf = dev->spareBuffer;
+		/* not dev->spareBuffer: readers may run concurrently */
+		ops.oobbuf = (__u8 *)&pt;
 		retval = mtd->read_oob(mtd, addr, &ops);
 	}
 #else
@@ -165,7 +166,9 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		}
 	} else {
 		if (tags) {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
 			memcpy(&pt, dev->spareBuffer, sizeof(pt));
+#endif
 			yaffs_UnpackTags2(tags, &pt);
 		}
 	}
@@ -192,6 +195,29 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+int nandmtd2_ReadChunksFromNAND(yaffs_Device *dev, int chunkInNAND,
+				int nChunks, __u8 *data)
+{
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	size_t len = nChunks * dev->totalBytesPerChunk;
+	size_t dummy;
+	int retval;
+
+	loff_t addr = ((loff_t) chunkInNAND) * dev->totalBytesPerChunk;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadChunksFromNAND chunk %d n %d" TENDSTR),
+	   chunkInNAND, nChunks));
+
+	retval = mtd->read(mtd, addr, len, &dummy, data);
+
+	/* Corrected or not, let the caller redo it chunk by chunk */
+	if (retval != 0 || dummy != len)
+		return YAFFS_FAIL;
+
+	return YAFFS_OK;
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
@@ -53,6 +53,23 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/*
+ * Reads the data of nChunks consecutive chunks. Returns YAFFS_FAIL if the
+ * device cannot, or if the read hit an ECC error: the caller should then read
+ * the chunks one by one, so that the errors are handled.
+ */
+int yaffs_ReadChunksFromNAND(yaffs_Device *dev, int chunkInNAND,
+				int nChunks, __u8 *buffer)
+{
+	if (!dev->readChunksFromNAND || dev->inbandTags)
+		return YAFFS_FAIL;
+
+	dev->nPageReads += nChunks;
+
+	return dev->readChunksFromNAND(dev, chunkInNAND - dev->chunkOffset,
+				       nChunks, buffer);
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
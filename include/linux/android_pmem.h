@@ -50,6 +50,9 @@ struct android_pmem_platform_data
 	unsigned cached;
 	/* The MSM7k has bits to enable a write buffer in the bus controller*/
 	unsigned buffered;
+	/* set if the region was declared with cma_declare(), it is then lent
+	 * to the page allocator while nothing is allocated from it */
+	unsigned cma;
 };
 
 struct pmem_region {
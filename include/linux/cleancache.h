@@ -0,0 +1,107 @@
+#ifndef _LINUX_CLEANCACHE_H
+#define _LINUX_CLEANCACHE_H
+
+/*
+ * Cleancache keeps LZO compressed copies of clean page cache pages that
+ * reclaim evicted, so that a later miss can be served by decompressing
+ * instead of reading the backing device again. Filesystems opt in with
+ * cleancache_init_fs() at mount time.
+ *
+ * Copies are keyed by (filesystem, inode number, page index). A copy is
+ * handed back at most once; truncation and invalidation of an inode drop
+ * all of its copies.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+
+#ifdef CONFIG_CLEANCACHE
+
+extern void cleancache_init_fs(struct super_block *sb);
+extern void __cleancache_flush_fs(struct super_block *sb);
+extern void __cleancache_put_page(struct page *page);
+extern int __cleancache_get_page(struct address_space *mapping,
+				 struct page *page);
+extern void __cleancache_flush_inode(struct address_space *mapping);
+
+static inline int cleancache_fs_enabled(struct address_space *mapping)
+{
+	return mapping->host && mapping->host->i_sb &&
+	       mapping->host->i_sb->cleancache_poolid >= 0;
+}
+
+static inline void cleancache_flush_fs(struct super_block *sb)
+{
+	if (sb->cleancache_poolid >= 0)
+		__cleancache_flush_fs(sb);
+}
+
+/* Called by reclaim with the page locked and mapping->tree_lock held */
+static inline void cleancache_put_page(struct page *page)
+{
+	if (cleancache_fs_enabled(page->mapping) && PageUptodate(page))
+		__cleancache_put_page(page);
+}
+
+/*
+ * Fill @page, which is locked and not uptodate, from its copy. Returns 0
+ * on success; the copy is consumed.
+ */
+static inline int cleancache_get_page(struct address_space *mapping,
+				      struct page *page)
+{
+	if (!cleancache_fs_enabled(mapping))
+		return -1;
+	return __cleancache_get_page(mapping, page);
+}
+
+static inline void cleancache_flush_inode(struct address_space *mapping)
+{
+	if (cleancache_fs_enabled(mapping))
+		__cleancache_flush_inode(mapping);
+}
+
+#else
+
+static inline void cleancache_init_fs(struct super_block *sb)
+{
+}
+
+static inline void cleancache_flush_fs(struct super_block *sb)
+{
+}
+
+static inline void cleancache_put_page(struct page *page)
+{
+}
+
+static inline int cleancache_get_page(struct address_space *mapping,
+				      struct page *page)
+{
+	return -1;
+}
+
+static inline void cleancache_flush_inode(struct address_space *mapping)
+{
+}
+
+#endif /* CONFIG_CLEANCACHE */
+
+/*
+ * Read a locked page cache page, from cleancache if it has a copy and
+ * through ->readpage otherwise. Returns as ->readpage does.
+ */
+static inline int cleancache_readpage(struct file *filp, struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+
+	if (cleancache_get_page(mapping, page) == 0) {
+		SetPageUptodate(page);
+		unlock_page(page);
+		return 0;
+	}
+	return mapping->a_ops->readpage(filp, page);
+}
+
+#endif /* _LINUX_CLEANCACHE_H */
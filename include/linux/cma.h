@@ -0,0 +1,53 @@
+#ifndef _LINUX_CMA_H
+#define _LINUX_CMA_H
+
+/*
+ * Contiguous memory regions that the page allocator borrows while their
+ * owner does not need them, see mm/cma.c.
+ *
+ * Board code declares a region from its ->map_io() hook, while bootmem
+ * is still up. The region must be CMA_ALIGN aligned, lie in lowmem and
+ * be part of the memory given to the kernel. Drivers then claim a fixed
+ * range of it with cma_claim() or any free part with cma_alloc(), and
+ * give it back with cma_release().
+ */
+
+#include <linux/mm.h>
+#include <linux/pageblock-flags.h>
+
+/* regions are made of whole pageblocks */
+#define CMA_ALIGN		(PAGE_SIZE << pageblock_order)
+
+#define CMA_MAX_REGIONS		4
+
+#ifdef CONFIG_CMA
+
+extern int cma_declare(unsigned long base, unsigned long size);
+extern int cma_claim(struct page *page, unsigned long count);
+extern struct page *cma_alloc(unsigned long count, unsigned int order);
+extern void cma_release(struct page *page, unsigned long count);
+
+#else
+
+static inline int cma_declare(unsigned long base, unsigned long size)
+{
+	return -ENOSYS;
+}
+
+static inline int cma_claim(struct page *page, unsigned long count)
+{
+	return -ENOSYS;
+}
+
+static inline struct page *cma_alloc(unsigned long count, unsigned int order)
+{
+	return NULL;
+}
+
+static inline void cma_release(struct page *page, unsigned long count)
+{
+}
+
+#endif /* CONFIG_CMA */
+
+#endif /* _LINUX_CMA_H */
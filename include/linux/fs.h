@@ -1385,6 +1385,9 @@ struct super_block {
 	 * generic_show_options()
 	 */
 	char *s_options;
+
+	/* Cleancache pool of this filesystem, or -1 if it is not used */
+	int cleancache_poolid;
 };
 
 extern struct timespec current_fs_time(struct super_block *sb);
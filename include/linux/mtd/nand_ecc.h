@@ -15,6 +15,12 @@
 
 struct mtd_info;
 
+/*
+ * Calculate 3 byte ECC code for eccsize byte block
+ */
+void __nand_calculate_ecc(const u_char *dat, unsigned int eccsize,
+			  u_char *ecc_code);
+
 /*
  * Calculate 3 byte ECC code for 256 byte block
  */
@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -41,5 +42,23 @@ static inline void oom_killer_enable(void)
 {
 	oom_killer_disabled = false;
 }
+
+/*
+ * The lowmemorykiller keeps thread group leaders on per-oom_adj lists, so it
+ * need not walk every process to choose a victim.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_add(struct task_struct *p);
+extern void lowmem_adj_del(struct task_struct *p);
+extern void lowmem_adj_replace(struct task_struct *old,
+			       struct task_struct *new);
+extern void lowmem_adj_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_add(struct task_struct *p) { }
+static inline void lowmem_adj_del(struct task_struct *p) { }
+static inline void lowmem_adj_replace(struct task_struct *old,
+				      struct task_struct *new) { }
+static inline void lowmem_adj_update(struct task_struct *p) { }
+#endif
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
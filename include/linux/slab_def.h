@@ -29,6 +29,9 @@ struct kmem_cache {
 	unsigned int batchcount;
 	unsigned int limit;
 	unsigned int shared;
+	unsigned int auto_limit;	/* 0: limit set through slabinfo */
+	unsigned int tune_misses;	/* array misses seen by autotuning */
+	unsigned long next_tune;
 
 	unsigned int buffer_size;
 	u32 reciprocal_buffer_size;
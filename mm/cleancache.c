@@ -0,0 +1,473 @@
+/*
+ * Compressed cache of clean page cache pages evicted by reclaim.
+ *
+ * When reclaim drops a clean page of a filesystem that opted in, the page
+ * is LZO compressed into a RAM pool; when the page is next looked up and
+ * missed, the copy is decompressed instead of reading the backing device.
+ * On NAND, where a read costs far more than a decompression, this keeps
+ * a good part of the evicted working set cheap to get back.
+ *
+ * The pool is capped (/sys/kernel/mm/cleancache/max_kbytes), evicts its
+ * oldest copies first and gives memory back through a shrinker.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/radix-tree.h>
+#include <linux/percpu.h>
+#include <linux/lzo.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/cleancache.h>
+
+#define CLEANCACHE_MAX_POOLS	32
+
+/* The compressed pages of one inode */
+struct cleancache_inode {
+	struct rb_node		node;
+	unsigned long		ino;
+	struct radix_tree_root	pages;
+	unsigned long		nr_pages;
+	int			pool;
+};
+
+struct cleancache_copy {
+	struct list_head	lru;
+	struct cleancache_inode	*inode;
+	pgoff_t			index;
+	unsigned int		len;
+	unsigned char		data[0];
+};
+
+/*
+ * Above this a copy would take a whole page of kmalloc memory and
+ * save nothing.
+ */
+#define CLEANCACHE_MAX_LEN	(PAGE_SIZE / 2 - sizeof(struct cleancache_copy))
+
+/*
+ * cleancache_lock protects everything below. Puts come from reclaim with
+ * mapping->tree_lock held and interrupts off, so it is always taken with
+ * interrupts disabled.
+ */
+static DEFINE_SPINLOCK(cleancache_lock);
+static struct rb_root cleancache_pools[CLEANCACHE_MAX_POOLS];
+static DECLARE_BITMAP(cleancache_pools_used, CLEANCACHE_MAX_POOLS);
+static LIST_HEAD(cleancache_lru);
+static unsigned long cleancache_bytes;
+static unsigned long cleancache_max_bytes;
+static unsigned long cleancache_nr_copies;
+
+static unsigned long cleancache_puts;
+static unsigned long cleancache_failed_puts;
+static unsigned long cleancache_succ_gets;
+static unsigned long cleancache_failed_gets;
+static unsigned long cleancache_flushes;
+static unsigned long cleancache_evicted;
+
+/* Compression scratch space, used with interrupts off */
+static DEFINE_PER_CPU(void *, cleancache_wrkmem);
+static DEFINE_PER_CPU(unsigned char *, cleancache_dst);
+
+static struct cleancache_inode *cleancache_find_inode(int pool,
+						      unsigned long ino)
+{
+	struct rb_node *node = cleancache_pools[pool].rb_node;
+	struct cleancache_inode *inode;
+
+	while (node) {
+		inode = rb_entry(node, struct cleancache_inode, node);
+		if (ino < inode->ino)
+			node = node->rb_left;
+		else if (ino > inode->ino)
+			node = node->rb_right;
+		else
+			return inode;
+	}
+	return NULL;
+}
+
+static struct cleancache_inode *cleancache_get_inode(int pool,
+						     unsigned long ino)
+{
+	struct rb_node **p = &cleancache_pools[pool].rb_node;
+	struct rb_node *parent = NULL;
+	struct cleancache_inode *inode;
+
+	while (*p) {
+		parent = *p;
+		inode = rb_entry(parent, struct cleancache_inode, node);
+		if (ino < inode->ino)
+			p = &parent->rb_left;
+		else if (ino > inode->ino)
+			p = &parent->rb_right;
+		else
+			return inode;
+	}
+
+	inode = kmalloc(sizeof(*inode), GFP_NOWAIT | __GFP_NOWARN);
+	if (!inode)
+		return NULL;
+	inode->ino = ino;
+	inode->pool = pool;
+	inode->nr_pages = 0;
+	INIT_RADIX_TREE(&inode->pages, GFP_NOWAIT | __GFP_NOWARN);
+	rb_link_node(&inode->node, parent, p);
+	rb_insert_color(&inode->node, &cleancache_pools[pool]);
+	return inode;
+}
+
+static void cleancache_release_inode(struct cleancache_inode *inode)
+{
+	if (inode->nr_pages)
+		return;
+	rb_erase(&inode->node, &cleancache_pools[inode->pool]);
+	kfree(inode);
+}
+
+/* Takes a copy out of the pool; its inode may be left empty */
+static void cleancache_unlink_copy(struct cleancache_copy *copy)
+{
+	radix_tree_delete(&copy->inode->pages, copy->index);
+	copy->inode->nr_pages--;
+	list_del(&copy->lru);
+	cleancache_bytes -= sizeof(*copy) + copy->len;
+	cleancache_nr_copies--;
+}
+
+static void cleancache_drop_copy(struct cleancache_copy *copy)
+{
+	struct cleancache_inode *inode = copy->inode;
+
+	cleancache_unlink_copy(copy);
+	kfree(copy);
+	cleancache_release_inode(inode);
+}
+
+static void cleancache_evict(unsigned long max_bytes)
+{
+	struct cleancache_copy *copy;
+
+	while (cleancache_bytes > max_bytes && !list_empty(&cleancache_lru)) {
+		copy = list_first_entry(&cleancache_lru,
+					struct cleancache_copy, lru);
+		cleancache_drop_copy(copy);
+		cleancache_evicted++;
+	}
+}
+
+static void cleancache_drop_inode(struct cleancache_inode *inode)
+{
+	struct cleancache_copy *batch[16];
+	unsigned int n;
+	unsigned int i;
+
+	while (inode->nr_pages) {
+		n = radix_tree_gang_lookup(&inode->pages, (void **)batch, 0,
+					   ARRAY_SIZE(batch));
+		for (i = 0; i < n; i++) {
+			cleancache_unlink_copy(batch[i]);
+			kfree(batch[i]);
+		}
+	}
+	cleancache_release_inode(inode);
+}
+
+void cleancache_init_fs(struct super_block *sb)
+{
+	unsigned long flags;
+	int pool;
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+	pool = find_first_zero_bit(cleancache_pools_used,
+				   CLEANCACHE_MAX_POOLS);
+	if (pool < CLEANCACHE_MAX_POOLS) {
+		__set_bit(pool, cleancache_pools_used);
+		cleancache_pools[pool] = RB_ROOT;
+		sb->cleancache_poolid = pool;
+	}
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+}
+EXPORT_SYMBOL(cleancache_init_fs);
+
+void __cleancache_flush_fs(struct super_block *sb)
+{
+	int pool = sb->cleancache_poolid;
+	struct rb_node *node;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+	while ((node = rb_first(&cleancache_pools[pool])))
+		cleancache_drop_inode(rb_entry(node, struct cleancache_inode,
+					       node));
+	__clear_bit(pool, cleancache_pools_used);
+	sb->cleancache_poolid = -1;
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+}
+
+void __cleancache_put_page(struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	int pool = mapping->host->i_sb->cleancache_poolid;
+	unsigned long ino = mapping->host->i_ino;
+	struct cleancache_copy *copy = NULL;
+	struct cleancache_copy *old;
+	struct cleancache_inode *inode;
+	unsigned char *src;
+	unsigned char *dst;
+	unsigned long flags;
+	size_t len;
+	int cpu;
+	int ret;
+
+	if (!cleancache_max_bytes)
+		return;
+
+	cpu = get_cpu();
+	dst = per_cpu(cleancache_dst, cpu);
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, &len,
+			       per_cpu(cleancache_wrkmem, cpu));
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret == LZO_E_OK && len <= CLEANCACHE_MAX_LEN) {
+		copy = kmalloc(sizeof(*copy) + len,
+			       GFP_NOWAIT | __GFP_NOWARN | __GFP_NOMEMALLOC);
+		if (copy) {
+			memcpy(copy->data, dst, len);
+			copy->len = len;
+			copy->index = page->index;
+		}
+	}
+	put_cpu();
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+
+	/* Whatever happens, an older copy of this page is stale now */
+	inode = cleancache_find_inode(pool, ino);
+	if (inode) {
+		old = radix_tree_lookup(&inode->pages, page->index);
+		if (old)
+			cleancache_drop_copy(old);
+	}
+
+	if (!copy)
+		goto fail;
+
+	inode = cleancache_get_inode(pool, ino);
+	if (!inode)
+		goto fail;
+	if (radix_tree_insert(&inode->pages, copy->index, copy)) {
+		cleancache_release_inode(inode);
+		goto fail;
+	}
+
+	copy->inode = inode;
+	inode->nr_pages++;
+	list_add_tail(&copy->lru, &cleancache_lru);
+	cleancache_bytes += sizeof(*copy) + copy->len;
+	cleancache_nr_copies++;
+	cleancache_puts++;
+	cleancache_evict(cleancache_max_bytes);
+
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+	return;
+
+fail:
+	cleancache_failed_puts++;
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+	kfree(copy);
+}
+
+int __cleancache_get_page(struct address_space *mapping, struct page *page)
+{
+	int pool = mapping->host->i_sb->cleancache_poolid;
+	struct cleancache_copy *copy = NULL;
+	struct cleancache_inode *inode;
+	unsigned char *dst;
+	unsigned long flags;
+	size_t len = PAGE_SIZE;
+	int ret;
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+	inode = cleancache_find_inode(pool, mapping->host->i_ino);
+	if (inode)
+		copy = radix_tree_lookup(&inode->pages, page->index);
+	if (copy) {
+		cleancache_unlink_copy(copy);
+		cleancache_release_inode(inode);
+		cleancache_succ_gets++;
+	} else
+		cleancache_failed_gets++;
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+
+	if (!copy)
+		return -1;
+
+	dst = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_decompress_safe(copy->data, copy->len, dst, &len);
+	kunmap_atomic(dst, KM_USER0);
+	flush_dcache_page(page);
+	kfree(copy);
+
+	if (unlikely(ret != LZO_E_OK || len != PAGE_SIZE)) {
+		printk(KERN_WARNING "cleancache: bad copy of page %lu of "
+		       "inode %lu\n", page->index, mapping->host->i_ino);
+		return -1;
+	}
+	return 0;
+}
+
+void __cleancache_flush_inode(struct address_space *mapping)
+{
+	int pool = mapping->host->i_sb->cleancache_poolid;
+	struct cleancache_inode *inode;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+	inode = cleancache_find_inode(pool, mapping->host->i_ino);
+	if (inode) {
+		cleancache_drop_inode(inode);
+		cleancache_flushes++;
+	}
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+}
+
+static int cleancache_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct cleancache_copy *copy;
+	unsigned long flags;
+	int nr;
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+	while (nr_to_scan-- > 0 && !list_empty(&cleancache_lru)) {
+		copy = list_first_entry(&cleancache_lru,
+					struct cleancache_copy, lru);
+		cleancache_drop_copy(copy);
+		cleancache_evicted++;
+	}
+	nr = cleancache_nr_copies;
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+
+	return nr;
+}
+
+static struct shrinker cleancache_shrinker = {
+	.shrink = cleancache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+#ifdef CONFIG_SYSFS
+/*
+ * This all compiles without CONFIG_SYSFS, but is a waste of space.
+ */
+
+#define CLEANCACHE_ATTR_RO(_name) \
+	static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+#define CLEANCACHE_ATTR(_name) \
+	static struct kobj_attribute _name##_attr = \
+		__ATTR(_name, 0644, _name##_show, _name##_store)
+
+static ssize_t max_kbytes_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", cleancache_max_bytes >> 10);
+}
+
+static ssize_t max_kbytes_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long kbytes;
+	unsigned long flags;
+	int err;
+
+	err = strict_strtoul(buf, 10, &kbytes);
+	if (err || kbytes > ULONG_MAX >> 10)
+		return -EINVAL;
+
+	spin_lock_irqsave(&cleancache_lock, flags);
+	cleancache_max_bytes = kbytes << 10;
+	cleancache_evict(cleancache_max_bytes);
+	spin_unlock_irqrestore(&cleancache_lock, flags);
+
+	return count;
+}
+CLEANCACHE_ATTR(max_kbytes);
+
+#define CLEANCACHE_STAT(_name, _val)					\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			    struct kobj_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%lu\n", (_val));				\
+}									\
+CLEANCACHE_ATTR_RO(_name)
+
+CLEANCACHE_STAT(used_kbytes, cleancache_bytes >> 10);
+CLEANCACHE_STAT(stored_pages, cleancache_nr_copies);
+CLEANCACHE_STAT(puts, cleancache_puts);
+CLEANCACHE_STAT(failed_puts, cleancache_failed_puts);
+CLEANCACHE_STAT(succ_gets, cleancache_succ_gets);
+CLEANCACHE_STAT(failed_gets, cleancache_failed_gets);
+CLEANCACHE_STAT(flushes, cleancache_flushes);
+CLEANCACHE_STAT(evicted, cleancache_evicted);
+
+static struct attribute *cleancache_attrs[] = {
+	&max_kbytes_attr.attr,
+	&used_kbytes_attr.attr,
+	&stored_pages_attr.attr,
+	&puts_attr.attr,
+	&failed_puts_attr.attr,
+	&succ_gets_attr.attr,
+	&failed_gets_attr.attr,
+	&flushes_attr.attr,
+	&evicted_attr.attr,
+	NULL,
+};
+
+static struct attribute_group cleancache_attr_group = {
+	.attrs = cleancache_attrs,
+	.name = "cleancache",
+};
+#endif /* CONFIG_SYSFS */
+
+static int __init cleancache_init(void)
+{
+	void *wrkmem;
+	unsigned char *dst;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		wrkmem = kmalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		dst = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+		if (!wrkmem || !dst) {
+			kfree(wrkmem);
+			kfree(dst);
+			printk(KERN_ERR "cleancache: out of memory\n");
+			return -ENOMEM;
+		}
+		per_cpu(cleancache_wrkmem, cpu) = wrkmem;
+		per_cpu(cleancache_dst, cpu) = dst;
+	}
+
+	register_shrinker(&cleancache_shrinker);
+
+#ifdef CONFIG_SYSFS
+	if (sysfs_create_group(mm_kobj, &cleancache_attr_group))
+		printk(KERN_ERR "cleancache: register sysfs failed\n");
+#endif
+
+	/* Enables puts; a sixteenth of RAM holds two or three times that */
+	cleancache_max_bytes = (totalram_pages / 16) << PAGE_SHIFT;
+	return 0;
+}
+module_init(cleancache_init)
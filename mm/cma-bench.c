@@ -0,0 +1,131 @@
+/*
+ * mm/cma-bench.c
+ *
+ * Times cma_alloc() of a large contiguous buffer, first with the system as
+ * it is and then with 'pressure_mb' of tmpfs pages held, which fill free
+ * memory and spill into the contiguous memory regions that the claim has
+ * to migrate out again. The module does its work at load time, e.g.
+ *
+ *	insmod cma-bench.ko pages=2048 rounds=8 pressure_mb=200
+ *
+ * Keep pressure_mb below the free memory of the device, there is no swap
+ * to push the tmpfs pages out to.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/pagemap.h>
+#include <linux/cma.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+static unsigned long pages = 1024;
+module_param(pages, ulong, 0444);
+MODULE_PARM_DESC(pages, "pages per contiguous allocation");
+
+static unsigned int rounds = 8;
+module_param(rounds, uint, 0444);
+MODULE_PARM_DESC(rounds, "allocations timed per run");
+
+static unsigned int pressure_mb;
+module_param(pressure_mb, uint, 0444);
+MODULE_PARM_DESC(pressure_mb, "tmpfs memory to hold for the second run");
+
+static void cma_bench_run(const char *what)
+{
+	s64 us, min_us = 0, max_us = 0, total_us = 0;
+	unsigned int i, done = 0;
+	struct page *page;
+	ktime_t start;
+
+	for (i = 0; i < rounds; i++) {
+		start = ktime_get();
+		page = cma_alloc(pages, 0);
+		us = ktime_us_delta(ktime_get(), start);
+		if (!page)
+			continue;
+		cma_release(page, pages);
+
+		if (!done || us < min_us)
+			min_us = us;
+		if (us > max_us)
+			max_us = us;
+		total_us += us;
+		done++;
+		cond_resched();
+	}
+
+	if (!done) {
+		printk(KERN_INFO "cma_bench: %s: all %u allocations of %lu "
+		       "pages failed\n", what, rounds, pages);
+		return;
+	}
+	printk(KERN_INFO "cma_bench: %s: %lu pages, min %lld avg %llu "
+	       "max %lld us, %u of %u failed\n", what, pages, min_us,
+	       div_u64(total_us, done), max_us, rounds - done, rounds);
+}
+
+/* Returns the number of pages the tmpfs file 'file' could be filled with */
+static unsigned long cma_bench_fill(struct file *file, unsigned long nr)
+{
+	struct page *page;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		if (fatal_signal_pending(current))
+			break;
+		page = read_mapping_page(file->f_mapping, i, file);
+		if (IS_ERR(page))
+			break;
+		page_cache_release(page);
+		cond_resched();
+	}
+	return i;
+}
+
+static int __init cma_bench_init(void)
+{
+	unsigned long nr;
+	struct file *file;
+
+	if (!pages || !rounds)
+		return -EINVAL;
+
+	printk(KERN_INFO "cma_bench: %u rounds of %lu pages\n", rounds, pages);
+	cma_bench_run("idle");
+	if (!pressure_mb)
+		return 0;
+
+	file = shmem_file_setup("cma_bench", (loff_t)pressure_mb << 20,
+				VM_NORESERVE);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	nr = cma_bench_fill(file, (unsigned long)pressure_mb <<
+			    (20 - PAGE_SHIFT));
+	printk(KERN_INFO "cma_bench: holding %lu MiB of tmpfs pages\n",
+	       nr >> (20 - PAGE_SHIFT));
+	cma_bench_run("pressure");
+
+	fput(file);
+	return 0;
+}
+
+static void __exit cma_bench_exit(void)
+{
+}
+
+module_init(cma_bench_init);
+module_exit(cma_bench_exit);
+
+MODULE_LICENSE("GPL");
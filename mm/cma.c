@@ -0,0 +1,236 @@
+/*
+ * Contiguous memory regions the page allocator can borrow.
+ *
+ * Board code reserves a region from bootmem with cma_declare(); at boot
+ * it is handed to the buddy allocator as MIGRATE_CMA pageblocks. Only
+ * movable allocations fall back into those, so while no driver has
+ * claimed the memory it holds user and page cache pages, not dead RAM.
+ * cma_claim() and cma_alloc() isolate the pageblocks, migrate whatever
+ * was borrowed elsewhere and hand the pages to the driver as physically
+ * contiguous memory until cma_release().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/bootmem.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/hrtimer.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/cma.h>
+#include "internal.h"
+
+struct cma_region {
+	unsigned long	base_pfn;
+	unsigned long	count;		/* in pages */
+	unsigned long	*bitmap;	/* pages claimed by drivers */
+	struct mutex	lock;		/* serialises claims and releases */
+};
+
+static struct cma_region cma_regions[CMA_MAX_REGIONS];
+static int cma_nr_regions;
+
+/**
+ * cma_declare - reserve a contiguous memory region
+ * @base:	physical address, CMA_ALIGN aligned
+ * @size:	size in bytes, a multiple of CMA_ALIGN
+ *
+ * Must be called while bootmem is still up, from the machine's ->map_io().
+ * The region is lent to the page allocator once the core initcalls run.
+ */
+int __init cma_declare(unsigned long base, unsigned long size)
+{
+	struct cma_region *cma;
+
+	if (!size)
+		return 0;
+	if ((base | size) & (CMA_ALIGN - 1)) {
+		printk(KERN_ERR "cma: region %08lx+%lx is not %lu aligned\n",
+		       base, size, CMA_ALIGN);
+		return -EINVAL;
+	}
+	if (cma_nr_regions == CMA_MAX_REGIONS) {
+		printk(KERN_ERR "cma: too many regions\n");
+		return -ENOSPC;
+	}
+	if (reserve_bootmem(base, size, BOOTMEM_EXCLUSIVE)) {
+		printk(KERN_ERR "cma: region %08lx+%lx is in use\n",
+		       base, size);
+		return -EBUSY;
+	}
+
+	cma = &cma_regions[cma_nr_regions++];
+	cma->base_pfn = base >> PAGE_SHIFT;
+	cma->count = size >> PAGE_SHIFT;
+	printk(KERN_INFO "cma: reserved %lu MiB at %08lx\n", size >> 20, base);
+	return 0;
+}
+
+static int __init cma_init_regions(void)
+{
+	struct cma_region *cma;
+	unsigned long pfn, end;
+	int i;
+
+	for (i = 0; i < cma_nr_regions; i++) {
+		cma = &cma_regions[i];
+		end = cma->base_pfn + cma->count;
+
+		mutex_init(&cma->lock);
+		cma->bitmap = kzalloc(BITS_TO_LONGS(cma->count) * sizeof(long),
+				      GFP_KERNEL);
+		if (!cma->bitmap ||
+		    page_zone(pfn_to_page(cma->base_pfn)) !=
+		    page_zone(pfn_to_page(end - 1))) {
+			/* stays reserved, and cma_find() will not see it */
+			printk(KERN_ERR "cma: cannot use region at pfn %lx\n",
+			       cma->base_pfn);
+			cma->count = 0;
+			continue;
+		}
+
+		for (pfn = cma->base_pfn; pfn < end; pfn += pageblock_nr_pages)
+			init_cma_reserved_pageblock(pfn_to_page(pfn));
+	}
+	return 0;
+}
+core_initcall(cma_init_regions);
+
+static struct cma_region *cma_find(unsigned long pfn, unsigned long count)
+{
+	struct cma_region *cma;
+	int i;
+
+	for (i = 0; i < cma_nr_regions; i++) {
+		cma = &cma_regions[i];
+		if (pfn >= cma->base_pfn &&
+		    pfn + count <= cma->base_pfn + cma->count)
+			return cma;
+	}
+	return NULL;
+}
+
+/* Called with cma->lock held, the range must not be claimed yet */
+static int __cma_claim(struct cma_region *cma, unsigned long pfn,
+		       unsigned long count)
+{
+	unsigned long i, first = pfn - cma->base_pfn;
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = alloc_contig_range(pfn, pfn + count, MIGRATE_CMA);
+	pr_debug("cma: claiming %lu pages at pfn %lx took %lld us (%d)\n",
+		 count, pfn,
+		 (long long)ktime_to_us(ktime_sub(ktime_get(), start)), ret);
+	if (ret)
+		return ret;
+
+	for (i = first; i < first + count; i++)
+		__set_bit(i, cma->bitmap);
+	return 0;
+}
+
+/**
+ * cma_claim - claim a fixed range of a contiguous memory region
+ * @page:	first page of the range
+ * @count:	number of pages
+ *
+ * Migrates whatever the page allocator placed in the range elsewhere.
+ * Sleeps, for a good while when memory is tight. Returns 0 when the range
+ * belongs to the caller, -EBUSY if part of it is claimed already or some
+ * page would not move.
+ */
+int cma_claim(struct page *page, unsigned long count)
+{
+	unsigned long pfn = page_to_pfn(page);
+	struct cma_region *cma = cma_find(pfn, count);
+	unsigned long first, end;
+	int ret;
+
+	if (!cma || !count)
+		return -EINVAL;
+
+	first = pfn - cma->base_pfn;
+	end = first + count;
+	mutex_lock(&cma->lock);
+	if (find_next_bit(cma->bitmap, end, first) < end)
+		ret = -EBUSY;
+	else
+		ret = __cma_claim(cma, pfn, count);
+	mutex_unlock(&cma->lock);
+	return ret;
+}
+EXPORT_SYMBOL(cma_claim);
+
+/**
+ * cma_alloc - allocate from any contiguous memory region
+ * @count:	number of pages
+ * @order:	the first page is aligned to 1 << order pages
+ *
+ * Like cma_claim(), but takes the first unclaimed range that can be
+ * vacated. Returns its first page, or NULL.
+ */
+struct page *cma_alloc(unsigned long count, unsigned int order)
+{
+	unsigned long mask = (1UL << order) - 1;
+	unsigned long start, next;
+	struct cma_region *cma;
+	int i, ret = -EBUSY;
+
+	if (!count)
+		return NULL;
+
+	for (i = 0; i < cma_nr_regions && ret == -EBUSY; i++) {
+		cma = &cma_regions[i];
+		mutex_lock(&cma->lock);
+		start = 0;
+		for (;;) {
+			start = ((cma->base_pfn + start + mask) & ~mask) -
+				cma->base_pfn;
+			if (start + count > cma->count)
+				break;
+			next = find_next_bit(cma->bitmap, start + count, start);
+			if (next < start + count) {
+				start = next + 1;
+				continue;
+			}
+			ret = __cma_claim(cma, cma->base_pfn + start, count);
+			if (ret != -EBUSY)
+				break;
+			/* something in there would not move, look further on */
+			start += mask + 1;
+		}
+		mutex_unlock(&cma->lock);
+		if (!ret)
+			return pfn_to_page(cma->base_pfn + start);
+	}
+	return NULL;
+}
+EXPORT_SYMBOL(cma_alloc);
+
+/**
+ * cma_release - give claimed pages back to the page allocator
+ * @page:	first page, as passed to cma_claim() or from cma_alloc()
+ * @count:	number of pages
+ */
+void cma_release(struct page *page, unsigned long count)
+{
+	unsigned long pfn = page_to_pfn(page);
+	struct cma_region *cma = cma_find(pfn, count);
+	unsigned long i, first;
+
+	if (WARN_ON(!cma))
+		return;
+
+	first = pfn - cma->base_pfn;
+	mutex_lock(&cma->lock);
+	free_contig_range(pfn, count);
+	for (i = first; i < first + count; i++)
+		__clear_bit(i, cma->bitmap);
+	mutex_unlock(&cma->lock);
+}
+EXPORT_SYMBOL(cma_release);
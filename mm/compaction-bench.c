@@ -0,0 +1,185 @@
+/*
+ * mm/compaction-bench.c
+ *
+ * Measures how many high-order allocations succeed after memory has been
+ * fragmented. 'fill_mb' of tmpfs pages are allocated into two files in
+ * turn and one of the files is then dropped, leaving free memory in single
+ * pages between pages still in use. Up to 'attempts' blocks of 'order' are
+ * then allocated and held:
+ *
+ *	fragmented:	without waiting, i.e. from the free lists as they are
+ *	compacted:	the same, after writing /proc/sys/vm/compact_memory
+ *	direct:		after fragmenting again, with GFP_KERNEL, so that
+ *			__alloc_pages_slowpath() compacts on demand
+ *
+ * The number of successes of each run is printed together with the change
+ * in the compact_* vmstat counters. The module does its work at load time,
+ * e.g.
+ *
+ *	insmod compaction-bench.ko fill_mb=200 order=3 attempts=256
+ *
+ * Keep fill_mb below the free memory of the device, there is no swap to
+ * push the tmpfs pages out to.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/err.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/vmstat.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+
+static unsigned int fill_mb = 64;
+module_param(fill_mb, uint, 0444);
+MODULE_PARM_DESC(fill_mb, "tmpfs memory to fragment free memory with");
+
+static unsigned int order = 3;
+module_param(order, uint, 0444);
+MODULE_PARM_DESC(order, "order of the allocations");
+
+static unsigned int attempts = 256;
+module_param(attempts, uint, 0444);
+MODULE_PARM_DESC(attempts, "allocations tried per run");
+
+static unsigned long before[NR_VM_EVENT_ITEMS], after[NR_VM_EVENT_ITEMS];
+
+/*
+ * Fills two tmpfs files a page at a time in turn and drops the second, so
+ * that every other page allocated is freed again. Returns the first file.
+ */
+static struct file *compaction_bench_fragment(void)
+{
+	unsigned long i, nr = (unsigned long)fill_mb << (20 - PAGE_SHIFT);
+	loff_t size = (loff_t)fill_mb << 19;
+	struct file *file[2];
+	struct page *page;
+
+	file[0] = shmem_file_setup("compaction_bench", size, VM_NORESERVE);
+	if (IS_ERR(file[0]))
+		return file[0];
+	file[1] = shmem_file_setup("compaction_bench", size, VM_NORESERVE);
+	if (IS_ERR(file[1])) {
+		fput(file[0]);
+		return file[1];
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (fatal_signal_pending(current))
+			break;
+		page = read_mapping_page(file[i & 1]->f_mapping, i >> 1,
+					 file[i & 1]);
+		if (IS_ERR(page))
+			break;
+		page_cache_release(page);
+		cond_resched();
+	}
+	fput(file[1]);
+
+	printk(KERN_INFO "compaction_bench: holding %lu MiB of tmpfs pages "
+	       "between as many free ones\n", (i / 2) >> (20 - PAGE_SHIFT));
+	return file[0];
+}
+
+static void compaction_bench_run(const char *what, gfp_t gfp_mask,
+				 struct page **pages)
+{
+	unsigned int i, done = 0;
+
+	all_vm_events(before);
+	for (i = 0; i < attempts; i++) {
+		pages[done] = alloc_pages(gfp_mask | __GFP_NOWARN, order);
+		if (pages[done])
+			done++;
+		cond_resched();
+	}
+	all_vm_events(after);
+
+	printk(KERN_INFO "compaction_bench: %s: %u of %u order-%u "
+	       "allocations, compact_stall %lu fail %lu success %lu, "
+	       "pages moved %lu failed %lu\n", what, done, attempts, order,
+	       after[COMPACTSTALL] - before[COMPACTSTALL],
+	       after[COMPACTFAIL] - before[COMPACTFAIL],
+	       after[COMPACTSUCCESS] - before[COMPACTSUCCESS],
+	       after[COMPACTPAGES] - before[COMPACTPAGES],
+	       after[COMPACTPAGEFAILED] - before[COMPACTPAGEFAILED]);
+
+	while (done--)
+		__free_pages(pages[done], order);
+}
+
+/* Compacts all memory through the sysctl, like a write from userspace */
+static int compaction_bench_compact(void)
+{
+	mm_segment_t old_fs = get_fs();
+	struct file *file;
+	loff_t pos = 0;
+	ssize_t n;
+
+	file = filp_open("/proc/sys/vm/compact_memory", O_WRONLY, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	set_fs(KERNEL_DS);
+	n = vfs_write(file, (char __user *)"1", 1, &pos);
+	set_fs(old_fs);
+	filp_close(file, NULL);
+	return n < 0 ? n : 0;
+}
+
+static int __init compaction_bench_init(void)
+{
+	struct page **pages;
+	struct file *file;
+	int err;
+
+	if (!fill_mb || !attempts || order >= MAX_ORDER)
+		return -EINVAL;
+
+	pages = kcalloc(attempts, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	file = compaction_bench_fragment();
+	err = PTR_ERR(file);
+	if (IS_ERR(file))
+		goto out;
+	compaction_bench_run("fragmented", GFP_NOWAIT, pages);
+	err = compaction_bench_compact();
+	if (!err)
+		compaction_bench_run("compacted", GFP_NOWAIT, pages);
+	fput(file);
+	if (err)
+		goto out;
+
+	file = compaction_bench_fragment();
+	err = PTR_ERR(file);
+	if (IS_ERR(file))
+		goto out;
+	compaction_bench_run("direct", GFP_KERNEL | __GFP_NORETRY, pages);
+	fput(file);
+	err = 0;
+out:
+	if (err)
+		printk(KERN_ERR "compaction_bench: failed, %d\n", err);
+	kfree(pages);
+	return err;
+}
+
+static void __exit compaction_bench_exit(void)
+{
+}
+
+module_init(compaction_bench_init);
+module_exit(compaction_bench_exit);
+
+MODULE_LICENSE("GPL");
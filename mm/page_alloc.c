@@ -45,6 +45,9 @@
 #include <linux/backing-dev.h>
 #include <linux/fault-inject.h>
 #include <linux/page-isolation.h>
+#include <linux/migrate.h>
+#include <linux/compaction.h>
+#include <linux/mm_inline.h>
 #include <linux/page_cgroup.h>
 #include <linux/debugobjects.h>
 #include <linux/kmemleak.h>
@@ -124,6 +127,18 @@ static char * const zone_names[MAX_NR_ZONES] = {
 int min_free_kbytes = 1024;
 int min_free_order_shift = 1;
 
+/*
+ * Extra memory for the system to try freeing between the min and low
+ * watermarks, so that kswapd starts early enough for bursts of
+ * allocations not to end up in direct reclaim. The low to high distance
+ * is at least watermark_scale_factor / 10000 of each zone, and kswapd
+ * keeps up to watermark_boost_factor / 10000 of the high watermark more
+ * free for a while after a fragmentation event.
+ */
+int extra_free_kbytes;
+int watermark_scale_factor = 10;
+int watermark_boost_factor = 15000;
+
 static unsigned long __meminitdata nr_kernel_pages;
 static unsigned long __meminitdata nr_all_pages;
 static unsigned long __meminitdata dma_reserve;
@@ -745,13 +760,19 @@ struct page *__rmqueue_smallest(struct zone *zone, unsigned int order,
 
 /*
  * This array describes the order lists are fallen back to when
- * the free lists for the desirable migrate type are depleted
+ * the free lists for the desirable migrate type are depleted.
+ * Each row ends with MIGRATE_RESERVE.
  */
-static int fallbacks[MIGRATE_TYPES][MIGRATE_TYPES-1] = {
+static int fallbacks[MIGRATE_TYPES][4] = {
 	[MIGRATE_UNMOVABLE]   = { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE,   MIGRATE_RESERVE },
 	[MIGRATE_RECLAIMABLE] = { MIGRATE_UNMOVABLE,   MIGRATE_MOVABLE,   MIGRATE_RESERVE },
+#ifdef CONFIG_CMA
+	[MIGRATE_MOVABLE]     = { MIGRATE_CMA,         MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE },
+	[MIGRATE_CMA]         = { MIGRATE_RESERVE }, /* Never used */
+#else
 	[MIGRATE_MOVABLE]     = { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE },
-	[MIGRATE_RESERVE]     = { MIGRATE_RESERVE,     MIGRATE_RESERVE,   MIGRATE_RESERVE }, /* Never used */
+#endif
+	[MIGRATE_RESERVE]     = { MIGRATE_RESERVE }, /* Never used */
 };
 
 /*
@@ -835,6 +856,29 @@ static void change_pageblock_range(struct page *pageblock_page,
 	}
 }
 
+/*
+ * An allocation fell back to a pageblock of another migratetype. Have
+ * kswapd free a pageblock's worth of pages more than usual, so that free
+ * pages merge back into whole pageblocks before the next fallback has to
+ * mix types again. Called with the zone->lock held, buffered_rmqueue()
+ * wakes kswapd once the lock is dropped.
+ */
+static inline void boost_watermark(struct zone *zone)
+{
+	unsigned long max_boost;
+
+	if (!watermark_boost_factor)
+		return;
+
+	max_boost = div_u64((u64)high_wmark_pages(zone) *
+			    watermark_boost_factor, 10000);
+	max_boost = max(pageblock_nr_pages, max_boost);
+	zone->watermark_boost = min(zone->watermark_boost + pageblock_nr_pages,
+				    max_boost);
+	zone_set_flag(zone, ZONE_BOOSTED_WATERMARK);
+	__count_vm_event(WATERMARK_BOOST);
+}
+
 /* Remove an element from the buddy allocator from the fallback list */
 static inline struct page *
 __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
@@ -847,12 +891,12 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 	/* Find the largest possible block of pages in the other list */
 	for (current_order = MAX_ORDER-1; current_order >= order;
 						--current_order) {
-		for (i = 0; i < MIGRATE_TYPES - 1; i++) {
+		for (i = 0; ; i++) {
 			migratetype = fallbacks[start_migratetype][i];
 
 			/* MIGRATE_RESERVE handled later if necessary */
 			if (migratetype == MIGRATE_RESERVE)
-				continue;
+				break;
 
 			area = &(zone->free_area[current_order]);
 			if (list_empty(&area->free_list[migratetype]))
@@ -862,15 +906,24 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 					struct page, lru);
 			area->nr_free--;
 
+			/* Borrowing from MIGRATE_CMA does not fragment */
+			if (current_order < pageblock_order &&
+			    !is_migrate_cma(migratetype) &&
+			    !page_group_by_mobility_disabled)
+				boost_watermark(zone);
+
 			/*
 			 * If breaking a large block of pages, move all free
 			 * pages to the preferred allocation list. If falling
 			 * back for a reclaimable kernel allocation, be more
-			 * agressive about taking ownership of free pages
+			 * agressive about taking ownership of free pages.
+			 * Never take ownership of MIGRATE_CMA pageblocks,
+			 * they must only ever hold movable pages.
 			 */
-			if (unlikely(current_order >= (pageblock_order >> 1)) ||
+			if (!is_migrate_cma(migratetype) &&
+			    (unlikely(current_order >= pageblock_order / 2) ||
 					start_migratetype == MIGRATE_RECLAIMABLE ||
-					page_group_by_mobility_disabled) {
+					page_group_by_mobility_disabled)) {
 				unsigned long pages;
 				pages = move_freepages_block(zone, page,
 								start_migratetype);
@@ -889,7 +942,8 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 			rmv_page_order(page);
 
 			/* Take ownership for orders >= pageblock_order */
-			if (current_order >= pageblock_order)
+			if (current_order >= pageblock_order &&
+			    !is_migrate_cma(migratetype))
 				change_pageblock_range(page, current_order,
 							start_migratetype);
 
@@ -965,7 +1019,16 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
 			list_add(&page->lru, list);
 		else
 			list_add_tail(&page->lru, list);
-		set_page_private(page, migratetype);
+#ifdef CONFIG_CMA
+		/*
+		 * Pages borrowed from a MIGRATE_CMA pageblock must go back
+		 * to its free list if the pcp list is drained unused.
+		 */
+		if (is_migrate_cma(get_pageblock_migratetype(page)))
+			set_page_private(page, MIGRATE_CMA);
+		else
+#endif
+			set_page_private(page, migratetype);
 		list = &page->lru;
 	}
 	__mod_zone_page_state(zone, NR_FREE_PAGES, -(i << order));
@@ -1173,6 +1236,53 @@ void split_page(struct page *page, unsigned int order)
 		set_page_refcounted(page + i);
 }
 
+/*
+ * Similar to split_page except the page is already free. As this is only
+ * being used for migration, the migratetype of the block also changes.
+ * As this is called with interrupts disabled, the caller is responsible
+ * for calling arch_alloc_page() and kernel_map_page() after interrupts
+ * are enabled.
+ *
+ * Note: this is probably too low level an operation for use in drivers.
+ * Please consult with lkml before using this in your driver.
+ */
+int split_free_page(struct page *page)
+{
+	unsigned int order;
+	unsigned long watermark;
+	struct zone *zone;
+
+	BUG_ON(!PageBuddy(page));
+
+	zone = page_zone(page);
+	order = page_order(page);
+
+	/* Obey watermarks as if the page was being allocated */
+	watermark = low_wmark_pages(zone) + (1 << order);
+	if (!zone_watermark_ok(zone, 0, watermark, 0, 0))
+		return 0;
+
+	/* Remove page from free list */
+	list_del(&page->lru);
+	zone->free_area[order].nr_free--;
+	rmv_page_order(page);
+	__mod_zone_page_state(zone, NR_FREE_PAGES, -(1UL << order));
+
+	/* Split into individual pages */
+	set_page_refcounted(page);
+	split_page(page, order);
+
+	/* MIGRATE_CMA pageblocks keep their type, see __rmqueue_fallback() */
+	if (order >= pageblock_order - 1 &&
+	    !is_migrate_cma(get_pageblock_migratetype(page))) {
+		struct page *endpage = page + (1 << order) - 1;
+		for (; page < endpage; page += pageblock_nr_pages)
+			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+	}
+
+	return 1 << order;
+}
+
 /*
  * Really, prep_compound_page() should be called from __rmqueue_bulk().  But
  * we cheat by calling it from here, in the order > 0 path.  Saves a branch
@@ -1239,6 +1349,9 @@ again:
 	local_irq_restore(flags);
 	put_cpu();
 
+	if (unlikely(zone_test_and_clear_flag(zone, ZONE_BOOSTED_WATERMARK)))
+		wakeup_kswapd(zone, 0);
+
 	VM_BUG_ON(bad_range(zone, page));
 	if (prep_new_page(page, order, gfp_flags))
 		goto again;
@@ -1673,6 +1786,63 @@ out:
 	return page;
 }
 
+#ifdef CONFIG_COMPACTION
+/* Try memory compaction for high-order allocations before reclaim */
+static struct page *
+__alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
+	struct zonelist *zonelist, enum zone_type high_zoneidx,
+	nodemask_t *nodemask, int alloc_flags, struct zone *preferred_zone,
+	int migratetype)
+{
+	struct page *page;
+	struct task_struct *p = current;
+	unsigned long compact_result;
+
+	if (!order || compaction_deferred(preferred_zone))
+		return NULL;
+
+	p->flags |= PF_MEMALLOC;
+	compact_result = try_to_compact_pages(zonelist, order, gfp_mask,
+						nodemask);
+	p->flags &= ~PF_MEMALLOC;
+	if (compact_result == COMPACT_SKIPPED)
+		return NULL;
+
+	/* Page migration frees to the PCP lists but we want merging */
+	drain_pages(get_cpu());
+	put_cpu();
+
+	page = get_page_from_freelist(gfp_mask, nodemask,
+			order, zonelist, high_zoneidx,
+			alloc_flags, preferred_zone,
+			migratetype);
+	if (page) {
+		compaction_succeeded(preferred_zone);
+		count_vm_event(COMPACTSUCCESS);
+		return page;
+	}
+
+	/*
+	 * It's bad if compaction run occurs and fails. The most likely
+	 * reason is that pages exist, but not enough to satisfy watermarks.
+	 */
+	count_vm_event(COMPACTFAIL);
+	defer_compaction(preferred_zone);
+
+	cond_resched();
+	return NULL;
+}
+#else
+static inline struct page *
+__alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
+	struct zonelist *zonelist, enum zone_type high_zoneidx,
+	nodemask_t *nodemask, int alloc_flags, struct zone *preferred_zone,
+	int migratetype)
+{
+	return NULL;
+}
+#endif /* CONFIG_COMPACTION */
+
 /* The really slow allocator path where we enter direct reclaim */
 static inline struct page *
 __alloc_pages_direct_reclaim(gfp_t gfp_mask, unsigned int order,
@@ -1871,6 +2041,15 @@ rebalance:
 	if (test_thread_flag(TIF_MEMDIE) && !(gfp_mask & __GFP_NOFAIL))
 		goto nopage;
 
+	/* Try direct compaction */
+	page = __alloc_pages_direct_compact(gfp_mask, order,
+					zonelist, high_zoneidx,
+					nodemask,
+					alloc_flags, preferred_zone,
+					migratetype);
+	if (page)
+		goto got_pg;
+
 	/* Try direct reclaim and then allocating */
 	page = __alloc_pages_direct_reclaim(gfp_mask, order,
 					zonelist, high_zoneidx,
@@ -4609,7 +4788,8 @@ static void setup_per_zone_lowmem_reserve(void)
 void setup_per_zone_wmarks(void)
 {
 	unsigned long pages_min = min_free_kbytes >> (PAGE_SHIFT - 10);
-	unsigned long lowmem_pages = 0;
+	unsigned long pages_low = extra_free_kbytes >> (PAGE_SHIFT - 10);
+	unsigned long lowmem_pages = 0, total_pages = 0;
 	struct zone *zone;
 	unsigned long flags;
 
@@ -4617,14 +4797,17 @@ void setup_per_zone_wmarks(void)
 	for_each_zone(zone) {
 		if (!is_highmem(zone))
 			lowmem_pages += zone->present_pages;
+		total_pages += zone->present_pages;
 	}
 
 	for_each_zone(zone) {
-		u64 tmp;
+		u64 tmp, low, gap;
 
 		spin_lock_irqsave(&zone->lock, flags);
 		tmp = (u64)pages_min * zone->present_pages;
 		do_div(tmp, lowmem_pages);
+		low = (u64)pages_low * zone->present_pages;
+		do_div(low, total_pages);
 		if (is_highmem(zone)) {
 			/*
 			 * __GFP_HIGH and PF_MEMALLOC allocations usually don't
@@ -4651,8 +4834,18 @@ void setup_per_zone_wmarks(void)
 			zone->watermark[WMARK_MIN] = tmp;
 		}
 
-		zone->watermark[WMARK_LOW]  = min_wmark_pages(zone) + (tmp >> 2);
-		zone->watermark[WMARK_HIGH] = min_wmark_pages(zone) + (tmp >> 1);
+		/*
+		 * The low to high distance paces kswapd. Scale it with the
+		 * zone, but keep the old quarter of min on small systems.
+		 */
+		gap = (u64)zone->present_pages * watermark_scale_factor;
+		do_div(gap, 10000);
+		gap = max(gap, tmp >> 2);
+
+		zone->watermark[WMARK_LOW]  = min_wmark_pages(zone) + low + gap;
+		zone->watermark[WMARK_HIGH] = min_wmark_pages(zone) + low +
+					      gap * 2;
+		zone->watermark_boost = 0;
 		setup_zone_migrate_reserve(zone);
 		spin_unlock_irqrestore(&zone->lock, flags);
 	}
@@ -4760,6 +4953,23 @@ int min_free_kbytes_sysctl_handler(ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * watermark_sysctl_handler - like min_free_kbytes_sysctl_handler(), for
+ *	the watermark tunables that have bounds.
+ */
+int watermark_sysctl_handler(ctl_table *table, int write,
+	void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int rc;
+
+	rc = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (rc)
+		return rc;
+	if (write)
+		setup_per_zone_wmarks();
+	return 0;
+}
+
 #ifdef CONFIG_NUMA
 int sysctl_min_unmapped_ratio_sysctl_handler(ctl_table *table, int write,
 	void __user *buffer, size_t *length, loff_t *ppos)
@@ -5042,6 +5252,7 @@ int set_migratetype_isolate(struct page *page)
 	 * In future, more migrate types will be able to be isolation target.
 	 */
 	if (get_pageblock_migratetype(page) != MIGRATE_MOVABLE &&
+	    !is_migrate_cma(get_pageblock_migratetype(page)) &&
 	    zone_idx != ZONE_MOVABLE)
 		goto out;
 	set_pageblock_migratetype(page, MIGRATE_ISOLATE);
@@ -5054,7 +5265,7 @@ out:
 	return ret;
 }
 
-void unset_migratetype_isolate(struct page *page)
+void unset_migratetype_isolate(struct page *page, int migratetype)
 {
 	struct zone *zone;
 	unsigned long flags;
@@ -5062,12 +5273,220 @@ void unset_migratetype_isolate(struct page *page)
 	spin_lock_irqsave(&zone->lock, flags);
 	if (get_pageblock_migratetype(page) != MIGRATE_ISOLATE)
 		goto out;
-	set_pageblock_migratetype(page, MIGRATE_MOVABLE);
-	move_freepages_block(zone, page, MIGRATE_MOVABLE);
+	set_pageblock_migratetype(page, migratetype);
+	move_freepages_block(zone, page, migratetype);
 out:
 	spin_unlock_irqrestore(&zone->lock, flags);
 }
 
+#ifdef CONFIG_CMA
+/*
+ * Hand a pageblock reserved from bootmem to the buddy allocator as a
+ * MIGRATE_CMA pageblock.
+ */
+void __init init_cma_reserved_pageblock(struct page *page)
+{
+	unsigned long i;
+
+	for (i = 0; i < pageblock_nr_pages; i++) {
+		__ClearPageReserved(page + i);
+		set_page_count(page + i, 0);
+	}
+	set_page_refcounted(page);
+	set_pageblock_migratetype(page, MIGRATE_CMA);
+	__free_pages(page, pageblock_order);
+	totalram_pages += pageblock_nr_pages;
+}
+
+static unsigned long pfn_max_align_down(unsigned long pfn)
+{
+	return pfn & ~(max_t(unsigned long, MAX_ORDER_NR_PAGES,
+			     pageblock_nr_pages) - 1);
+}
+
+static unsigned long pfn_max_align_up(unsigned long pfn)
+{
+	return ALIGN(pfn, max_t(unsigned long, MAX_ORDER_NR_PAGES,
+				pageblock_nr_pages));
+}
+
+static struct page *
+contig_migrate_alloc(struct page *page, unsigned long private, int **x)
+{
+	return alloc_page(GFP_HIGHUSER_MOVABLE);
+}
+
+#define NR_CONTIG_MIGRATE_AT_ONCE	(256)
+#define NR_CONTIG_MIGRATE_PASSES	(5)
+
+/*
+ * Migrate the LRU pages in [start, end) elsewhere, a batch at a time.
+ * Pages that cannot be isolated or fail to migrate are left behind for
+ * the caller to find with test_pages_isolated().
+ *
+ * Nothing pins the pages we scan, so like isolate_migratepages() we only
+ * look at them under zone->lru_lock, and at most a pageblock per hold.
+ */
+static int
+__alloc_contig_migrate_range(unsigned long start, unsigned long end)
+{
+	struct zone *zone = page_zone(pfn_to_page(start));
+	unsigned long pfn = start, block_end;
+	struct page *page;
+	int nr, ret;
+	LIST_HEAD(source);
+
+	while (pfn < end) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+
+		block_end = min(end, ALIGN(pfn + 1, pageblock_nr_pages));
+		spin_lock_irq(&zone->lru_lock);
+		for (nr = 0; pfn < block_end && nr < NR_CONTIG_MIGRATE_AT_ONCE;
+		     pfn++) {
+			page = pfn_to_page(pfn);
+			if (__isolate_lru_page(page, ISOLATE_BOTH, 0) != 0)
+				continue;
+			del_page_from_lru_list(zone, page, page_lru(page));
+			list_add_tail(&page->lru, &source);
+			nr++;
+		}
+		spin_unlock_irq(&zone->lru_lock);
+		if (list_empty(&source))
+			continue;
+		/* this function returns # of failed pages */
+		ret = migrate_pages(&source, contig_migrate_alloc, 0);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Take the free pages covering [start, end) off the free lists and split
+ * them into order-0 pages with a reference count of one. start must be
+ * the head of a free page. Returns the pfn past the last page taken,
+ * which lies beyond end if the last free page straddles it, or 0 if a
+ * page in the range turned out not to be free.
+ */
+static unsigned long
+take_isolated_free_range(unsigned long start, unsigned long end)
+{
+	struct zone *zone = page_zone(pfn_to_page(start));
+	unsigned long pfn = start;
+	unsigned long flags;
+	struct page *page;
+	int order;
+
+	spin_lock_irqsave(&zone->lock, flags);
+	while (pfn < end) {
+		page = pfn_to_page(pfn);
+		if (!PageBuddy(page))
+			break;
+		order = page_order(page);
+		list_del(&page->lru);
+		rmv_page_order(page);
+		zone->free_area[order].nr_free--;
+		__mod_zone_page_state(zone, NR_FREE_PAGES, -(1UL << order));
+		set_page_refcounted(page);
+		split_page(page, order);
+		pfn += 1UL << order;
+	}
+	spin_unlock_irqrestore(&zone->lock, flags);
+
+	if (pfn < end) {
+		free_contig_range(start, pfn - start);
+		return 0;
+	}
+	return pfn;
+}
+
+/**
+ * alloc_contig_range() -- allocate a given range of pages
+ * @start:	first pfn of the range
+ * @end:	pfn past the end of the range
+ * @migratetype: type of the pageblocks of the range, MIGRATE_MOVABLE
+ *		or MIGRATE_CMA
+ *
+ * The range need not be pageblock aligned but must lie within a single
+ * zone without holes, and nobody else may be isolating the pageblocks
+ * around it at the same time. The pageblocks are isolated, the pages in
+ * use are migrated away, and the then free pages are taken off the free
+ * lists. This sleeps and may take a while under memory pressure.
+ *
+ * Returns 0 with every page of the range allocated with a reference
+ * count of one, free them with free_contig_range(); -EBUSY if some page
+ * could not be moved, or another error.
+ */
+int alloc_contig_range(unsigned long start, unsigned long end,
+		       int migratetype)
+{
+	unsigned long outer_start, outer_end;
+	struct page *page;
+	int pass, order, ret;
+
+	ret = start_isolate_page_range(pfn_max_align_down(start),
+				       pfn_max_align_up(end), migratetype);
+	if (ret)
+		return ret;
+
+	for (pass = 0; ; pass++) {
+		ret = __alloc_contig_migrate_range(start, end);
+		if (ret)
+			goto out;
+
+		/* drain all zone's lru pagevec and pcp pages */
+		lru_add_drain_all();
+		drain_all_pages();
+
+		/*
+		 * The first page may be the tail of a larger free page,
+		 * the check and the take below must start at its head.
+		 */
+		outer_start = start;
+		for (order = 0; order < MAX_ORDER; order++) {
+			page = pfn_to_page(outer_start & (~0UL << order));
+			if (PageBuddy(page) &&
+			    page_to_pfn(page) + (1UL << page_order(page)) >
+			    start) {
+				outer_start = page_to_pfn(page);
+				break;
+			}
+		}
+
+		if (!test_pages_isolated(outer_start, end))
+			break;
+		if (pass + 1 == NR_CONTIG_MIGRATE_PASSES) {
+			ret = -EBUSY;
+			goto out;
+		}
+		yield();
+	}
+
+	outer_end = take_isolated_free_range(outer_start, end);
+	if (!outer_end) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	/* give back what the outer free pages had beyond the range */
+	if (outer_start != start)
+		free_contig_range(outer_start, start - outer_start);
+	if (outer_end != end)
+		free_contig_range(end, outer_end - end);
+out:
+	undo_isolate_page_range(pfn_max_align_down(start),
+				pfn_max_align_up(end), migratetype);
+	return ret;
+}
+
+void free_contig_range(unsigned long pfn, unsigned long nr_pages)
+{
+	for (; nr_pages--; pfn++)
+		__free_page(pfn_to_page(pfn));
+}
+#endif /* CONFIG_CMA */
+
 #ifdef CONFIG_MEMORY_HOTREMOVE
 /*
  * All pages in the range must be isolated before calling this.
@@ -16,6 +16,7 @@
 #include <linux/task_io_accounting_ops.h>
 #include <linux/pagevec.h>
 #include <linux/pagemap.h>
+#include <linux/cleancache.h>
 
 /*
  * Initialise a struct file's readahead state.  Assumes that the caller has
@@ -108,9 +109,27 @@ EXPORT_SYMBOL(read_cache_pages);
 static int read_pages(struct address_space *mapping, struct file *filp,
 		struct list_head *pages, unsigned nr_pages)
 {
+	struct page *page, *next;
 	unsigned page_idx;
 	int ret;
 
+	/* Pages with a copy in cleancache need no I/O */
+	list_for_each_entry_safe(page, next, pages, lru) {
+		if (cleancache_get_page(mapping, page))
+			continue;
+		list_del(&page->lru);
+		nr_pages--;
+		if (!add_to_page_cache_lru(page, mapping,
+					page->index, GFP_KERNEL)) {
+			SetPageUptodate(page);
+			unlock_page(page);
+		}
+		page_cache_release(page);
+	}
+	ret = 0;
+	if (list_empty(pages))
+		goto out;
+
 	if (mapping->a_ops->readpages) {
 		ret = mapping->a_ops->readpages(filp, mapping, pages, nr_pages);
 		/* Clean up the remaining pages */
@@ -119,7 +138,7 @@ static int read_pages(struct address_space *mapping, struct file *filp,
 	}
 
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
-		struct page *page = list_to_page(pages);
+		page = list_to_page(pages);
 		list_del(&page->lru);
 		if (!add_to_page_cache_lru(page, mapping,
 					page->index, GFP_KERNEL)) {
@@ -0,0 +1,154 @@
+/*
+ * mm/slab-bench.c
+ *
+ * Times kmem_cache_alloc()/kmem_cache_free() against their _bulk
+ * variants for a range of object sizes and prints the cost per object.
+ * The module does its work at load time, e.g.
+ *
+ *	insmod slab-bench.ko loops=10000 batch=16
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#define MAX_BATCH	256
+
+static unsigned int loops = 10000;
+module_param(loops, uint, 0444);
+MODULE_PARM_DESC(loops, "rounds per object size");
+
+static unsigned int batch = 16;
+module_param(batch, uint, 0444);
+MODULE_PARM_DESC(batch, "objects allocated and freed per round");
+
+static const unsigned int bench_sizes[] = {
+	32, 64, 128, 256, 512, 1024, 2048,
+};
+
+struct bench_result {
+	s64 alloc_ns;
+	s64 free_ns;
+};
+
+static int bench_single(struct kmem_cache *cachep, void **objs,
+			struct bench_result *res)
+{
+	unsigned int i, j;
+	ktime_t start;
+
+	for (i = 0; i < loops; i++) {
+		start = ktime_get();
+		for (j = 0; j < batch; j++) {
+			objs[j] = kmem_cache_alloc(cachep, GFP_KERNEL);
+			if (!objs[j])
+				goto fail;
+		}
+		res->alloc_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		for (j = 0; j < batch; j++)
+			kmem_cache_free(cachep, objs[j]);
+		res->free_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		cond_resched();
+	}
+	return 0;
+
+fail:
+	while (j--)
+		kmem_cache_free(cachep, objs[j]);
+	return -ENOMEM;
+}
+
+static int bench_bulk(struct kmem_cache *cachep, void **objs,
+		      struct bench_result *res)
+{
+	unsigned int i;
+	ktime_t start;
+
+	for (i = 0; i < loops; i++) {
+		start = ktime_get();
+		if (!kmem_cache_alloc_bulk(cachep, GFP_KERNEL, batch, objs))
+			return -ENOMEM;
+		res->alloc_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		kmem_cache_free_bulk(cachep, batch, objs);
+		res->free_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		cond_resched();
+	}
+	return 0;
+}
+
+static int __init slab_bench_size(unsigned int size, void **objs)
+{
+	struct bench_result single = { 0, 0 }, bulk = { 0, 0 };
+	struct kmem_cache *cachep;
+	u64 nr_ops = (u64)loops * batch;
+	int ret;
+
+	cachep = kmem_cache_create("slab_bench", size, 0, 0, NULL);
+	if (!cachep)
+		return -ENOMEM;
+
+	/* warm up the per-cpu array and the slabs behind it */
+	ret = bench_single(cachep, objs, &single);
+	if (!ret) {
+		single.alloc_ns = single.free_ns = 0;
+		ret = bench_single(cachep, objs, &single);
+	}
+	if (!ret)
+		ret = bench_bulk(cachep, objs, &bulk);
+	kmem_cache_destroy(cachep);
+	if (ret)
+		return ret;
+
+	printk(KERN_INFO "slab_bench: %4u bytes: alloc %3llu free %3llu, "
+	       "bulk alloc %3llu free %3llu ns/object\n", size,
+	       div64_u64(single.alloc_ns, nr_ops),
+	       div64_u64(single.free_ns, nr_ops),
+	       div64_u64(bulk.alloc_ns, nr_ops),
+	       div64_u64(bulk.free_ns, nr_ops));
+	return 0;
+}
+
+static int __init slab_bench_init(void)
+{
+	void **objs;
+	int i, ret = 0;
+
+	if (!loops || !batch || batch > MAX_BATCH)
+		return -EINVAL;
+
+	objs = kmalloc(sizeof(*objs) * batch, GFP_KERNEL);
+	if (!objs)
+		return -ENOMEM;
+
+	printk(KERN_INFO "slab_bench: %u rounds of %u objects\n",
+	       loops, batch);
+	for (i = 0; i < ARRAY_SIZE(bench_sizes) && !ret; i++)
+		ret = slab_bench_size(bench_sizes[i], objs);
+
+	kfree(objs);
+	return ret;
+}
+
+static void __exit slab_bench_exit(void)
+{
+}
+
+module_init(slab_bench_init);
+module_exit(slab_bench_exit);
+
+MODULE_LICENSE("GPL");
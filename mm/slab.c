@@ -269,6 +269,7 @@ struct array_cache {
 	unsigned int limit;
 	unsigned int batchcount;
 	unsigned int touched;
+	unsigned int misses;	/* refills and flushes, for autotuning */
 	spinlock_t lock;
 	void *entry[];	/*
 			 * Must have this definition in here for the proper
@@ -389,6 +390,17 @@ static void kmem_list3_init(struct kmem_list3 *parent)
 #define REAPTIMEOUT_CPUC	(2*HZ)
 #define REAPTIMEOUT_LIST3	(4*HZ)
 
+/*
+ * Array cache autotuning: a cache whose per-cpu arrays missed at least
+ * TUNE_GROW_MISSES times within TUNE_INTERVAL gets arrays twice as large,
+ * up to TUNE_MAX_FACTOR times the size enable_cpucache() picked, so that
+ * each trip to the list_lock moves more objects. A cache that went quiet
+ * shrinks back one step per interval.
+ */
+#define TUNE_INTERVAL		(8*HZ)
+#define TUNE_GROW_MISSES	64
+#define TUNE_MAX_FACTOR		4
+
 #if STATS
 #define	STATS_INC_ACTIVE(x)	((x)->num_active++)
 #define	STATS_DEC_ACTIVE(x)	((x)->num_active--)
@@ -898,6 +910,7 @@ static struct array_cache *alloc_arraycache(int node, int entries,
 		nc->limit = entries;
 		nc->batchcount = batchcount;
 		nc->touched = 0;
+		nc->misses = 0;
 		spin_lock_init(&nc->lock);
 	}
 	return nc;
@@ -3100,6 +3113,7 @@ static inline void *____cache_alloc(struct kmem_cache *cachep, gfp_t flags)
 		objp = ac->entry[--ac->avail];
 	} else {
 		STATS_INC_ALLOCMISS(cachep);
+		ac->misses++;
 		objp = cache_alloc_refill(cachep, flags);
 	}
 	/*
@@ -3532,6 +3546,7 @@ static inline void __cache_free(struct kmem_cache *cachep, void *objp)
 		return;
 	} else {
 		STATS_INC_FREEMISS(cachep);
+		ac->misses++;
 		cache_flusharray(cachep, ac);
 		ac->entry[ac->avail++] = objp;
 	}
@@ -3556,6 +3571,63 @@ void *kmem_cache_alloc(struct kmem_cache *cachep, gfp_t flags)
 }
 EXPORT_SYMBOL(kmem_cache_alloc);
 
+/**
+ * kmem_cache_alloc_bulk - Allocate several objects
+ * @cachep: The cache to allocate from.
+ * @flags: See kmalloc().
+ * @size: Number of objects to allocate.
+ * @p: Array the objects are stored in.
+ *
+ * Like @size calls to kmem_cache_alloc(), but interrupts are disabled
+ * only once and the per-cpu array is refilled a batch at a time, so the
+ * list_lock is taken once per batchcount objects at most. Returns @size,
+ * or 0 with nothing allocated if any of the objects could not be.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *cachep, gfp_t flags,
+			  size_t size, void **p)
+{
+	unsigned long save_flags;
+	size_t i, nr;
+
+	flags &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(flags);
+
+	if (slab_should_failslab(cachep, flags))
+		return 0;
+
+	cache_alloc_debugcheck_before(cachep, flags);
+	local_irq_save(save_flags);
+	for (nr = 0; nr < size; nr++) {
+		p[nr] = __do_cache_alloc(cachep, flags);
+		if (unlikely(!p[nr]))
+			break;
+	}
+	local_irq_restore(save_flags);
+
+	for (i = 0; i < nr; i++) {
+		void *objp;
+
+		objp = cache_alloc_debugcheck_after(cachep, flags, p[i],
+					__builtin_return_address(0));
+		kmemleak_alloc_recursive(objp, obj_size(cachep), 1,
+					 cachep->flags, flags);
+		kmemcheck_slab_alloc(cachep, flags, objp, obj_size(cachep));
+		if (unlikely(flags & __GFP_ZERO))
+			memset(objp, 0, obj_size(cachep));
+		trace_kmem_cache_alloc(_RET_IP_, objp, obj_size(cachep),
+				       cachep->buffer_size, flags);
+		p[i] = objp;
+	}
+
+	if (unlikely(nr < size)) {
+		kmem_cache_free_bulk(cachep, nr, p);
+		return 0;
+	}
+	return size;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 #ifdef CONFIG_KMEMTRACE
 void *kmem_cache_alloc_notrace(struct kmem_cache *cachep, gfp_t flags)
 {
@@ -3743,6 +3815,34 @@ void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/**
+ * kmem_cache_free_bulk - Deallocate several objects
+ * @cachep: The cache the allocations were from.
+ * @size: Number of objects.
+ * @p: The previously allocated objects.
+ *
+ * Like @size calls to kmem_cache_free(), with interrupts disabled only
+ * once; a full per-cpu array is flushed a batch at a time.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *cachep, size_t size, void **p)
+{
+	unsigned long flags;
+	size_t i;
+
+	local_irq_save(flags);
+	for (i = 0; i < size; i++) {
+		debug_check_no_locks_freed(p[i], obj_size(cachep));
+		if (!(cachep->flags & SLAB_DEBUG_OBJECTS))
+			debug_check_no_obj_freed(p[i], obj_size(cachep));
+		__cache_free(cachep, p[i]);
+	}
+	local_irq_restore(flags);
+
+	for (i = 0; i < size; i++)
+		trace_kmem_cache_free(_RET_IP_, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
 /**
  * kfree - free previously allocated memory
  * @objp: pointer returned by kmalloc.
@@ -3943,8 +4043,8 @@ static int enable_cpucache(struct kmem_cache *cachep, gfp_t gfp)
 	 * - reduce the number of spinlock operations.
 	 * - reduce the number of linked list operations on the slab and
 	 *   bufctl chains: array operations are cheaper.
-	 * The numbers are guessed, we should auto-tune as described by
-	 * Bonwick.
+	 * The numbers are guessed; busy caches grow from here in
+	 * autotune_cpucache(), much as Bonwick resizes his magazines.
 	 */
 	if (cachep->buffer_size > 131072)
 		limit = 1;
@@ -3982,9 +4082,49 @@ static int enable_cpucache(struct kmem_cache *cachep, gfp_t gfp)
 	if (err)
 		printk(KERN_ERR "enable_cpucache failed for %s, error %d.\n",
 		       cachep->name, -err);
+#if !DEBUG
+	/* debugging keeps the batches short, see above */
+	cachep->auto_limit = limit;
+#endif
 	return err;
 }
 
+/*
+ * Resize the arrays of a cache after the misses of the last TUNE_INTERVAL.
+ * Called from cache_reap() with the cache_chain_mutex held.
+ */
+static void autotune_cpucache(struct kmem_cache *cachep)
+{
+	unsigned int misses = 0, delta;
+	int limit, cpu;
+
+	if (!cachep->auto_limit || time_before(jiffies, cachep->next_tune))
+		return;
+	cachep->next_tune = jiffies + TUNE_INTERVAL;
+
+	for_each_online_cpu(cpu)
+		misses += cachep->array[cpu]->misses;
+	/* a cpu went offline, count from scratch */
+	if (misses < cachep->tune_misses)
+		cachep->tune_misses = 0;
+	delta = misses - cachep->tune_misses;
+	cachep->tune_misses = misses;
+
+	limit = cachep->limit;
+	if (delta >= TUNE_GROW_MISSES)
+		limit = min_t(int, limit * 2,
+			      cachep->auto_limit * TUNE_MAX_FACTOR);
+	else if (!delta)
+		limit = max_t(int, limit / 2, cachep->auto_limit);
+	if (limit == cachep->limit)
+		return;
+
+	/* the new arrays count their misses from zero */
+	if (!do_tune_cpucache(cachep, limit, (limit + 1) / 2,
+			      cachep->shared, GFP_KERNEL))
+		cachep->tune_misses = 0;
+}
+
 /*
  * Drain an array if it contains any elements taking the l3 lock only if
  * necessary. Note that the l3 listlock also protects the array_cache
@@ -4072,6 +4212,7 @@ static void cache_reap(struct work_struct *w)
 			STATS_ADD_REAPED(searchp, freed);
 		}
 next:
+		autotune_cpucache(searchp);
 		cond_resched();
 	}
 	check_irq_on();
@@ -4286,6 +4427,8 @@ ssize_t slabinfo_write(struct file *file, const char __user * buffer,
 				res = do_tune_cpucache(cachep, limit,
 						       batchcount, shared,
 						       GFP_KERNEL);
+				/* the administrator knows better */
+				cachep->auto_limit = 0;
 			}
 			break;
 		}
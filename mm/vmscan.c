@@ -40,6 +40,7 @@
 #include <linux/memcontrol.h>
 #include <linux/delayacct.h>
 #include <linux/sysctl.h>
+#include <linux/cleancache.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -476,6 +477,7 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 		spin_unlock_irq(&mapping->tree_lock);
 		swapcache_free(swap, page);
 	} else {
+		cleancache_put_page(page);
 		__remove_from_page_cache(page);
 		spin_unlock_irq(&mapping->tree_lock);
 		mem_cgroup_uncharge_cache_page(page);
@@ -804,11 +806,6 @@ keep:
 	return nr_reclaimed;
 }
 
-/* LRU Isolation modes. */
-#define ISOLATE_INACTIVE 0	/* Isolate inactive pages. */
-#define ISOLATE_ACTIVE 1	/* Isolate active pages. */
-#define ISOLATE_BOTH 2		/* Isolate both active and inactive pages. */
-
 /*
  * Attempt to remove the specified page from its LRU.  Only take this page
  * if it is of the appropriate PageActive status.  Pages which are being
@@ -1883,8 +1880,22 @@ unsigned long try_to_free_pages(struct zonelist *zonelist, int order,
 		.isolate_pages = isolate_pages_global,
 		.nodemask = nodemask,
 	};
+	unsigned long nr_reclaimed, msecs;
+	ktime_t start = ktime_get();
+	struct timeval tv;
 
-	return do_try_to_free_pages(zonelist, &sc);
+	nr_reclaimed = do_try_to_free_pages(zonelist, &sc);
+
+	/* how long the allocating task was stalled, see /proc/vmstat */
+	tv = ktime_to_timeval(ktime_sub(ktime_get(), start));
+	msecs = tv.tv_sec * MSEC_PER_SEC + tv.tv_usec / USEC_PER_MSEC;
+	count_vm_events(ALLOCSTALL_MS, msecs);
+	if (msecs >= 10)
+		count_vm_event(ALLOCSTALL_10MS);
+	if (msecs >= 100)
+		count_vm_event(ALLOCSTALL_100MS);
+
+	return nr_reclaimed;
 }
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR
@@ -1947,9 +1958,34 @@ unsigned long try_to_free_mem_cgroup_pages(struct mem_cgroup *mem_cont,
 }
 #endif
 
+/*
+ * kswapd reclaims up to the high watermark, plus the boost the page
+ * allocator adds after fragmentation events.
+ */
+static unsigned long kswapd_wmark_pages(struct zone *zone)
+{
+	return high_wmark_pages(zone) + zone->watermark_boost;
+}
+
+static void reset_watermark_boost(pg_data_t *pgdat)
+{
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < pgdat->nr_zones; i++) {
+		struct zone *zone = pgdat->node_zones + i;
+
+		if (!zone->watermark_boost)
+			continue;
+		spin_lock_irqsave(&zone->lock, flags);
+		zone->watermark_boost = 0;
+		spin_unlock_irqrestore(&zone->lock, flags);
+	}
+}
+
 /*
  * For kswapd, balance_pgdat() will work across all this node's zones until
- * they are all at high_wmark_pages(zone).
+ * they are all at kswapd_wmark_pages(zone).
  *
  * Returns the number of pages which were actually freed.
  *
@@ -1996,6 +2032,7 @@ loop_again:
 	total_scanned = 0;
 	sc.nr_reclaimed = 0;
 	sc.may_writepage = !laptop_mode;
+	sc.may_swap = 1;
 	count_vm_event(PAGEOUTRUN);
 
 	for (i = 0; i < pgdat->nr_zones; i++)
@@ -2004,6 +2041,8 @@ loop_again:
 	for (priority = DEF_PRIORITY; priority >= 0; priority--) {
 		int end_zone = 0;	/* Inclusive.  0 = ZONE_DMA */
 		unsigned long lru_pages = 0;
+		unsigned long nr_to_reclaim = 0;
+		int boost_only = 1;
 
 		/* The swap token gets in the way of swapout... */
 		if (!priority)
@@ -2034,7 +2073,7 @@ loop_again:
 							&sc, priority, 0);
 
 			if (!zone_watermark_ok(zone, order,
-					high_wmark_pages(zone), 0, 0)) {
+					kswapd_wmark_pages(zone), 0, 0)) {
 				end_zone = i;
 				break;
 			}
@@ -2046,8 +2085,39 @@ loop_again:
 			struct zone *zone = pgdat->node_zones + i;
 
 			lru_pages += zone_reclaimable_pages(zone);
+			nr_to_reclaim += kswapd_wmark_pages(zone) -
+					 low_wmark_pages(zone);
+			if (populated_zone(zone) &&
+			    !zone_watermark_ok(zone, order,
+					high_wmark_pages(zone), 0, 0))
+				boost_only = 0;
 		}
 
+		/*
+		 * A boost alone is not worth swapping or writing back for:
+		 * take what clean page cache there is and give up on the
+		 * boost rather than scanning harder.
+		 */
+		if (boost_only) {
+			if (priority < DEF_PRIORITY - 2) {
+				reset_watermark_boost(pgdat);
+				all_zones_ok = 1;
+				break;
+			}
+			sc.may_writepage = 0;
+			sc.may_swap = 0;
+		} else if (!sc.may_swap) {
+			sc.may_writepage = !laptop_mode;
+			sc.may_swap = 1;
+		}
+		/*
+		 * Reclaim from the low watermark kswapd was woken at up to
+		 * its target in one go, rather than SWAP_CLUSTER_MAX pages
+		 * at a time with a restart at DEF_PRIORITY in between.
+		 */
+		nr_to_reclaim = max(nr_to_reclaim,
+				    (unsigned long)SWAP_CLUSTER_MAX);
+
 		/*
 		 * Now scan the zone in the dma->highmem direction, stopping
 		 * at the last zone which needs scanning.
@@ -2070,7 +2140,7 @@ loop_again:
 				continue;
 
 			if (!zone_watermark_ok(zone, order,
-					high_wmark_pages(zone), end_zone, 0))
+					kswapd_wmark_pages(zone), end_zone, 0))
 				all_zones_ok = 0;
 			temp_priority[i] = priority;
 			sc.nr_scanned = 0;
@@ -2107,7 +2177,8 @@ loop_again:
 			 * the reclaim ratio is low, start doing writepage
 			 * even in laptop mode
 			 */
-			if (total_scanned > SWAP_CLUSTER_MAX * 2 &&
+			if (!boost_only &&
+			    total_scanned > SWAP_CLUSTER_MAX * 2 &&
 			    total_scanned > sc.nr_reclaimed + sc.nr_reclaimed / 2)
 				sc.may_writepage = 1;
 		}
@@ -2126,7 +2197,7 @@ loop_again:
 		 * matches the direct reclaim path behaviour in terms of impact
 		 * on zone->*_priority.
 		 */
-		if (sc.nr_reclaimed >= SWAP_CLUSTER_MAX)
+		if (sc.nr_reclaimed >= nr_to_reclaim)
 			break;
 	}
 out:
@@ -2159,12 +2230,18 @@ out:
 		 * back to sleep. High-order users can still perform direct
 		 * reclaim if they wish.
 		 */
-		if (sc.nr_reclaimed < SWAP_CLUSTER_MAX)
+		if (sc.nr_reclaimed < SWAP_CLUSTER_MAX) {
 			order = sc.order = 0;
+			/* nor is a boost worth looping for */
+			reset_watermark_boost(pgdat);
+		}
 
 		goto loop_again;
 	}
 
+	/* The boosted watermarks are met, pageblocks had a chance to merge */
+	reset_watermark_boost(pgdat);
+
 	return sc.nr_reclaimed;
 }
 
@@ -2255,7 +2332,8 @@ void wakeup_kswapd(struct zone *zone, int order)
 		return;
 
 	pgdat = zone->zone_pgdat;
-	if (zone_watermark_ok(zone, order, low_wmark_pages(zone), 0, 0))
+	if (!zone->watermark_boost &&
+	    zone_watermark_ok(zone, order, low_wmark_pages(zone), 0, 0))
 		return;
 	if (pgdat->kswapd_max_order < order)
 		pgdat->kswapd_max_order = order;